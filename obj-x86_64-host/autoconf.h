@@ -0,0 +1,36 @@
+// autoconf.h generated from config-host at Sat Oct 17 13:44:45 2026
+
+#ifndef AUTOCONF_H
+#define AUTOCONF_H
+
+#define CONFFILES configs/config-host
+#define CONFIG_ARCH host
+#define CONFIG_BUFFER_COUNT 15
+#define CONFIG_BUFFER_POOL 16
+#define CONFIG_COMMAND_BUFFER_SIZE 250
+#define CONFIG_D64_DIRINDEX 296
+#define CONFIG_D64_ERRORMAP
+#define CONFIG_D64_VALIDATE
+#define CONFIG_DNP_BAM_CACHE
+#define CONFIG_ERROR_BUFFER_SIZE 100
+#define CONFIG_FAT_DIRCACHE 4
+#define CONFIG_FAT_DIRCACHE_ENTRIES 256
+#define CONFIG_FAT_PREALLOC 65536
+#define CONFIG_FAT_STREAM_SIZE 4096
+#define CONFIG_HARDWARE_NAME host
+#define CONFIG_HARDWARE_VARIANT 200
+#define CONFIG_HAVE_IEEE
+#define CONFIG_IMAGE_CACHE 12
+#define CONFIG_IMAGE_FASTSEEK 32
+#define CONFIG_IMAGE_TOOLS
+#define CONFIG_MAX_PARTITIONS 4
+#define CONFIG_MCU x86_64
+#define CONFIG_MCU_FREQ 100000000
+#define CONFIG_NO_SD
+#define CONFIG_P00CACHE
+#define CONFIG_P00CACHE_SIZE 32768
+#define CONFIG_SECTOR_CACHE_DATA 1
+#define CONFIG_SECTOR_CACHE_DIR 2
+#define CONFIG_SECTOR_CACHE_FAT 4
+
+#endif
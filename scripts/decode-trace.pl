@@ -0,0 +1,159 @@
+#!/usr/bin/env perl
+#
+# Decode the binary bus trace from the serial debug output
+#
+#  Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+#
+#  NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; version 2 of the License only.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+# Reads a capture of the UART output of a firmware built with
+# CONFIG_BUS_TRACE from the given files or stdin. Plain text is passed
+# through, trace records (see src/trace.c) are printed as one line each
+# with a timestamp in seconds.
+
+use Getopt::Long;
+use Pod::Usage;
+use strict;
+use warnings;
+use feature ':5.10';
+
+my $RECORD_SIZE = 6;
+my $TICK_USECS  = 10000;        # 100 ticks per second
+
+my $help = 0;
+
+GetOptions(
+    "help" => \$help,
+) or pod2usage(-verbose => 1, -exitval => 2, -noperldoc => 1);
+
+pod2usage(-verbose => 2, -exitval => 0, -noperldoc => 1) if $help;
+
+
+# ----- Events, keep in sync with trace_id_t in src/trace.h -----
+
+my @abort_reasons = ("LLabort", "refill abort", "refill abort2");
+
+my @events = (
+    sub { "trace start, $_[0] subticks per tick" },     # TRACE_START
+    sub { "$_[1] events lost" },                        # TRACE_LOST
+    sub { "idle" },                                     # TRACE_IDLE
+    sub { "IFC" },                                      # TRACE_IFC
+    sub { sprintf "%02X", $_[1] },                      # TRACE_CMD
+    sub { "LSN $_[1]" },                                # TRACE_LSN
+    sub { "TLK $_[1]" },                                # TRACE_TLK
+    sub { "ULN" },                                      # TRACE_ULN
+    sub { "UTK" },                                      # TRACE_UTK
+    sub { "DTA L $_[1]" },                              # TRACE_DTA_L
+    sub { "DTA T $_[1]" },                              # TRACE_DTA_T
+    sub { "OPN $_[1]" },                                # TRACE_OPN
+    sub { "CLO $_[1]" },                                # TRACE_CLO
+    sub { sprintf "UKN %02X", $_[1] },                  # TRACE_UKN
+    sub { "LL $_[1]" . ($_[2] ? " (open)" : "") },      # TRACE_LL
+    sub { ($abort_reasons[$_[2]] // "abort $_[2]") .    # TRACE_LL_ABORT
+              " $_[1]" },
+    sub { "Ignoring data" },                            # TRACE_IGNORE
+    sub { sprintf "T%X %d", $_[1], $_[2] },             # TRACE_TALKLOOP
+    sub { sprintf "RX %02X @%02X", $_[1], $_[2] },      # TRACE_RXDATA
+    sub { sprintf "TX %02X @%02X", $_[1], $_[2] },      # TRACE_TXDATA
+);
+
+
+# ----- Decoder -----
+
+my $period    = 0;              # subticks per tick, from TRACE_START
+my $lasttick  = undef;
+my $tickbase  = 0;
+my $text      = "";
+
+sub flush_text() {
+    print $text if $text ne "";
+    $text = "";
+}
+
+sub timestamp($$) {
+    my ($tick, $subtick) = @_;
+
+    # extend the 8 bit tick counter, assumes at least one
+    # event every 2.56 seconds for exact results
+    $tickbase += 256 if defined $lasttick && $tick < $lasttick;
+    $lasttick = $tick;
+
+    my $usecs = ($tickbase + $tick) * $TICK_USECS;
+    $usecs += int($subtick * $TICK_USECS / $period) if $period;
+    return sprintf "%10.6f", $usecs / 1000000;
+}
+
+sub decode_record(@) {
+    my ($id, $tick, $sublo, $subhi, $arg1, $arg2) = @_;
+    my $subtick = $sublo + 256 * $subhi;
+
+    $id &= 0x7f;
+    if ($id == 0) {
+        $period   = $arg1 + 256 * $arg2;
+        $lasttick = undef;
+        $tickbase = 0;
+    }
+
+    my $ts  = timestamp($tick, $subtick);
+    my $msg = defined $events[$id]
+        ? $events[$id]->($period, $arg1, $arg2)
+        : sprintf("unknown event %d: %02X %02X", $id, $arg1, $arg2);
+
+    flush_text();
+    say "[$ts] $msg";
+}
+
+binmode STDIN;
+binmode STDOUT;
+$/ = \4096;
+
+my @pending;
+while (my $block = <>) {
+    for my $byte (unpack "C*", $block) {
+        if (@pending) {
+            push @pending, $byte;
+            if (@pending == $RECORD_SIZE) {
+                decode_record(@pending);
+                @pending = ();
+            }
+        } elsif ($byte & 0x80) {
+            @pending = ($byte);
+        } elsif ($byte != 13) {
+            $text .= chr $byte;
+            flush_text() if $byte == 10;
+        }
+    }
+}
+flush_text();
+say STDERR "Warning: incomplete trace record at end of input" if @pending;
+
+__END__
+
+=head1 SYNOPSIS
+
+decode-trace.pl [options] [capture...]
+
+=head1 OPTIONS
+
+=over 8
+
+=item B<--help>
+
+prints this help message
+
+=back
+
+=cut
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Standard benchmark run for the host-native build
+#
+#  Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+#
+#  NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; version 2 of the License only.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+# Builds the host configuration, creates a FAT32 image with a few test
+# files and an empty D64 image and runs LOAD/SAVE/directory operations
+# on both, some of them over the simulated IEEE-488 bus. Extra parameters are passed to the benchmark program.
+
+set -e
+
+CONFIG=configs/config-host
+BENCH=obj-x86_64-host/NODISKEMU.elf
+WORKDIR=${WORKDIR:-obj-x86_64-host/bench}
+
+make --no-print-directory CONFIG=$CONFIG
+
+mkdir -p "$WORKDIR"
+head -c 50000  /dev/urandom > "$WORKDIR/small.prg"
+head -c 180000 /dev/urandom > "$WORKDIR/large.prg"
+head -c 174848 /dev/zero    > "$WORKDIR/blank.d64"
+scripts/host/mkfatimg.pl --size 64 "$WORKDIR/card.img" \
+    "$WORKDIR/small.prg" "$WORKDIR/large.prg" "$WORKDIR/blank.d64"
+
+$BENCH "$@" "$WORKDIR/card.img" \
+    -D \
+    -n 3 -l SMALL.PRG -l LARGE.PRG \
+    -n 1 -s FATSAVE.PRG=100000 -l FATSAVE.PRG \
+    -L SMALL.PRG -a 253 -L SMALL.PRG -S BUSSAVE.PRG=20000 -L BUSSAVE.PRG \
+    -c CD:BLANK.D64 -c N:BENCH,01 \
+    -s D64SAVE1=40000 -s D64SAVE2=40000 \
+    -n 3 -l D64SAVE1 -D \
+    -n 1 -L D64SAVE1 -a 253 -L D64SAVE1 \
+    -c S:D64SAVE1 -c CD:_
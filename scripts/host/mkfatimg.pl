@@ -0,0 +1,244 @@
+#!/usr/bin/env perl
+#
+# Create a FAT image for the host-native benchmark build
+#
+#  Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+#
+#  NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; version 2 of the License only.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#
+# The image is an unpartitioned ("superfloppy") FAT16 or FAT32 volume.
+# Files given on the command line are copied into the root directory
+# using contiguous clusters, their names are converted to 8.3 format.
+
+use File::Basename;
+use Getopt::Long;
+use Pod::Usage;
+use strict;
+use warnings;
+use feature ':5.10';
+
+my $SECTOR_SIZE = 512;
+
+my $size_mb = 64;
+my $fattype = 32;
+my $help    = 0;
+
+GetOptions(
+    "size=i" => \$size_mb,
+    "fat=i"  => \$fattype,
+    "help"   => \$help,
+) or pod2usage(-verbose => 1, -exitval => 2, -noperldoc => 1);
+
+pod2usage(-verbose => 2, -exitval => 0, -noperldoc => 1) if $help;
+pod2usage(-verbose => 1, -exitval => 2, -noperldoc => 1) if @ARGV < 1;
+die "FAT type must be 16 or 32\n" unless $fattype == 16 || $fattype == 32;
+
+my $imagename = shift @ARGV;
+my @files     = @ARGV;
+
+my $total_sectors = $size_mb * 1024 * 1024 / $SECTOR_SIZE;
+
+
+# ----- Layout -----
+
+my $reserved     = ($fattype == 32) ? 32 : 1;
+my $root_entries = ($fattype == 32) ? 0  : 512;
+my $root_sectors = $root_entries * 32 / $SECTOR_SIZE;
+my $entry_size   = $fattype / 8;
+
+# smallest cluster size that keeps the cluster count in range for the FAT type
+my $max_clusters = ($fattype == 32) ? 0x0ffffff0 : 65524;
+my $min_clusters = ($fattype == 32) ? 65525      : 4085;
+
+my ($spc, $fat_sectors, $clusters);
+for ($spc = 1; $spc <= 128; $spc *= 2) {
+    $fat_sectors = 1;
+    for (1..3) {
+        $clusters = int(($total_sectors - $reserved - 2 * $fat_sectors - $root_sectors) / $spc);
+        $fat_sectors = int((($clusters + 2) * $entry_size + $SECTOR_SIZE - 1) / $SECTOR_SIZE);
+    }
+    last if $clusters <= $max_clusters;
+}
+
+die "Image size too small for FAT$fattype\n" if $clusters < $min_clusters;
+die "Image size too large for FAT$fattype\n" if $clusters > $max_clusters;
+
+my $fat_start  = $reserved;
+my $root_start = $fat_start + 2 * $fat_sectors;
+my $data_start = $root_start + $root_sectors;
+my $cluster_bytes = $spc * $SECTOR_SIZE;
+
+open my $img, "+>", $imagename or die "Can't create $imagename: $!";
+binmode $img;
+truncate $img, $total_sectors * $SECTOR_SIZE or die "Can't resize $imagename: $!";
+
+sub write_at($$) {
+    my ($offset, $data) = @_;
+
+    sysseek $img, $offset, 0 or die "Seek failed: $!";
+    syswrite $img, $data or die "Write failed: $!";
+}
+
+sub cluster_offset($) {
+    return ($data_start + (shift() - 2) * $spc) * $SECTOR_SIZE;
+}
+
+
+# ----- Cluster allocation, all chains are contiguous -----
+
+my @fat = (($fattype == 32) ? 0x0ffffff8 : 0xfff8,
+           ($fattype == 32) ? 0x0fffffff : 0xffff);
+my $next_cluster = 2;
+
+sub alloc_chain($) {
+    my $count = shift;
+    my $first = $next_cluster;
+
+    return 0 if $count == 0;
+    die "Image full\n" if $first + $count - 2 > $clusters;
+
+    for my $c ($first .. $first + $count - 2) {
+        $fat[$c] = $c + 1;
+    }
+    $fat[$first + $count - 1] = ($fattype == 32) ? 0x0fffffff : 0xffff;
+    $next_cluster += $count;
+    return $first;
+}
+
+
+# ----- Directory entries -----
+
+sub short_name($) {
+    my $name = uc basename(shift);
+    my ($base, $ext) = ($name, "");
+
+    if ($name =~ /^(.*)\.([^.]*)$/) {
+        ($base, $ext) = ($1, $2);
+    }
+    $base =~ s/[^A-Z0-9!#\$%&'()\-\@^_`{}~]/_/g;
+    $ext  =~ s/[^A-Z0-9!#\$%&'()\-\@^_`{}~]/_/g;
+    return sprintf("%-8.8s%-3.3s", $base, $ext);
+}
+
+sub dir_entry($$$$) {
+    my ($name, $attr, $cluster, $size) = @_;
+
+    # 2018-01-01 00:00
+    my $date = ((2018 - 1980) << 9) | (1 << 5) | 1;
+    return pack("a11 C C C v v v v v v v V",
+                $name, $attr, 0, 0, 0, $date, $date,
+                $cluster >> 16, 0, $date, $cluster & 0xffff, $size);
+}
+
+my $rootdir = dir_entry("NODISKEMU  ", 0x08, 0, 0);
+my %used_names;
+
+# allocate the FAT32 root directory first so it gets cluster 2
+my $root_cluster = 0;
+if ($fattype == 32) {
+    my $bytes = (@files + 1) * 32;
+    $root_cluster = alloc_chain(int(($bytes + $cluster_bytes - 1) / $cluster_bytes));
+} elsif (@files + 1 > $root_entries) {
+    die "Too many files for the FAT16 root directory\n";
+}
+
+foreach my $file (@files) {
+    open my $fh, "<", $file or die "Can't open $file: $!";
+    binmode $fh;
+    local $/;
+    my $data = <$fh>;
+    close $fh;
+
+    my $name = short_name($file);
+    die "Duplicate 8.3 name for $file\n" if $used_names{$name}++;
+
+    my $count   = int((length($data) + $cluster_bytes - 1) / $cluster_bytes);
+    my $cluster = alloc_chain($count);
+    write_at(cluster_offset($cluster), $data) if $count;
+    $rootdir .= dir_entry($name, 0x20, $cluster, length($data));
+}
+
+if ($fattype == 32) {
+    write_at(cluster_offset($root_cluster), $rootdir);
+} else {
+    write_at($root_start * $SECTOR_SIZE, $rootdir);
+}
+
+
+# ----- FATs -----
+
+my $fatdata = pack(($fattype == 32) ? "V*" : "v*", map { $_ // 0 } @fat);
+write_at(($fat_start + $_ * $fat_sectors) * $SECTOR_SIZE, $fatdata) for (0, 1);
+
+
+# ----- Boot sector and FSInfo -----
+
+my $boot = pack("C3 a8 v C v C v v C v v v V V",
+                0xeb, 0x58, 0x90, "NODISKEM", $SECTOR_SIZE, $spc, $reserved,
+                2, $root_entries,
+                ($total_sectors < 65536 && $fattype == 16) ? $total_sectors : 0,
+                0xf8,
+                ($fattype == 16) ? $fat_sectors : 0,
+                63, 255, 0,
+                ($total_sectors < 65536 && $fattype == 16) ? 0 : $total_sectors);
+
+if ($fattype == 32) {
+    $boot .= pack("V v v V v v a12 C C C V a11 a8",
+                  $fat_sectors, 0, 0, $root_cluster, 1, 6, "",
+                  0x80, 0, 0x29, 0x12345678, "NODISKEMU  ", "FAT32   ");
+} else {
+    $boot .= pack("C C C V a11 a8",
+                  0x80, 0, 0x29, 0x12345678, "NODISKEMU  ", "FAT16   ");
+}
+$boot .= "\0" x (510 - length($boot)) . "\x55\xaa";
+write_at(0, $boot);
+
+if ($fattype == 32) {
+    my $fsinfo = pack("V", 0x41615252) . ("\0" x 480) .
+                 pack("V V V", 0x61417272, $clusters - ($next_cluster - 2), $next_cluster) .
+                 ("\0" x 12) . pack("V", 0xaa550000);
+    write_at($SECTOR_SIZE, $fsinfo);
+    write_at(6 * $SECTOR_SIZE, $boot);
+    write_at(7 * $SECTOR_SIZE, $fsinfo);
+}
+
+close $img;
+
+__END__
+
+=head1 SYNOPSIS
+
+mkfatimg.pl [options] image [file...]
+
+=head1 OPTIONS
+
+=over 8
+
+=item B<--help>
+
+prints this help message
+
+=item B<--size>
+
+size of the image in MiB (default 64)
+
+=item B<--fat>
+
+FAT type, 16 or 32 (default 32)
+
+=back
+
+=cut
@@ -0,0 +1,14 @@
+# architecture-dependent additional targets and manual dependencies
+
+# Run the benchmark driver against a FAT image,
+# e.g. "make CONFIG=configs/config-host bench IMAGE=card.img"
+IMAGE ?= card.img
+BENCHFLAGS ?=
+
+bench: elf
+	$(Q)$(TARGET).elf $(BENCHFLAGS) $(IMAGE)
+
+program:
+	@echo "The host build can't be programmed, use the bench target instead"
+
+.PHONY: bench
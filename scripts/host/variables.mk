@@ -0,0 +1,27 @@
+# architecture-dependent variables
+
+#---------------- Source code ----------------
+# The host build has no bus hardware, main() is provided by the
+# benchmark driver instead. ieee.c runs against the simulated bus
+# in host/ieeebus.c.
+SRC := $(filter-out main.c diagnose.c host/spi.c,$(SRC))
+SRC += host/memdisk.c host/bench.c host/arch-eeprom.c host/ieeebus.c
+
+ASMSRC =
+
+#---------------- Toolchain ----------------
+CC = gcc
+OBJCOPY = objcopy
+OBJDUMP = objdump
+SIZE = size
+NM = nm
+
+
+#---------------- Architecture variables ----------------
+# -O2 instead of the size-optimized firmware build so the numbers
+# reflect the algorithms and not the compiler's size tricks
+OPT = 2
+# Same char/bitfield/enum semantics as the AVR firmware
+ARCH_CFLAGS  = -funsigned-char -funsigned-bitfields -fshort-enums -fno-common
+ARCH_ASFLAGS =
+ARCH_LDFLAGS =
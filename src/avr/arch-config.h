@@ -1650,6 +1650,16 @@ static inline uint8_t display_intrq_active(void) {
 #  define P00CACHE_ATTRIB
 #endif
 
+/* DNP BAM cache is in bss by default */
+#ifndef BAMCACHE_ATTRIB
+#  define BAMCACHE_ATTRIB
+#endif
+
+/* FAT directory cache is in bss by default */
+#ifndef DIRCACHE_ATTRIB
+#  define DIRCACHE_ATTRIB
+#endif
+
 /* -- ensure that the timing for Dolphin is achievable        -- */
 /* the C64 will switch to an alternate, not-implemented protocol */
 /* if the answer to the XQ/XZ commands is too late and the       */
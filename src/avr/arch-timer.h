@@ -61,4 +61,21 @@ static inline uint8_t has_timed_out(void) {
   return TIFR0 & _BV(TOV0);
 }
 
+/**
+ * timer_subticks - returns the position within the current tick
+ *
+ * Timer 1 generates the tick interrupt and restarts on every tick,
+ * so its counter is a fine timestamp in units of 64 clock cycles.
+ */
+static inline uint16_t timer_subticks(void) {
+  return TCNT1;
+}
+
+/**
+ * timer_subticks_per_tick - returns the number of subticks in a tick
+ */
+static inline uint16_t timer_subticks_per_tick(void) {
+  return OCR1A + 1;
+}
+
 #endif
@@ -130,6 +130,10 @@ void uart_flush(void) {
   while (read_idx != write_idx) ;
 }
 
+unsigned int uart_txfree(void) {
+  return (read_idx - write_idx - 1) & (sizeof(txbuf)-1);
+}
+
 void uart_puts_P(const char *text) {
   uint8_t ch;
 
@@ -36,15 +36,155 @@
 dh_t    matchdh;
 uint8_t ops_scratch[33];
 
+#ifdef CONFIG_BUFFER_POOL
+/* The pool buffers follow the error buffer. They are only lent to */
+/* caches, their data is carved from the arena of the architecture  */
+#  define POOL_FIRST   (CONFIG_BUFFER_COUNT+1)
+#  define BUFFER_SLOTS (CONFIG_BUFFER_COUNT+1+CONFIG_BUFFER_POOL)
+
+/* Number of free regular buffers that are never lent */
+#  define LEND_RESERVE 2
+
+#  ifndef BUFFER_POOL_START
+#    error "CONFIG_BUFFER_POOL needs an arena, which this architecture lacks"
+#  endif
+
+#  if BUFFER_SLOTS > 254
+#    error "CONFIG_BUFFER_COUNT + CONFIG_BUFFER_POOL is too large"
+#  endif
+
+/// Number of pool buffers that have a data area
+static uint8_t pool_size;
+#else
+#  define BUFFER_SLOTS (CONFIG_BUFFER_COUNT+1)
+#endif
+
 /// One additional buffer structure for channel 15
-buffer_t buffers[CONFIG_BUFFER_COUNT+1];
+buffer_t buffers[BUFFER_SLOTS];
 
 /// The actual data buffers
 static uint8_t bufferdata[CONFIG_BUFFER_COUNT*256];
 
+/* Return value of find_free_run if there is none */
+#define NO_RUN 0xff
+
 /// Number of active data buffers + 16 * number of dirty buffers
 uint8_t active_buffers;
 
+/* Index for find_buffer: secondary addresses 0-15 followed by the */
+/* aliases BUFFER_SEC_CHAIN..BUFFER_SEC_CHAIN-14 of chained buffers */
+#define INDEX_CHAIN_SLOT 16
+#define INDEX_SLOTS      (INDEX_CHAIN_SLOT + 15)
+#define INDEX_NONE       0xff
+
+/// Lowest numbered allocated buffer for each secondary address
+static uint8_t secondary_index[INDEX_SLOTS];
+
+/**
+ * index_slot - get the index slot of a secondary address
+ * @secondary: secondary address
+ *
+ * This function returns the slot in secondary_index that is used for
+ * the given secondary address or INDEX_NONE if the address is not
+ * indexed. System buffers are rare and are not indexed.
+ */
+static uint8_t index_slot(uint8_t secondary) {
+  if (secondary < 16)
+    return secondary;
+  if (secondary <= BUFFER_SEC_CHAIN && secondary >= BUFFER_SEC_CHAIN - 14)
+    return INDEX_CHAIN_SLOT + BUFFER_SEC_CHAIN - secondary;
+  return INDEX_NONE;
+}
+
+/**
+ * index_add - add a buffer to the secondary address index
+ * @buf: pointer to the buffer
+ *
+ * The index keeps the buffer with the lowest number if more than one
+ * buffer uses the same secondary address, which is the one a linear
+ * search would find first.
+ */
+static void index_add(buffer_t *buf) {
+  uint8_t slot = index_slot(buf->secondary);
+  uint8_t num  = buf - buffers;
+
+  /* INDEX_NONE is larger than any buffer number */
+  if (slot != INDEX_NONE && num < secondary_index[slot])
+    secondary_index[slot] = num;
+}
+
+/**
+ * index_remove - remove a buffer from the secondary address index
+ * @buf: pointer to the buffer
+ *
+ * If the buffer is in the index, this function replaces it with the
+ * next allocated buffer that has the same secondary address.
+ */
+static void index_remove(buffer_t *buf) {
+  uint8_t slot = index_slot(buf->secondary);
+  uint8_t num  = buf - buffers;
+  uint8_t i;
+
+  if (slot == INDEX_NONE || secondary_index[slot] != num)
+    return;
+
+  secondary_index[slot] = INDEX_NONE;
+  for (i=num+1;i<CONFIG_BUFFER_COUNT+1;i++) {
+    if (buffers[i].allocated && buffers[i].secondary == buf->secondary) {
+      secondary_index[slot] = i;
+      break;
+    }
+  }
+}
+
+/**
+ * find_free_run - find adjacent free buffers
+ * @first: number of the first buffer to check
+ * @end  : number of the buffer after the last one to check
+ * @count: number of buffers required
+ *
+ * This function returns the number of the first buffer of @count
+ * adjacent free buffers in the range [@first, @end) or NO_RUN if
+ * there are none. Adjacent buffers have continuous data segments.
+ */
+static uint8_t find_free_run(uint8_t first, uint8_t end, uint8_t count) {
+  uint8_t i, freebufs = 0;
+
+  for (i=first;i<end;i++) {
+    if (buffers[i].allocated)
+      freebufs = 0;
+    else if (++freebufs == count)
+      return i + 1 - count;
+  }
+
+  return NO_RUN;
+}
+
+#ifdef CONFIG_BUFFER_POOL
+/**
+ * reclaim_buffer - take a lent buffer back from a cache
+ *
+ * This function asks the borrowers of regular buffers to give them
+ * back until one of them did. Returns true if a buffer was freed,
+ * false if all borrowers still need their buffers.
+ */
+static bool reclaim_buffer(void) {
+  uint8_t i;
+
+  for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
+    if (buffers[i].allocated && buffers[i].reclaim != NULL) {
+      buffers[i].reclaim(&buffers[i]);
+      if (!buffers[i].allocated)
+        return true;
+    }
+  }
+
+  return false;
+}
+#else
+#  define reclaim_buffer() false
+#endif
+
 /**
  * callback_dummy - dummy function for the buffer callbacks
  * @buf: pointer to a buffer
@@ -77,6 +217,21 @@ void buffers_init(void) {
   buffers[ERRORBUFFER_IDX].sendeoi   = 1;
   buffers[ERRORBUFFER_IDX].refill    = set_ok_message;
   buffers[ERRORBUFFER_IDX].cleanup   = callback_dummy;
+
+  memset(secondary_index, INDEX_NONE, sizeof(secondary_index));
+  index_add(&buffers[ERRORBUFFER_IDX]);
+
+#ifdef CONFIG_BUFFER_POOL
+  /* Use as much of the arena as there are pool buffers */
+  uint8_t *arena = BUFFER_POOL_START;
+
+  for (pool_size=0;pool_size<CONFIG_BUFFER_POOL;pool_size++) {
+    if (BUFFER_POOL_END - arena < 256)
+      break;
+    buffers[POOL_FIRST+pool_size].data = arena;
+    arena += 256;
+  }
+#endif
 }
 
 /**
@@ -105,12 +260,14 @@ static void alloc_specific_buffer(uint8_t bufnum) {
 buffer_t *alloc_system_buffer(void) {
   uint8_t i;
 
-  for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
-    if (!buffers[i].allocated) {
-      alloc_specific_buffer(i);
-      return &buffers[i];
+  do {
+    for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
+      if (!buffers[i].allocated) {
+        alloc_specific_buffer(i);
+        return &buffers[i];
+      }
     }
-  }
+  } while (reclaim_buffer());
 
   set_error(ERROR_NO_CHANNEL);
   return NULL;
@@ -126,7 +283,7 @@ buffer_t *alloc_system_buffer(void) {
 buffer_t *alloc_buffer(void) {
   buffer_t *buf = alloc_system_buffer();
   if (buf != NULL) {
-    buf->secondary = 0;
+    set_buffer_secondary(buf, 0);
     active_buffers++;
     set_busy_led(1);
   }
@@ -135,56 +292,129 @@ buffer_t *alloc_buffer(void) {
 
 /**
  * alloc_linked_buffers - allocates linked buffers
- * @count    : Number of buffers to allocate
+ * @count     : Number of buffers to allocate
+ * @contiguous: Flags if the data segments must be continuous
  *
  * This function allocates count buffers, marks them as used and
  * links them. It will also turn on the busy LED to notify the user.
  * Returns a pointer to the first buffer structure or NULL if
  * not enough buffers are free. The data segments of the allocated
- * buffers are guaranteed to be continuous.
+ * buffers are continuous if there are enough adjacent free buffers,
+ * otherwise the chain is built from any free buffers unless
+ * @contiguous is set.
  */
-buffer_t *alloc_linked_buffers(uint8_t count) {
+buffer_t *alloc_linked_buffers(uint8_t count, bool contiguous) {
   uint8_t i,freebufs,start;
+  buffer_t *first,*prev;
 
-  freebufs = 0;
-  start    = 0;
-  for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
-    if (buffers[i].allocated) {
-      /* Look for continuous buffers */
-      /* Switching data segments is possible, but probably not required */
+  while (1) {
+    start = find_free_run(0, CONFIG_BUFFER_COUNT, count);
+    if (start != NO_RUN)
+      break;
+
+    if (!contiguous) {
       freebufs = 0;
-    } else {
-      if (freebufs == 0)
-        start = i;
-      freebufs++;
-      /* Found enough free space */
-      if (freebufs == count)
+      for (i=0;i<CONFIG_BUFFER_COUNT;i++)
+        if (!buffers[i].allocated)
+          freebufs++;
+
+      if (freebufs >= count) {
+        start = 0;
         break;
+      }
     }
-  }
 
-  if (freebufs < count) {
-    set_error(ERROR_NO_CHANNEL);
-    return NULL;
+    if (!reclaim_buffer()) {
+      set_error(ERROR_NO_CHANNEL);
+      return NULL;
+    }
   }
 
-  /* Chain the buffers */
-  for (i=0;i<count;i++) {
-    alloc_specific_buffer(start+i);
+  /* Chain the buffers, the first count free ones from start */
+  first = NULL;
+  prev  = NULL;
+  for (i=start,freebufs=0;freebufs<count;i++) {
+    if (buffers[i].allocated)
+      continue;
+
+    alloc_specific_buffer(i);
     active_buffers++;
-    buffers[start+i].secondary = 0;
-    buffers[start+i].pvt.buffer.next  = &buffers[start+i+1];
-    buffers[start+i].pvt.buffer.first = &buffers[start];
-    buffers[start+i].pvt.buffer.size  = count;
+    set_buffer_secondary(&buffers[i], 0);
+    if (first == NULL)
+      first = &buffers[i];
+    else
+      prev->pvt.buffer.next = &buffers[i];
+
+    buffers[i].pvt.buffer.first = first;
+    buffers[i].pvt.buffer.size  = count;
+    prev = &buffers[i];
+    freebufs++;
   }
 
   set_busy_led(1);
 
-  buffers[start+count-1].pvt.buffer.next = NULL;
+  prev->pvt.buffer.next = NULL;
+
+  return first;
+}
+
+#ifdef CONFIG_BUFFER_POOL
+/**
+ * lend_buffers - lend idle buffers to a cache
+ * @count  : Number of buffers to lend
+ * @reclaim: Callback to ask for the buffers back
+ *
+ * This function allocates @count adjacent buffers with continuous
+ * data segments for use as cache memory, preferring the pool buffers.
+ * Regular buffers are only lent while LEND_RESERVE of them stay free.
+ * When a regular buffer is needed and none is free, @reclaim is called
+ * with the first lent buffer and should give the buffers back using
+ * return_buffers, unless their contents are still in use.
+ * Returns a pointer to the first buffer or NULL if not enough buffers
+ * are idle. No error is set in that case, a cache just stays smaller.
+ */
+buffer_t *lend_buffers(uint8_t count, void (*reclaim)(buffer_t *buf)) {
+  uint8_t i,freebufs,start;
+
+  start = find_free_run(POOL_FIRST, POOL_FIRST + pool_size, count);
+  if (start == NO_RUN) {
+    freebufs = 0;
+    for (i=0;i<CONFIG_BUFFER_COUNT;i++)
+      if (!buffers[i].allocated)
+        freebufs++;
+
+    if (freebufs < count + LEND_RESERVE)
+      return NULL;
+
+    start = find_free_run(0, CONFIG_BUFFER_COUNT, count);
+    if (start == NO_RUN)
+      return NULL;
+  }
+
+  for (i=start;i<start+count;i++) {
+    alloc_specific_buffer(i);
+    buffers[i].lent = 1;
+  }
+
+  /* The first buffer stands for all of them */
+  buffers[start].reclaim = reclaim;
 
   return &buffers[start];
 }
 
+/**
+ * return_buffers - give lent buffers back
+ * @buf  : pointer to the first lent buffer
+ * @count: number of buffers that were lent
+ *
+ * This function deallocates buffers obtained from lend_buffers.
+ */
+void return_buffers(buffer_t *buf, uint8_t count) {
+  while (count--)
+    free_buffer(buf++);
+}
+#endif
+
 /**
  * cleanup_and_free_buffer - cleanup and deallocate a buffer
  * @buffer: pointer to the buffer structure to cleanup and mark as free
@@ -212,6 +442,7 @@ void free_buffer(buffer_t *buffer) {
   if (!buffer->allocated) return;
 
   buffer->allocated = 0;
+  index_remove(buffer);
 
   if (buffer->dirty)
     active_buffers -= 16;
@@ -230,7 +461,7 @@ void free_buffer(buffer_t *buffer) {
  * also call the cleanup function for those buffers which are about to be
  * freed. When FMB_CLEAN is set, the function returns 0 if all cleanup
  * functions returned 0 or 1 if at least one did not. When FMB_CLEAN is not
- * set, returns 0.
+ * set, returns 0. Buffers lent to caches are never freed here.
  */
 uint8_t free_multiple_buffers(uint8_t flags) {
   uint8_t i,res;
@@ -238,7 +469,8 @@ uint8_t free_multiple_buffers(uint8_t flags) {
   res = 0;
 
   for (i=0;i<CONFIG_BUFFER_COUNT;i++) {
-    if (buffers[i].allocated) {
+    /* Lent buffers are managed by their cache */
+    if (buffers[i].allocated && !buffers[i].lent) {
       if ((flags & FMB_FREE_SYSTEM) || buffers[i].secondary < BUFFER_SEC_SYSTEM) {
         if ((flags & FMB_FREE_STICKY) || !buffers[i].sticky) {
           if (flags & FMB_CLEAN) {
@@ -253,18 +485,40 @@ uint8_t free_multiple_buffers(uint8_t flags) {
   return res;
 }
 
+/**
+ * set_buffer_secondary - change the secondary address of a buffer
+ * @buf      : pointer to the buffer, must be allocated
+ * @secondary: new secondary address
+ *
+ * This function sets the secondary address of the buffer and updates
+ * the index used by find_buffer. The secondary field of an allocated
+ * buffer must not be changed in any other way.
+ */
+void set_buffer_secondary(buffer_t *buf, uint8_t secondary) {
+  index_remove(buf);
+  buf->secondary = secondary;
+  index_add(buf);
+}
+
 /**
  * find_buffer - find the buffer corresponding to a secondary address
  * @secondary: secondary address to look for
  *
  * This function returns a pointer to the first buffer structure whose
  * secondary address is the same as the one given. Returns NULL if
- * no matching buffer was found.
+ * no matching buffer was found. Secondary addresses 0-15 and chain
+ * aliases are looked up in the index, so the bus code can call this
+ * after every refill without scanning all buffers.
  */
 buffer_t *find_buffer(uint8_t secondary) {
-  uint8_t i;
+  uint8_t i = index_slot(secondary);
+
+  if (i != INDEX_NONE) {
+    i = secondary_index[i];
+    return i == INDEX_NONE ? NULL : &buffers[i];
+  }
 
-  for (i=0;i<CONFIG_BUFFER_COUNT+1;i++) {
+  for (i=0;i<BUFFER_SLOTS;i++) {
     if (buffers[i].allocated && buffers[i].secondary == secondary)
       return &buffers[i];
   }
@@ -27,6 +27,7 @@
 #ifndef BUFFERS_H
 #define BUFFERS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "dirent.h"
 
@@ -63,7 +64,8 @@ typedef enum { DIR_FMT_CBM, DIR_FMT_CMD_SHORT, DIR_FMT_CMD_LONG } dirformat_t;
  * @data     : Pointer to the data area of the buffer, MUST be the first field
  * @lastused : Index to the last used byted
  * @position : Index of the byte that will be read/written next
- * @seconday : Secondary address the buffer is associated with
+ * @seconday : Secondary address the buffer is associated with,
+ *             change it with set_buffer_secondary only
  * @recordlen: Record length, if buffer points to a REL file
  * @allocated: Flags if the buffer is allocated or not
  * @mustflush: Flags if the buffer must be flushed before adding characters
@@ -71,8 +73,10 @@ typedef enum { DIR_FMT_CBM, DIR_FMT_CMD_SHORT, DIR_FMT_CMD_LONG } dirformat_t;
  * @write    : Flags if the buffer was opened for writing
  * @sendeoi  : Flags if the last byte should be sent with EOI
  * @sticky   : Flags if the buffer will survive garbage collection
+ * @lent     : Flags if the buffer is lent to a cache (see lend_buffers)
  * @refill   : Callback to refill/write out the buffer, returns true on error
  * @cleanup  : Callback to clean up and save remaining data, returns true on error
+ * @reclaim  : Callback that asks the cache to give a lent buffer back
  *
  * Most allocated buffers point into the same bufferdata array, but
  * the error channel uses the same structure to avoid special-casing it
@@ -96,9 +100,13 @@ typedef struct buffer_s {
   int     dirty:1;
   int     sendeoi:1;
   int     sticky:1;
+  int     lent:1;
   uint8_t (*seek) (struct buffer_s *buffer, uint32_t position, uint8_t index);
   uint8_t (*refill)(struct buffer_s *buffer);
   uint8_t (*cleanup)(struct buffer_s *buffer);
+#ifdef CONFIG_BUFFER_POOL
+  void    (*reclaim)(struct buffer_s *buffer);
+#endif
 
   /* private: */
   union {
@@ -153,8 +161,17 @@ buffer_t *alloc_system_buffer(void);
 buffer_t *alloc_buffer(void);
 
 /* Allocates linked buffers - returns pointer to first buffer or NULL if failure */
-/* Buffers are guranteed to have continuous data segments. */
-buffer_t *alloc_linked_buffers(uint8_t count);
+/* Buffers have continuous data segments if possible or if @contiguous is set. */
+buffer_t *alloc_linked_buffers(uint8_t count, bool contiguous);
+
+#ifdef CONFIG_BUFFER_POOL
+/* Lends buffers with continuous data segments to a cache */
+/* Returns pointer to first buffer or NULL if none are idle */
+buffer_t *lend_buffers(uint8_t count, void (*reclaim)(buffer_t *buf));
+
+/* Gives lent buffers back */
+void return_buffers(buffer_t *buf, uint8_t count);
+#endif
 
 /* Call the cleanup function and deallocate a buffer */
 void cleanup_and_free_buffer(buffer_t *buffer);
@@ -175,6 +192,9 @@ static void inline unstick_buffer(buffer_t *buf) {
   buf->sticky = 0;
 }
 
+/* Changes the secondary address of an allocated buffer */
+void set_buffer_secondary(buffer_t *buf, uint8_t secondary);
+
 /* Finds the buffer corresponding to a secondary address */
 /* Returns pointer to buffer on success or NULL on failure */
 buffer_t *find_buffer(uint8_t secondary);
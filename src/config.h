@@ -95,6 +95,10 @@ static inline void late_board_init(void) {
 #  error "CONFIG_LOADER_GEOS must be enabled for Wheels support!"
 #endif
 
+#if defined(CONFIG_BUS_TRACE) && !defined(CONFIG_UART_DEBUG)
+#  error "CONFIG_UART_DEBUG must be enabled for the bus trace!"
+#endif
+
 #if defined(CONFIG_PARALLEL_DOLPHIN)
 #  if !defined(HAVE_PARALLEL)
 #    error "CONFIG_PARALLEL_DOLPHIN enabled on a hardware without parallel port!"
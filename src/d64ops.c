@@ -33,9 +33,11 @@
 #include "errormsg.h"
 #include "fatops.h"
 #include "ff.h"
+#include "imagecache.h"
 #include "parser.h"
 #include "progmem.h"
 #include "rtc.h"
+#include "timer.h"
 #include "ustring.h"
 #include "wrapops.h"
 #include "d64ops.h"
@@ -88,20 +90,71 @@
 #define D80_BAM_BYTES_PER_TRACK 5
 #define D80_BAM_BITFIELD_BYTES  4
 
+typedef enum { BAM_BITFIELD, BAM_FREECOUNT } bamdata_t;
+
+#ifdef CONFIG_D64_ERRORMAP
 /* used for error info only */
-#define MAX_SECTORS_PER_TRACK 40
+#define MAX_ERROR_SECTORS 4166  // D82
 
-typedef enum { BAM_BITFIELD, BAM_FREECOUNT } bamdata_t;
+/* one bit per sector of the last image with error info that was read, */
+/* set if its error code isn't "OK". There is one map for all partitions. */
+static struct {
+  uint8_t part;
+  uint8_t map[(MAX_ERROR_SECTORS + 7) / 8];
+} errormap;
+#else
+/* used for error info only */
+#define MAX_SECTORS_PER_TRACK 40
 
 struct {
   uint8_t part;
   uint8_t track;
   uint8_t errors[MAX_SECTORS_PER_TRACK];
 } errorcache;
+#endif
 
 static buffer_t *bam_buffer;  // recently-used buffer
 static buffer_t *bam_buffer2; // secondary buffer
 static uint8_t   bam_refcount;
+static uint8_t  *bam_window;  // BAM sector selected by move_bam_window
+
+#ifdef CONFIG_DNP_BAM_CACHE
+#define DNP_BAM_SECTORS 32
+
+/* All BAM sectors of one DNP image and the free sectors of each track */
+static BAMCACHE_ATTRIB struct {
+  uint8_t  data[DNP_BAM_SECTORS][256];
+  uint16_t free[256];
+} dnpbam;
+
+static uint32_t dnpbam_dirty;       // one bit per BAM sector
+static uint8_t  dnpbam_part = 255;  // partition of the cached BAM
+static int8_t   dnpbam_window = -1; // BAM sector in bam_window, -1 if it is bam_buffer
+#endif
+
+#ifdef CONFIG_D64_DIRINDEX
+#define DIRINDEX_BUCKETS 32
+#define DIRINDEX_END     0xffff
+
+/* Name hashes of the entries of one image directory in directory order */
+static struct {
+  uint8_t  part;        // partition of the indexed directory, 255 if unused
+  uint8_t  track;       // first sector of the indexed directory
+  uint8_t  sector;
+  uint8_t  valid;       // 0 if the directory did not fit into the index
+  uint16_t cursor;      // entry returned by the last lookup
+  uint16_t head[DIRINDEX_BUCKETS];
+  struct {
+    struct d64dh dh;
+    uint16_t hash;
+    uint16_t next;
+  } entry[CONFIG_D64_DIRINDEX];
+} dirindex;  // part is set to 255 by d64_invalidate at startup
+
+# define dirindex_drop() dirindex.part = 255
+#else
+# define dirindex_drop() do {} while (0)
+#endif
 
 /* ------------------------------------------------------------------------- */
 /*  Forward declarations                                                     */
@@ -120,28 +173,68 @@ static void format_dnp_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
 /*  Utility functions                                                        */
 /* ------------------------------------------------------------------------- */
 
+/* First LBA of every track on one side of the disk, the entry behind  */
+/* the last track is the total number of sectors on that side. The D41 */
+/* table covers the 40 and 42 track extensions too.                    */
+static const PROGMEM uint16_t d41_track_lba[] = {
+     0,   21,   42,   63,   84,  105,  126,  147,  168,  189,
+   210,  231,  252,  273,  294,  315,  336,  357,  376,  395,
+   414,  433,  452,  471,  490,  508,  526,  544,  562,  580,
+   598,  615,  632,  649,  666,  683,  700,  717,  734,  751,
+   768,  785,  802
+};
+
+static const PROGMEM uint16_t d80_track_lba[] = {
+     0,   29,   58,   87,  116,  145,  174,  203,  232,  261,
+   290,  319,  348,  377,  406,  435,  464,  493,  522,  551,
+   580,  609,  638,  667,  696,  725,  754,  783,  812,  841,
+   870,  899,  928,  957,  986, 1015, 1044, 1073, 1102, 1131,
+  1158, 1185, 1212, 1239, 1266, 1293, 1320, 1347, 1374, 1401,
+  1428, 1455, 1482, 1509, 1534, 1559, 1584, 1609, 1634, 1659,
+  1684, 1709, 1734, 1759, 1784, 1807, 1830, 1853, 1876, 1899,
+  1922, 1945, 1968, 1991, 2014, 2037, 2060, 2083
+};
+
+static const PROGMEM uint16_t d81_track_lba[] = {
+     0,   40,   80,  120,  160,  200,  240,  280,  320,  360,
+   400,  440,  480,  520,  560,  600,  640,  680,  720,  760,
+   800,  840,  880,  920,  960, 1000, 1040, 1080, 1120, 1160,
+  1200, 1240, 1280, 1320, 1360, 1400, 1440, 1480, 1520, 1560,
+  1600, 1640, 1680, 1720, 1760, 1800, 1840, 1880, 1920, 1960,
+  2000, 2040, 2080, 2120, 2160, 2200, 2240, 2280, 2320, 2360,
+  2400, 2440, 2480, 2520, 2560, 2600, 2640, 2680, 2720, 2760,
+  2800, 2840, 2880, 2920, 2960, 3000, 3040, 3080, 3120, 3160,
+  3200
+};
+
 static const PROGMEM struct param_s d41param = {
-  18, 1, 35, 0x90, 0xa2, 10, 3, format_d41_image
+  18, 1, 35, 0x90, 0xa2, 10, 3, format_d41_image,
+  d41_track_lba, 255, 0
 };
 
 static const PROGMEM struct param_s d71param = {
-  18, 1, 70, 0x90, 0xa2, 6, 3, format_d71_image
+  18, 1, 70, 0x90, 0xa2, 6, 3, format_d71_image,
+  d41_track_lba, 35, 683
 };
 
 static const PROGMEM struct param_s d81param = {
-  40, 3, 80, 0x04, 0x16, 1, 1, format_d81_image
+  40, 3, 80, 0x04, 0x16, 1, 1, format_d81_image,
+  d81_track_lba, 255, 0
 };
 
 static const PROGMEM struct param_s dnpparam = {
-  1, 1, 0, DNP_LABEL_OFFSET, DNP_ID_OFFSET, 1, 1, format_dnp_image
+  1, 1, 0, DNP_LABEL_OFFSET, DNP_ID_OFFSET, 1, 1, format_dnp_image,
+  NULL, 255, 0
 };
 
 static const PROGMEM struct param_s d80param = {
-  39, 1, 77, 6, 0x18, 5, 3, format_d80_image
+  39, 1, 77, 6, 0x18, 5, 3, format_d80_image,
+  d80_track_lba, 255, 0
 };
 
 static const PROGMEM struct param_s d82param = {
-  39, 1, 154, 6, 0x18, 5, 3, format_d82_image
+  39, 1, 154, 6, 0x18, 5, 3, format_d82_image,
+  d80_track_lba, 77, 2083
 };
 
 
@@ -163,50 +256,24 @@ static uint8_t get_param(uint8_t part, param_t param) {
  * @track : Track number
  * @sector: Sector number
  *
- * Calculates an LBA-style sector number for a given track/sector pair.
+ * Calculates an LBA-style sector number for a given track/sector pair
+ * using the track table selected when the image was mounted.
  */
-/* This version used the least code of all tested variants. */
 static uint16_t sector_lba(uint8_t part, uint8_t track, const uint8_t sector) {
+  struct param_s *param = &partition[part].d64data;
   uint16_t offset = 0;
 
   track--; /* Track numbers are 1-based */
 
-  switch (partition[part].imagetype & D64_TYPE_MASK) {
-  case D64_TYPE_D41:
-  case D64_TYPE_D71:
-  default:
-    if (track >= 35) {
-      offset = 683;
-      track -= 35;
-    }
-    if (track < 17)
-      return track*21 + sector + offset;
-    if (track < 24)
-      return 17*21 + (track-17)*19 + sector + offset;
-    if (track < 30)
-      return 17*21 + 7*19 + (track-24)*18 + sector + offset;
-    return 17*21 + 7*19 + 6*18 + (track-30)*17 + sector + offset;
-
-  case D64_TYPE_D81:
-    return track*40 + sector;
-
-  case D64_TYPE_DNP:
-    return track*256 + sector;
+  if (param->track_lba == NULL)
+    return ((uint16_t)track << 8) + sector;
 
-  case D64_TYPE_D80:
-  case D64_TYPE_D82:
-    if (track >= 78) {
-      offset = 2083;
-      track -= 77;
-    }
-    if (track < 39)
-      return track*29 + sector + offset;
-    if (track < 53)
-      return 39*29 + (track-39)*27 + sector + offset;
-    if (track < 64)
-      return 39*29 + 14*27 + (track-53)*25 + sector + offset;
-    return 39*29 + 14*27 + 11*25 + (track-64) + sector + offset;
+  if (track >= param->side_tracks) {
+    offset = param->side_lba;
+    track -= param->side_tracks;
   }
+
+  return offset + pgm_read_word(param->track_lba + track) + sector;
 }
 
 /**
@@ -230,40 +297,153 @@ static uint32_t sector_offset(uint8_t part, uint8_t track, const uint8_t sector)
  * of a 1541/71/81 disk. Invalid track numbers will return invalid results.
  */
 static uint16_t sectors_per_track(uint8_t part, uint8_t track) {
+  struct param_s *param = &partition[part].d64data;
+
+  if (param->track_lba == NULL)
+    return 256;
+
+  track--;
+  if (track >= param->side_tracks)
+    track -= param->side_tracks;
+
+  return pgm_read_word(param->track_lba + track + 1) -
+         pgm_read_word(param->track_lba + track);
+}
+
+/**
+ * error_offset - return the offset of the error info in an image
+ * @part: partition number
+ *
+ * This function returns the offset of the error info block in
+ * the image mounted on partition @part or 0 if the image format
+ * has no error info.
+ */
+static uint32_t error_offset(uint8_t part) {
   switch (partition[part].imagetype & D64_TYPE_MASK) {
   case D64_TYPE_D41:
+    return D41_ERROR_OFFSET;
+
   case D64_TYPE_D71:
-  default:
-    if (track > 35)
-      track -= 35;
-    if (track < 18)
-      return 21;
-    if (track < 25)
-      return 19;
-    if (track < 31)
-      return 18;
-    return 17;
+    return D71_ERROR_OFFSET;
 
   case D64_TYPE_D81:
-    return 40;
-
-  case D64_TYPE_DNP:
-    return 256;
+    return D81_ERROR_OFFSET;
 
   case D64_TYPE_D80:
+    return D80_ERROR_OFFSET;
+
   case D64_TYPE_D82:
-    if (track > 77)
-       track -= 77;
-    if (track < 40)
-       return 29;
-    if (track < 54)
-       return 27;
-    if (track < 65)
-       return 25;
-    return 23;
+    return D82_ERROR_OFFSET;
+
+  default:
+    /* Should not happen unless someone enables error info
+       for additional image formats */
+    return 0;
   }
 }
 
+#ifdef CONFIG_D64_ERRORMAP
+/**
+ * load_errormap - build the bad sector map of an image
+ * @part: partition number
+ *
+ * This function reads the complete error info block of the image
+ * mounted on partition @part and marks all sectors whose code is
+ * not 0 or 1 in the error map. Returns 0 if successful, 2 on error.
+ */
+static uint8_t load_errormap(uint8_t part) {
+  uint8_t  codes[64];
+  uint32_t offset = error_offset(part);
+  uint16_t count, lba, i;
+
+  if (offset == 0)
+    return 2;
+
+  memset(errormap.map, 0, sizeof(errormap.map));
+  errormap.part = 255;
+
+  count = partition[part].imagehandle.fsize - offset;
+  if (count > MAX_ERROR_SECTORS)
+    count = MAX_ERROR_SECTORS;
+
+  for (lba = 0; lba < count; lba += sizeof(codes)) {
+    uint8_t len = sizeof(codes);
+
+    if (count - lba < len)
+      len = count - lba;
+
+    if (image_read(part, offset + lba, codes, len) >= 2)
+      return 2;
+
+    for (i = 0; i < len; i++)
+      if (codes[i] > 1)
+        errormap.map[(lba + i) / 8] |= 1 << ((lba + i) & 7);
+  }
+
+  errormap.part = part;
+  return 0;
+}
+
+/**
+ * read_error_code - read the error info code of a sector
+ * @part  : partition number
+ * @track : track number
+ * @sector: sector number
+ * @code  : pointer to where the code should be stored
+ *
+ * This function returns the error info code of a sector in @code,
+ * the code is only read from the image if the sector is marked in
+ * the error map. Returns 0 if successful, 2 on error.
+ */
+static uint8_t read_error_code(uint8_t part, uint8_t track, uint8_t sector, uint8_t *code) {
+  uint16_t lba = sector_lba(part, track, sector);
+
+  if (errormap.part != part && load_errormap(part))
+    return 2;
+
+  *code = 1;
+  if (!(errormap.map[lba / 8] & (1 << (lba & 7))))
+    return 0;
+
+  if (image_read(part, error_offset(part) + lba, code, 1) >= 2)
+    return 2;
+
+  return 0;
+}
+#else
+/**
+ * read_error_code - read the error info code of a sector
+ * @part  : partition number
+ * @track : track number
+ * @sector: sector number
+ * @code  : pointer to where the code should be stored
+ *
+ * This function returns the error info code of a sector in @code.
+ * The codes of the most recently used track are kept in RAM.
+ * Returns 0 if successful, 2 on error.
+ */
+static uint8_t read_error_code(uint8_t part, uint8_t track, uint8_t sector, uint8_t *code) {
+  if (errorcache.part != part || errorcache.track != track) {
+    /* Read the error info for this track */
+    uint32_t offset = error_offset(part);
+
+    if (offset == 0)
+      return 2;
+
+    memset(errorcache.errors, 1, sizeof(errorcache.errors));
+    if (image_read(part, offset + sector_lba(part,track,0),
+                   errorcache.errors, sectors_per_track(part, track)) >= 2)
+      return 2;
+
+    errorcache.part  = part;
+    errorcache.track = track;
+  }
+
+  *code = errorcache.errors[sector];
+  return 0;
+}
+#endif
+
 /**
  * checked_read - read a specified sector after range-checking
  * @part  : partition number
@@ -287,58 +467,18 @@ static uint8_t checked_read(uint8_t part, uint8_t track, uint8_t sector, uint8_t
 
   if (partition[part].imagetype & D64_HAS_ERRORINFO) {
     /* Check if the sector is marked as bad */
-    if (errorcache.part != part || errorcache.track != track) {
-      /* Read the error info for this track */
-      memset(errorcache.errors, 1, sizeof(errorcache.errors));
-
-      switch (partition[part].imagetype & D64_TYPE_MASK) {
-      case D64_TYPE_D41:
-        if (image_read(part, D41_ERROR_OFFSET + sector_lba(part,track,0),
-                       errorcache.errors, sectors_per_track(part, track)) >= 2)
-          return 2;
-        break;
-
-      case D64_TYPE_D71:
-        if (image_read(part, D71_ERROR_OFFSET + sector_lba(part,track,0),
-                       errorcache.errors, sectors_per_track(part, track)) >= 2)
-          return 2;
-        break;
-
-      case D64_TYPE_D81:
-        if (image_read(part, D81_ERROR_OFFSET + sector_lba(part,track,0),
-                       errorcache.errors, sectors_per_track(part, track)) >= 2)
-          return 2;
-        break;
+    uint8_t code;
 
-      case D64_TYPE_D80:
-        if (image_read(part, D80_ERROR_OFFSET + sector_lba(part,track,0),
-                       errorcache.errors, sectors_per_track(part, track)) >= 2)
-          return 2;
-        break;
-
-      case D64_TYPE_D82:
-        if (image_read(part, D82_ERROR_OFFSET + sector_lba(part,track,0),
-                       errorcache.errors, sectors_per_track(part, track)) >= 2)
-          return 2;
-        break;
-
-      default:
-        /* Should not happen unless someone enables error info
-           for additional image formats */
-        return 2;
-
-      }
-      errorcache.part  = part;
-      errorcache.track = track;
-    }
+    if (read_error_code(part, track, sector, &code))
+      return 2;
 
     /* Calculate error message from the code */
-    if (errorcache.errors[sector] >= 2 && errorcache.errors[sector] <= 11) {
+    if (code >= 2 && code <= 11) {
       /* Most codes can be mapped directly */
-      set_error_ts(errorcache.errors[sector]-2+20,track,sector);
+      set_error_ts(code-2+20,track,sector);
       return 2;
     }
-    if (errorcache.errors[sector] == 15) {
+    if (code == 15) {
       /* Drive not ready */
       set_error(74);
       return 2;
@@ -389,6 +529,7 @@ static void update_timestamp(uint8_t *buffer) {
  * Returns the same as image_write
  */
 static uint8_t write_entry(uint8_t part, struct d64dh *dh, uint8_t *buf, uint8_t flush) {
+  dirindex_drop();
   return image_write(part, sector_offset(part, dh->track, dh->sector) +
                            dh->entry * 32, buf, 32, flush);
 }
@@ -466,6 +607,106 @@ static uint8_t bam_buffer_flush(buffer_t *buf) {
     return 0;
 }
 
+/**
+ * dnp_track_free - count the free sectors in a DNP track bitmap
+ * @map  : pointer to the bitmap of the track
+ * @bytes: number of bitmap bytes to count
+ */
+static uint16_t dnp_track_free(uint8_t *map, uint8_t bytes) {
+  uint16_t blocks = 0;
+
+  for (uint8_t i=0;i < bytes;i++) {
+    // From http://everything2.com/title/counting%25201%2520bits
+    uint8_t b = (map[i] & 0x55) + (map[i]>>1 & 0x55);
+    b = (b & 0x33) + (b >> 2 & 0x33);
+    b = (b & 0x0f) + (b >> 4 & 0x0f);
+    blocks += b;
+  }
+  return blocks;
+}
+
+#ifdef CONFIG_DNP_BAM_CACHE
+/**
+ * dnpbam_flush - write the dirty sectors of the DNP BAM cache to disk
+ *
+ * This function writes all modified sectors of the cached DNP BAM to
+ * the disk image, consecutive sectors with a single call.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t dnpbam_flush(void) {
+  uint8_t i, n, res = 0;
+
+  if (dnpbam_part >= max_part) {
+    dnpbam_dirty = 0;
+    return 0;
+  }
+
+  for (i = 0; dnpbam_dirty != 0 && i < DNP_BAM_SECTORS; i += n) {
+    n = 0;
+    while (i + n < DNP_BAM_SECTORS && (dnpbam_dirty & (1UL << (i + n))))
+      n++;
+
+    if (n == 0) {
+      n = 1;
+      continue;
+    }
+
+    res |= image_write(dnpbam_part,
+                       sector_offset(dnpbam_part, DNP_BAM_TRACK, DNP_BAM_SECTOR + i),
+                       dnpbam.data[i], n * 256, 1);
+    dnpbam_dirty &= ~(((1UL << n) - 1) << i);
+  }
+
+  dnpbam_dirty = 0;
+  return res;
+}
+
+/**
+ * dnpbam_drop - forget the cached DNP BAM of a partition
+ * @part: partition
+ *
+ * This function marks the cache as empty if it holds the BAM of
+ * partition @part. Dirty sectors must be flushed before.
+ */
+static void dnpbam_drop(uint8_t part) {
+  if (dnpbam_part == part) {
+    dnpbam_part  = 255;
+    dnpbam_dirty = 0;
+  }
+}
+
+/**
+ * dnpbam_load - read the complete BAM of a DNP image into the cache
+ * @part: partition
+ *
+ * This function reads all BAM sectors of the DNP image on partition
+ * @part with a single call and counts the free sectors of each track.
+ * Nothing is read if the cache already holds this BAM.
+ * Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t dnpbam_load(uint8_t part) {
+  uint8_t lasttrack = get_param(part, LAST_TRACK);
+
+  if (dnpbam_part == part)
+    return 0;
+
+  if (dnpbam_flush())
+    return 1;
+  dnpbam_part = 255;
+
+  if (image_read(part, sector_offset(part, DNP_BAM_TRACK, DNP_BAM_SECTOR),
+                 dnpbam.data, ((lasttrack >> 3) + 1) * 256))
+    return 1;
+
+  for (uint16_t t = 0; t <= lasttrack; t++)
+    dnpbam.free[t] = dnp_track_free((uint8_t *)dnpbam.data + t * DNP_BAM_BYTES_PER_TRACK,
+                                   DNP_BAM_BYTES_PER_TRACK);
+
+  dnpbam_part = part;
+  return 0;
+}
+#endif
+
 /**
  * d64_bam_commit - write BAM buffers to disk
  *
@@ -481,23 +722,55 @@ uint8_t d64_bam_commit(void) {
   if (bam_buffer2)
     res |= bam_buffer2->cleanup(bam_buffer2);
 
+#ifdef CONFIG_DNP_BAM_CACHE
+  res |= dnpbam_flush();
+#endif
+
+  res |= imgcache_flush(IMGCACHE_ALL);
+
   return 0;
 }
 
+#ifdef CONFIG_BUFFER_POOL
+/**
+ * bam_buffer_reclaim - reclaim callback for the second BAM buffer
+ * @buf: pointer to the lent buffer
+ *
+ * This function writes the BAM sector in @buf to the disk image and
+ * gives the buffer back. It keeps the buffer if it is the current
+ * BAM buffer, because bam_window may point into it.
+ */
+static void bam_buffer_reclaim(buffer_t *buf) {
+  if (buf != bam_buffer2 || bam_buffer_flush(buf))
+    return;
+
+  bam_buffer2 = NULL;
+  return_buffers(buf, 1);
+}
+#endif
+
 /**
  * bam_buffer_alloc - allocates a buffer for the BAM
- * @buf: pointer to the BAM buffer pointer
+ * @buf   : pointer to the BAM buffer pointer
+ * @borrow: borrow an idle buffer that can be reclaimed
  *
  * This function tries to allocate a buffer for holding the BAM,
- * using the pointer pointed to by @buf. Returns 0 if successful,
- * != 0 otherwise.
+ * using the pointer pointed to by @buf. With CONFIG_BUFFER_POOL
+ * and @borrow set, the buffer is lent from the buffer pool and
+ * may be taken back when it is no longer the current BAM buffer.
+ * Returns 0 if successful, != 0 otherwise.
  */
-static uint8_t bam_buffer_alloc(buffer_t **buf) {
-  *buf = alloc_system_buffer();
+static uint8_t bam_buffer_alloc(buffer_t **buf, bool borrow) {
+#ifdef CONFIG_BUFFER_POOL
+  if (borrow)
+    *buf = lend_buffers(1, bam_buffer_reclaim);
+  else
+#endif
+    *buf = alloc_system_buffer();
   if (!*buf)
     return 1;
 
-  (*buf)->secondary    = BUFFER_SYS_BAM;
+  set_buffer_secondary(*buf, BUFFER_SYS_BAM);
   (*buf)->pvt.bam.part = 255;
   (*buf)->cleanup      = bam_buffer_flush;
   stick_buffer(*buf);
@@ -590,6 +863,15 @@ static uint8_t move_bam_window(uint8_t part, uint8_t track, bamdata_t type, uint
     break;
 
   case D64_TYPE_DNP:
+#ifdef CONFIG_DNP_BAM_CACHE
+    if (dnpbam_load(part))
+      return 1;
+
+    dnpbam_window = track >> 3;
+    bam_window    = dnpbam.data[track >> 3];
+    *ptr = bam_window + (track & 0x07) * 32;
+    return 0;
+#endif
     t   = DNP_BAM_TRACK;
     s   = DNP_BAM_SECTOR + (track >> 3);
     pos = (track & 0x07) * 32;
@@ -626,7 +908,7 @@ static uint8_t move_bam_window(uint8_t part, uint8_t track, bamdata_t type, uint
     } else {
       /* allocate and swap to the second BAM buffer if the first one is valid */
       if (bam_buffer->pvt.bam.part != 255) {
-        if (bam_buffer_alloc(&bam_buffer2)) {
+        if (bam_buffer_alloc(&bam_buffer2, true)) {
           /* allocation failed, reset error and continue with just one buffer */
           set_error(ERROR_OK);
         } else {
@@ -650,10 +932,30 @@ static uint8_t move_bam_window(uint8_t part, uint8_t track, bamdata_t type, uint
   }
 
  found:
-  *ptr = bam_buffer->data + pos;
+#ifdef CONFIG_DNP_BAM_CACHE
+  dnpbam_window = -1;
+#endif
+  bam_window = bam_buffer->data;
+  *ptr = bam_window + pos;
   return 0;
 }
 
+/**
+ * mark_bam_dirty - mark the current BAM window as modified
+ *
+ * This function flags the BAM sector selected by the last call of
+ * move_bam_window for writing back to the disk image.
+ */
+static void mark_bam_dirty(void) {
+#ifdef CONFIG_DNP_BAM_CACHE
+  if (dnpbam_window >= 0) {
+    dnpbam_dirty |= 1UL << dnpbam_window;
+    return;
+  }
+#endif
+  bam_buffer->mustflush = 1;
+}
+
 /**
  * is_free - checks if the given sector is marked as free
  * @part  : partition
@@ -677,6 +979,64 @@ static int8_t is_free(uint8_t part, uint8_t track, uint8_t sector) {
     return (ptr[sector>>3] & (1<<(sector&7))) != 0;
 }
 
+/**
+ * find_free_sector - find a free sector on a track
+ * @part  : partition
+ * @track : track number
+ * @start : first sector to check
+ *
+ * This function scans the BAM bitfield of the given track one byte
+ * at a time for the first free sector at or after @start, wrapping
+ * around to sector 0 at the end of the track. Returns the sector
+ * number, -1 if the track is full or -2 if the BAM couldn't be read.
+ */
+static int16_t find_free_sector(uint8_t part, uint8_t track, uint8_t start) {
+  uint8_t  *map;
+  uint8_t  bits, dnp;
+  uint16_t sec, end, count;
+
+  if (move_bam_window(part, track, BAM_BITFIELD, &map))
+    return -2;
+
+  dnp   = (partition[part].imagetype == D64_TYPE_DNP);
+  count = sectors_per_track(part, track);
+  if (start >= count)
+    start = 0;
+
+  /* first pass from start to the end of the track, second one up to start */
+  sec = start;
+  end = count;
+  while (1) {
+    while (sec < end) {
+      bits = map[sec >> 3];
+
+      if (dnp) {
+        /* DNP: sector 0 is the most significant bit */
+        bits &= 0xff >> (sec & 7);
+        if ((sec | 7) >= end)
+          bits &= ~(0xff >> (end & 7));
+        if (bits)
+          return (sec & ~7) + __builtin_clz(bits) - (8 * sizeof(unsigned int) - 8);
+      } else {
+        /* CBM: sector 0 is the least significant bit */
+        bits &= 0xff << (sec & 7);
+        if ((sec | 7) >= end)
+          bits &= (1 << (end & 7)) - 1;
+        if (bits)
+          return (sec & ~7) + __builtin_ctz(bits);
+      }
+
+      sec = (sec | 7) + 1;
+    }
+
+    if (end == start || start == 0)
+      return -1;
+
+    sec = 0;
+    end = start;
+  }
+}
+
 /**
  * sectors_free - returns the number of free sectors on a given track
  * @part  : partition
@@ -697,15 +1057,11 @@ static uint16_t sectors_free(uint8_t part, uint8_t track) {
     if(move_bam_window(part,track,BAM_FREECOUNT,&trackmap))
       return 0;
 
-    uint16_t blocks = 0;
-    for (uint8_t i=0;i < DNP_BAM_BYTES_PER_TRACK;i++) {
-      // From http://everything2.com/title/counting%25201%2520bits
-      uint8_t b = (trackmap[i] & 0x55) + (trackmap[i]>>1 & 0x55);
-      b = (b & 0x33) + (b >> 2 & 0x33);
-      b = (b & 0x0f) + (b >> 4 & 0x0f);
-      blocks += b;
-    }
-    return blocks;
+#ifdef CONFIG_DNP_BAM_CACHE
+    return dnpbam.free[track];
+#else
+    return dnp_track_free(trackmap, DNP_BAM_BYTES_PER_TRACK);
+#endif
 
   case D64_TYPE_D71:
   case D64_TYPE_D81:
@@ -741,11 +1097,14 @@ static uint8_t allocate_sector(uint8_t part, uint8_t track, uint8_t sector) {
     if(move_bam_window(part,track,BAM_BITFIELD,&trackmap))
       return 1;
 
-    bam_buffer->mustflush = 1;
+    mark_bam_dirty();
 
     if (partition[part].imagetype == D64_TYPE_DNP) {
       /* For some reason DNP has its bitfield reversed */
       trackmap[sector>>3] &= (uint8_t)~(0x80>>(sector&7));
+#ifdef CONFIG_DNP_BAM_CACHE
+      dnpbam.free[track]--;
+#endif
 
       /* DNP has no counter in its BAM */
       return 0;
@@ -758,7 +1117,7 @@ static uint8_t allocate_sector(uint8_t part, uint8_t track, uint8_t sector) {
 
     if (trackmap[0] > 0) {
       trackmap[0]--;
-      bam_buffer->mustflush = 1;
+      mark_bam_dirty();
     }
   }
   return 0;
@@ -786,11 +1145,14 @@ static uint8_t free_sector(uint8_t part, uint8_t track, uint8_t sector) {
     if(move_bam_window(part,track,BAM_BITFIELD,&trackmap))
       return 1;
 
-    bam_buffer->mustflush = 1;
+    mark_bam_dirty();
 
     if (partition[part].imagetype == D64_TYPE_DNP) {
       /* For some reason DNP has its bitfield reversed */
       trackmap[sector>>3] |= 0x80>>(sector&7);
+#ifdef CONFIG_DNP_BAM_CACHE
+      dnpbam.free[track]++;
+#endif
 
       /* DNP has no counter in its BAM */
       return 0;
@@ -803,7 +1165,7 @@ static uint8_t free_sector(uint8_t part, uint8_t track, uint8_t sector) {
 
     if(trackmap[0] < sectors_per_track(part, track)) {
       trackmap[0]++;
-      bam_buffer->mustflush = 1;
+      mark_bam_dirty();
     }
   }
   return 0;
@@ -869,9 +1231,11 @@ static uint8_t get_first_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
   }
 
   /* Search for the first free sector on this track */
-  for (*sector = 0;*sector < sectors_per_track(part, *track); *sector += 1)
-    if (is_free(part, *track, *sector) > 0)
-      return 0;
+  int16_t res = find_free_sector(part, *track, 0);
+  if (res >= 0) {
+    *sector = res;
+    return 0;
+  }
 
   /* If we're here the BAM is invalid or couldn't be read */
   if (current_error == ERROR_OK)
@@ -910,18 +1274,18 @@ static uint8_t get_next_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
         return 1;
     }
 
-    uint8_t newsector;
+    int16_t newsector;
 
     if (newtrack == *track) {
       /* Same track: start at the previous sector */
-      newsector = *sector;
+      newsector = find_free_sector(part, newtrack, *sector);
     } else {
       /* New track: start at sector 0 */
-      newsector = 0;
+      newsector = find_free_sector(part, newtrack, 0);
     }
 
-    while (!is_free(part, newtrack, newsector))
-      newsector++; // will automatically wrap from 255->0
+    if (newsector < 0)
+      return 1;
 
     *track = newtrack;
     *sector = newsector;
@@ -982,15 +1346,11 @@ static uint8_t get_next_sector(uint8_t part, uint8_t *track, uint8_t *sector) {
   }
 
   /* Increase distance until an empty sector is found */
-  tries = 99;
-  while (is_free(part,*track,*sector) <= 0 && tries--) {
-    *sector += 1;
-    if (*sector >= sectors_per_track(part, *track))
-      *sector = 0;
-  }
-
-  if (tries)
+  int16_t res = find_free_sector(part, *track, *sector);
+  if (res >= 0) {
+    *sector = res;
     return 0;
+  }
 
   if (current_error == ERROR_OK)
     set_error(ERROR_DISK_FULL);
@@ -1036,6 +1396,74 @@ static int8_t nextdirentry(dh_t *dh) {
   return 0;
 }
 
+#ifdef CONFIG_D64_DIRINDEX
+/**
+ * name_hash - hash a file name for the directory index
+ * @name: pointer to the name
+ * @end : additional character that terminates the name
+ *
+ * This function returns a hash of up to 16 characters of @name,
+ * stopping early at a zero byte or @end.
+ */
+static uint16_t name_hash(uint8_t *name, uint8_t end) {
+  uint16_t hash = 0;
+
+  for (uint8_t i=0; i < CBM_NAME_LENGTH && name[i] != 0 && name[i] != end; i++)
+    hash = hash * 31 + name[i];
+
+  return hash;
+}
+
+/**
+ * dirindex_build - index the directory that starts at a directory handle
+ * @dh: directory handle pointing to the first entry of the directory
+ *
+ * This function reads all entries of the directory and records their
+ * position and name hash. The index is left invalid if the directory has
+ * more entries than fit into it or dropped if a read error occurs.
+ */
+static void dirindex_build(dh_t *dh) {
+  dh_t     walk = *dh;
+  uint16_t count = 0;
+  int8_t   res;
+
+  dirindex.part   = dh->part;
+  dirindex.track  = dh->dir.d64.track;
+  dirindex.sector = dh->dir.d64.sector;
+  dirindex.valid  = 0;
+  dirindex.cursor = DIRINDEX_END;
+
+  while ((res = nextdirentry(&walk)) == 0) {
+    if (ops_scratch[DIR_OFS_FILE_TYPE] == 0)
+      continue;
+
+    if (count == CONFIG_D64_DIRINDEX)
+      return;
+
+    dirindex.entry[count].dh = walk.dir.d64;
+    dirindex.entry[count].dh.entry -= 1; /* undo increment in nextdirentry */
+    dirindex.entry[count].hash = name_hash(ops_scratch + DIR_OFS_FILE_NAME, 0xa0);
+    count++;
+  }
+
+  if (res > 0) {
+    dirindex_drop();
+    return;
+  }
+
+  /* Link the entries of each bucket in directory order */
+  memset(dirindex.head, 0xff, sizeof(dirindex.head));
+  while (count--) {
+    uint8_t bucket = dirindex.entry[count].hash % DIRINDEX_BUCKETS;
+
+    dirindex.entry[count].next = dirindex.head[bucket];
+    dirindex.head[bucket] = count;
+  }
+
+  dirindex.valid = 1;
+}
+#endif
+
 /**
  * find_empty_entry - find an empty directory entry
  * @path: path of the directory
@@ -1124,22 +1552,51 @@ static uint8_t find_empty_entry(path_t *path, dh_t *dh) {
   return 0;
 }
 
+/**
+ * prefetch_link - read ahead the track of a chain link
+ * @part  : partition number
+ * @track : track of the link
+ * @sector: sector of the link
+ *
+ * This function reads the sectors around the one the link points
+ * to into the image cache if it isn't cached yet, so following the
+ * chain through the interleaved sectors of a track usually needs just
+ * one card access per track instead of one per sector.
+ */
+static void prefetch_link(uint8_t part, uint8_t track, uint8_t sector) {
+#ifdef CONFIG_IMAGE_CACHE
+  uint32_t start;
+
+  if (track > get_param(part, LAST_TRACK) ||
+      sector >= sectors_per_track(part, track))
+    return;
+
+  start = sector_offset(part, track, 0);
+  imgcache_prefetch(part, sector_offset(part, track, sector), start,
+                    start + sectors_per_track(part, track) * 256UL);
+#endif
+}
+
 /**
  * d64_read - refill-callback used for reading
  * @buf: target buffer
  *
  * This is the callback used as refill for files opened for reading.
+ * The link to the next sector is kept in pvt.d64 because the bus code
+ * may store a byte that must be sent again in front of the data.
  */
 static uint8_t d64_read(buffer_t *buf) {
   /* Store the current sector, used for append */
-  buf->pvt.d64.track  = buf->data[0];
-  buf->pvt.d64.sector = buf->data[1];
+  buf->pvt.d64.track  = buf->pvt.d64.linktrack;
+  buf->pvt.d64.sector = buf->pvt.d64.linksector;
 
-  if (checked_read(buf->pvt.d64.part, buf->data[0], buf->data[1], buf->data, 256, ERROR_ILLEGAL_TS_LINK)) {
+  if (checked_read(buf->pvt.d64.part, buf->pvt.d64.track, buf->pvt.d64.sector, buf->data, 256, ERROR_ILLEGAL_TS_LINK)) {
     free_buffer(buf);
     return 1;
   }
 
+  buf->pvt.d64.linktrack  = buf->data[0];
+  buf->pvt.d64.linksector = buf->data[1];
   buf->position = 2;
 
   if (buf->data[0] == 0) {
@@ -1149,11 +1606,63 @@ static uint8_t d64_read(buffer_t *buf) {
   } else {
     buf->lastused = 255;
     buf->sendeoi  = 0;
+    prefetch_link(buf->pvt.d64.part, buf->data[0], buf->data[1]);
   }
 
   return 0;
 }
 
+/**
+ * d64_is_file - check if a buffer reads a file in an image
+ * @buf: buffer to check
+ *
+ * This function returns 1 if @buf is used to read a file from a
+ * disk image, 0 otherwise.
+ */
+uint8_t d64_is_file(buffer_t *buf) {
+  return buf->refill == d64_read;
+}
+
+/**
+ * d64_read_data - read the data of the next sectors of a file
+ * @buf      : buffer of a file opened for reading
+ * @data     : pointer to the destination
+ * @size     : size of the destination, at least 254 bytes
+ * @bytesread: pointer to the number of bytes stored
+ *
+ * This function stores the data left in @buf and the data of as many
+ * of the following sectors as fit into @size bytes at @data, so a copy
+ * can write it in one call. The sectors are read through d64_read and
+ * the image cache. @bytesread is 0 at the end of the file.
+ * Returns 0 if successful, 1 on error.
+ */
+uint8_t d64_read_data(buffer_t *buf, uint8_t *data, uint16_t size, UINT *bytesread) {
+  uint8_t count;
+
+  *bytesread = 0;
+  while (1) {
+    count = 0;
+    if (buf->lastused >= buf->position)
+      count = buf->lastused - buf->position + 1;
+
+    if (*bytesread + count > size)
+      return 0;
+
+    memcpy(data + *bytesread, buf->data + buf->position, count);
+    *bytesread += count;
+
+    if (buf->sendeoi) {
+      /* mark the final sector as used up */
+      buf->position = 2;
+      buf->lastused = 1;
+      return 0;
+    }
+
+    if (d64_read(buf))
+      return 1;
+  }
+}
+
 /**
  * d64_seek - seek-callback
  * @buf     : target buffer
@@ -1260,6 +1769,9 @@ static uint8_t d64_write_cleanup(buffer_t *buf) {
   if (write_entry(buf->pvt.d64.part, &buf->pvt.d64.dh, ops_scratch, 1))
     return 1;
 
+  if (imgcache_flush(buf->pvt.d64.part))
+    return 1;
+
   buf->cleanup = callback_dummy;
   free_buffer(buf);
 
@@ -1276,6 +1788,8 @@ uint8_t d64_mount(path_t *path, uint8_t *name) {
   uint8_t part = path->part;
   uint32_t fsize = partition[part].imagehandle.fsize;
 
+  dirindex_drop();
+
   switch (fsize) {
   case 174848:
     imagetype = D64_TYPE_D41;
@@ -1350,19 +1864,30 @@ uint8_t d64_mount(path_t *path, uint8_t *name) {
 
   /* allocate the first BAM buffer if required */
   if (bam_buffer == NULL) {
-    if (bam_buffer_alloc(&bam_buffer))
+    if (bam_buffer_alloc(&bam_buffer, false))
       return 1;
   }
 
+#ifdef CONFIG_IMAGE_FASTSEEK
+  /* map the cluster chain, images with too many fragments just seek slower */
+  f_linkmap(&partition[part].imagehandle, partition[part].imagemap,
+            sizeof(partition[part].imagemap) / sizeof(DWORD));
+#endif
+
   partition[part].imagetype = imagetype;
   path->dir.dxx.track  = get_param(part, DIR_TRACK);
   path->dir.dxx.sector = get_param(part, DIR_START_SECTOR);
 
   bam_refcount++;
 
-  if (imagetype & D64_HAS_ERRORINFO)
+  if (imagetype & D64_HAS_ERRORINFO) {
     /* Invalidate error cache */
+#ifdef CONFIG_D64_ERRORMAP
+    errormap.part = 255;
+#else
     errorcache.part = 255;
+#endif
+  }
 
   return 0;
 }
@@ -1429,6 +1954,59 @@ static int8_t d64_readdir(dh_t *dh, cbmdirent_t *dent) {
   return 0;
 }
 
+#ifdef CONFIG_D64_DIRINDEX
+/**
+ * d64_seek_name - move a directory handle to the next entry with a name
+ * @dh  : directory handle
+ * @name: file name without wildcards
+ *
+ * This function uses the directory index to move @dh to the next entry
+ * whose name may be @name, so the following readdir returns it. It can
+ * only continue from a freshly opened directory or from the entry it
+ * returned the last time. Returns 0 if @dh was moved, -1 if there are no
+ * more entries with this name or 1 if the index can't be used and the
+ * caller must scan the directory itself.
+ */
+int8_t d64_seek_name(dh_t *dh, uint8_t *name) {
+  uint16_t hash = name_hash(name, 0);
+  uint16_t i;
+
+  if (dh->dir.d64.entry == 0) {
+    /* Freshly opened directory */
+    if (dirindex.part   != dh->part ||
+        dirindex.track  != dh->dir.d64.track ||
+        dirindex.sector != dh->dir.d64.sector)
+      dirindex_build(dh);
+
+    if (dirindex.part != dh->part || !dirindex.valid)
+      return 1;
+
+    i = dirindex.head[hash % DIRINDEX_BUCKETS];
+
+  } else {
+    /* Continue after the entry returned by the last call */
+    i = dirindex.cursor;
+    if (dirindex.part != dh->part || !dirindex.valid || i == DIRINDEX_END ||
+        dirindex.entry[i].dh.track  != dh->dir.d64.track  ||
+        dirindex.entry[i].dh.sector != dh->dir.d64.sector ||
+        dirindex.entry[i].dh.entry  != dh->dir.d64.entry - 1)
+      return 1;
+
+    i = dirindex.entry[i].next;
+  }
+
+  while (i != DIRINDEX_END && dirindex.entry[i].hash != hash)
+    i = dirindex.entry[i].next;
+
+  dirindex.cursor = i;
+  if (i == DIRINDEX_END)
+    return -1;
+
+  dh->dir.d64 = dirindex.entry[i].dh;
+  return 0;
+}
+#endif
+
 /* Reads and converts a string from the dir header sector (BAM for D41/D71) to the buffer */
 /* Used by d64_get(disk|dir)label and d64_getid */
 static uint8_t read_string_from_dirheader(path_t *path, uint8_t *buffer, param_t what, uint8_t size) {
@@ -1514,10 +2092,10 @@ static uint16_t d64_freeblocks(uint8_t part) {
     if ((partition[part].imagetype & D64_TYPE_MASK)
         == D64_TYPE_DNP && i == 1) {
       /* DNP: ignore sectors 0-63 on track 1 */
-      for (uint16_t j = 64; j < 256; j++) {
-        if (is_free(part, 1, j) > 0)
-          blocks++;
-      }
+      uint8_t *map;
+
+      if (move_bam_window(part, 1, BAM_BITFIELD, &map) == 0)
+        blocks += dnp_track_free(map + 64/8, DNP_BAM_BYTES_PER_TRACK - 64/8);
 
     } else {
       blocks += sectors_free(part,i);
@@ -1532,8 +2110,8 @@ static void d64_open_read(path_t *path, cbmdirent_t *dent, buffer_t *buf) {
   if (read_entry(path->part, &dent->pvt.dxx.dh, ops_scratch))
     return;
 
-  buf->data[0] = ops_scratch[DIR_OFS_TRACK];
-  buf->data[1] = ops_scratch[DIR_OFS_SECTOR];
+  buf->pvt.d64.linktrack  = ops_scratch[DIR_OFS_TRACK];
+  buf->pvt.d64.linksector = ops_scratch[DIR_OFS_SECTOR];
 
   buf->pvt.d64.part = path->part;
 
@@ -1558,7 +2136,7 @@ static void d64_open_write(path_t *path, cbmdirent_t *dent, uint8_t type, buffer
   if (append) {
     /* Append case: Open the file and read the last sector */
     d64_open_read(path, dent, buf);
-    while (!current_error && buf->data[0])
+    while (!current_error && buf->pvt.d64.linktrack)
       buf->refill(buf);
 
     if (current_error)
@@ -1667,8 +2245,18 @@ static void d64_write_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t
   if (track < 1 || track > get_param(part, LAST_TRACK) ||
       sector >= sectors_per_track(part, track)) {
     set_error_ts(ERROR_ILLEGAL_TS_COMMAND,track,sector);
-  } else
+  } else {
+#ifdef CONFIG_DNP_BAM_CACHE
+    /* don't let the cache overwrite a BAM sector written directly */
+    if (dnpbam_part == part && track == DNP_BAM_TRACK &&
+        sector >= DNP_BAM_SECTOR && sector < DNP_BAM_SECTOR + DNP_BAM_SECTORS) {
+      dnpbam_flush();
+      dnpbam_drop(part);
+    }
+#endif
+    dirindex_drop();
     image_write(part, sector_offset(part,track,sector), buf->data, 256, 1);
+  }
 }
 
 static void d64_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
@@ -1696,11 +2284,11 @@ static void d64_rename(path_t *path, cbmdirent_t *dent, uint8_t *newname) {
  */
 void d64_raw_directory(path_t *path, buffer_t *buf) {
   /* Copy&Waste from d64_open_read */
-  buf->data[0] = path->dir.dxx.track;
+  buf->pvt.d64.linktrack = path->dir.dxx.track;
   if (partition[path->part].imagetype == D64_TYPE_DNP)
-    buf->data[1] = path->dir.dxx.sector;
+    buf->pvt.d64.linksector = path->dir.dxx.sector;
   else
-    buf->data[1] = 0;
+    buf->pvt.d64.linksector = 0;
 
   buf->pvt.d64.part = path->part;
 
@@ -1887,6 +2475,11 @@ static void d64_mkdir(path_t *path, uint8_t *dirname) {
  * a card change is detected.
  */
 void d64_invalidate(void) {
+  dirindex_drop();
+#ifdef CONFIG_DNP_BAM_CACHE
+  dnpbam_part  = 255;
+  dnpbam_dirty = 0;
+#endif
   free_buffer(bam_buffer);
   bam_buffer   = NULL;
   free_buffer(bam_buffer2);
@@ -1915,6 +2508,12 @@ void d64_unmount(uint8_t part) {
       bam_buffer2->pvt.bam.part = 255;
   }
 
+#ifdef CONFIG_DNP_BAM_CACHE
+  dnpbam_flush();
+  dnpbam_drop(part);
+#endif
+  dirindex_drop();
+
   /* decrease BAM buffer refcounter - it can never be zero while a Dxx is mounted*/
   if (--bam_refcount) {
     free_buffer(bam_buffer);
@@ -1931,7 +2530,7 @@ void d64_unmount(uint8_t part) {
 
 /* create a 1581/DNP BAM signature */
 static void format_add_bam_signature(uint8_t doschar, uint8_t *idbuf) {
-  uint8_t *ptr = bam_buffer->data + 2;
+  uint8_t *ptr = bam_window + 2;
 
   *ptr++ = doschar;
   *ptr++ = doschar ^ 0xff;
@@ -2032,9 +2631,9 @@ static void format_dnp_image(uint8_t part, buffer_t *buf, uint8_t *name, uint8_t
   for (uint8_t s=0; s<35; s++)
     allocate_sector(part, DNP_BAM_TRACK, s);
 
-  /* add BAM signature - first BAM sector is in bam_buffer because of allocate_sector */
+  /* add BAM signature - first BAM sector is in bam_window because of allocate_sector */
   format_add_bam_signature('H', idbuf);
-  bam_buffer->data[DNP_BAM_LAST_TRACK_OFS] = get_param(part, LAST_TRACK);
+  bam_window[DNP_BAM_LAST_TRACK_OFS] = get_param(part, LAST_TRACK);
 
   /* build root dirheader */
   uint8_t *ptr = buf->data;
@@ -2093,6 +2692,10 @@ static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
   bam_buffer->pvt.bam.part = 0xff;
   if (bam_buffer2)
     bam_buffer2->pvt.bam.part = 0xff;
+  dirindex_drop();
+#ifdef CONFIG_DNP_BAM_CACHE
+  dnpbam_drop(part);
+#endif
 
   if (id != NULL) {
     /* Clear the data area of the disk image */
@@ -2140,6 +2743,403 @@ static void d64_format(uint8_t part, uint8_t *name, uint8_t *id) {
 }
 
 
+#ifdef CONFIG_D64_VALIDATE
+/* ------------------------------------------------------------------------- */
+/*  Validate                                                                 */
+/* ------------------------------------------------------------------------- */
+
+#define VALIDATE_MAX_SECTORS 4166  // D82
+#define VALIDATE_TIMEOUT     MS_TO_TICKS(20000)
+
+/* Offsets in a D64 directory entry that are only used by validate */
+#define DIR_OFS_SIDE_TRACK   0x15  // REL side sector or GEOS info block
+#define DIR_OFS_SIDE_SECTOR  0x16
+#define DIR_OFS_GEOS_STRUCT  0x17
+#define DIR_OFS_GEOS_TYPE    0x18
+#define GEOS_STRUCT_VLIR     1
+
+/* one bit per sector of the image, set if the sector is in use, */
+/* in normal RAM because the P00 cache can fill the AHB ram */
+static uint8_t usedmap[(VALIDATE_MAX_SECTORS + 7) / 8];
+
+static struct {
+  uint8_t  part;
+  uint8_t  crosslinks;  // chains that ran into a sector already in use
+  uint8_t  removed;     // unclosed files
+  uint8_t  dirsectors;  // length of the directory chain
+  tick_t   deadline;
+} vstate;
+
+/**
+ * mark_used - mark a sector as used in the validation map
+ * @track : track number
+ * @sector: sector number
+ *
+ * Returns 0 if the sector was free before, 1 if it is already in use
+ * or 2 if the track/sector is illegal or the time for the validation
+ * is used up. The error channel is set in the last case.
+ */
+static uint8_t mark_used(uint8_t track, uint8_t sector) {
+  uint8_t  part = vstate.part;
+  uint16_t lba;
+
+  if (track < 1 || track > get_param(part, LAST_TRACK) ||
+      sector >= sectors_per_track(part, track)) {
+    set_error_ts(ERROR_ILLEGAL_TS_LINK, track, sector);
+    return 2;
+  }
+
+  if (time_after(getticks(), vstate.deadline)) {
+    set_error(ERROR_DRIVE_NOT_READY);
+    return 2;
+  }
+
+  lba = sector_lba(part, track, sector);
+  if (usedmap[lba >> 3] & (1 << (lba & 7)))
+    return 1;
+
+  usedmap[lba >> 3] |= 1 << (lba & 7);
+  return 0;
+}
+
+/**
+ * count_crosslink - count a chain that ran into a used sector
+ */
+static void count_crosslink(void) {
+  if (vstate.crosslinks < 255)
+    vstate.crosslinks++;
+}
+
+/**
+ * mark_chain - mark all sectors of a chain as used
+ * @track : track of the first sector
+ * @sector: sector of the first sector
+ *
+ * This function follows the link pointers starting at @track/@sector
+ * and marks every sector of the chain. A chain that runs into a sector
+ * that is already in use is counted as cross-linked and not followed
+ * any further, so a chain that loops back to itself ends too.
+ * Returns 0 if successful, != 0 on error.
+ */
+static uint8_t mark_chain(uint8_t track, uint8_t sector) {
+  uint8_t link[2];
+  uint8_t res;
+
+  while (track != 0) {
+    res = mark_used(track, sector);
+    if (res == 1) {
+      count_crosslink();
+      return 0;
+    }
+    if (res)
+      return 1;
+
+    if (checked_read(vstate.part, track, sector, link, 2, ERROR_ILLEGAL_TS_LINK))
+      return 1;
+
+    track  = link[0];
+    sector = link[1];
+  }
+
+  return 0;
+}
+
+/**
+ * mark_area - mark a run of consecutive sectors as used
+ * @track : track of the first sector
+ * @sector: sector of the first sector
+ * @blocks: number of sectors
+ *
+ * This function marks the area of a 1581 partition, which is not
+ * linked but a run of consecutive sectors. Returns 0 if successful,
+ * != 0 on error.
+ */
+static uint8_t mark_area(uint8_t track, uint8_t sector, uint16_t blocks) {
+  uint8_t res;
+
+  while (blocks--) {
+    res = mark_used(track, sector);
+    if (res == 1) {
+      count_crosslink();
+      return 0;
+    }
+    if (res)
+      return 1;
+
+    if (++sector == sectors_per_track(vstate.part, track)) {
+      sector = 0;
+      track++;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * mark_file - mark all sectors of a file as used
+ * @entry: pointer to the directory entry of the file
+ * @data : 256 byte work area
+ *
+ * This function marks the sector chain of a file, the side sectors of
+ * a REL file, the info block and records of a GEOS file or the area of
+ * a 1581 partition. Returns 0 if successful, != 0 on error.
+ */
+static uint8_t mark_file(uint8_t *entry, uint8_t *data) {
+  uint8_t track  = entry[DIR_OFS_TRACK];
+  uint8_t sector = entry[DIR_OFS_SECTOR];
+
+  switch (entry[DIR_OFS_FILE_TYPE] & TYPE_MASK) {
+  case TYPE_CBM:
+    return mark_area(track, sector, entry[DIR_OFS_SIZE_LOW] +
+                                    (entry[DIR_OFS_SIZE_HI] << 8));
+
+  case TYPE_REL:
+    if (mark_chain(track, sector))
+      return 1;
+
+    return mark_chain(entry[DIR_OFS_SIDE_TRACK], entry[DIR_OFS_SIDE_SECTOR]);
+
+  default:
+    if (mark_chain(track, sector))
+      return 1;
+
+    if (entry[DIR_OFS_GEOS_TYPE] == 0)
+      return 0;
+
+    /* GEOS file: info block and for VLIR files all records */
+    if (mark_chain(entry[DIR_OFS_SIDE_TRACK], entry[DIR_OFS_SIDE_SECTOR]))
+      return 1;
+
+    if (entry[DIR_OFS_GEOS_STRUCT] != GEOS_STRUCT_VLIR)
+      return 0;
+
+    /* the first sector of a VLIR file is its record index */
+    if (checked_read(vstate.part, track, sector, data, 256, ERROR_ILLEGAL_TS_LINK))
+      return 1;
+
+    for (uint16_t i = 2; i < 256; i += 2)
+      if (mark_chain(data[i], data[i+1]))
+        return 1;
+
+    return 0;
+  }
+}
+
+/**
+ * mark_system_sectors - mark header and BAM sectors as used
+ *
+ * Returns 0 if successful, != 0 on error.
+ */
+static uint8_t mark_system_sectors(void) {
+  uint8_t part = vstate.part;
+  uint8_t res  = mark_used(get_param(part, DIR_TRACK), 0);
+
+  switch (partition[part].imagetype & D64_TYPE_MASK) {
+  case D64_TYPE_D71:
+    /* the 1571 reserves all of track 53 */
+    for (uint8_t s = 0; s < sectors_per_track(part, D71_BAM2_TRACK); s++)
+      res |= mark_used(D71_BAM2_TRACK, s);
+    break;
+
+  case D64_TYPE_D81:
+    res |= mark_used(D81_BAM_TRACK, D81_BAM_SECTOR1);
+    res |= mark_used(D81_BAM_TRACK, D81_BAM_SECTOR2);
+    break;
+
+  case D64_TYPE_D80:
+  case D64_TYPE_D82:
+    /* one BAM sector per 50 tracks */
+    for (uint8_t t = 0; t < get_param(part, LAST_TRACK); t += 50)
+      res |= mark_used(D80_BAM_TRACK, D80_BAM_SECTOR + t / 50 * D80_BAM_INTERLEAVE);
+    break;
+
+  default:
+    break;
+  }
+
+  return res;
+}
+
+/**
+ * walk_directory - process all entries of the directory
+ * @data   : 256 byte buffer for directory sectors
+ * @work   : 256 byte work area
+ * @scratch: remove unclosed files instead of marking the files
+ *
+ * Without @scratch this function marks the directory chain and all
+ * files in it and counts the unclosed files. With @scratch it removes
+ * the unclosed files from the directory, following the chain only as
+ * far as the marking pass did. Returns 0 if successful, != 0 on error.
+ */
+static uint8_t walk_directory(uint8_t *data, uint8_t *work, uint8_t scratch) {
+  uint8_t part   = vstate.part;
+  uint8_t track  = get_param(part, DIR_TRACK);
+  uint8_t sector = get_param(part, DIR_START_SECTOR);
+  uint8_t count  = 0;
+  uint8_t res, dirty;
+
+  while (track != 0) {
+    if (scratch) {
+      if (count++ == vstate.dirsectors)
+        break;
+    } else {
+      res = mark_used(track, sector);
+      if (res == 1) {
+        count_crosslink();
+        break;
+      }
+      if (res)
+        return 1;
+
+      vstate.dirsectors++;
+    }
+
+    if (checked_read(part, track, sector, data, 256, ERROR_ILLEGAL_TS_LINK))
+      return 1;
+
+    dirty = 0;
+    for (uint8_t *entry = data; entry < data + 256; entry += 32) {
+      uint8_t type = entry[DIR_OFS_FILE_TYPE];
+
+      if (type == 0)
+        continue;
+
+      /* the splat flag is inverted on disk */
+      if (!(type & FLAG_SPLAT)) {
+        /* unclosed file, removed like on a real drive */
+        if (scratch) {
+          entry[DIR_OFS_FILE_TYPE] = 0;
+          dirindex_drop();
+          dirty = 1;
+        } else if (vstate.removed < 255) {
+          vstate.removed++;
+        }
+        continue;
+      }
+
+      if (!scratch && mark_file(entry, work))
+        return 1;
+    }
+
+    if (dirty && image_write(part, sector_offset(part, track, sector), data, 256, 0))
+      return 1;
+
+    track  = data[0];
+    sector = data[1];
+  }
+
+  return 0;
+}
+
+/**
+ * write_bam - write the validation map to the BAM
+ *
+ * This function replaces the bitfield and the free sector count of
+ * every track with the values from the validation map and writes the
+ * BAM sectors back. Returns 0 if successful, != 0 on error.
+ */
+static uint8_t write_bam(void) {
+  uint8_t  part = vstate.part;
+  uint8_t  *map;
+  uint8_t  bytes, free;
+  uint16_t lba;
+
+  switch (partition[part].imagetype & D64_TYPE_MASK) {
+  case D64_TYPE_D81:
+    bytes = D81_BAM_BITFIELD_BYTES;
+    break;
+
+  case D64_TYPE_D80:
+  case D64_TYPE_D82:
+    bytes = D80_BAM_BITFIELD_BYTES;
+    break;
+
+  default:
+    bytes = D41_BAM_BITFIELD_BYTES;
+    break;
+  }
+
+  for (uint8_t t = 1; t <= get_param(part, LAST_TRACK); t++) {
+    if (move_bam_window(part, t, BAM_BITFIELD, &map))
+      return 1;
+
+    memset(map, 0, bytes);
+    lba  = sector_lba(part, t, 0);
+    free = 0;
+    for (uint8_t s = 0; s < sectors_per_track(part, t); s++, lba++) {
+      if (!(usedmap[lba >> 3] & (1 << (lba & 7)))) {
+        map[s >> 3] |= 1 << (s & 7);
+        free++;
+      }
+    }
+    mark_bam_dirty();
+
+    if (move_bam_window(part, t, BAM_FREECOUNT, &map))
+      return 1;
+
+    *map = free;
+    mark_bam_dirty();
+  }
+
+  return d64_bam_commit();
+}
+
+/**
+ * d64_validate - rebuild the BAM of a disk image from its files
+ * @part: partition
+ *
+ * This function walks the directory and every file of the image once,
+ * marking all sectors in use in a map in RAM. Unclosed files are
+ * removed. Each sector is visited at most once and the walk is given
+ * up after VALIDATE_TIMEOUT, so the bus is never blocked for long.
+ * Nothing is changed unless the walk completed, then the BAM is
+ * written from the map in a single pass. The track of the result
+ * reports the number of cross-linked chains, the sector the number
+ * of removed files.
+ */
+void d64_validate(uint8_t part) {
+  buffer_t *dirbuf, *workbuf;
+  uint8_t res;
+
+  if ((partition[part].imagetype & D64_TYPE_MASK) == D64_TYPE_DNP) {
+    set_error(ERROR_SYNTAX_UNABLE);
+    return;
+  }
+
+  dirbuf = alloc_buffer();
+  if (dirbuf == NULL)
+    return;
+
+  workbuf = alloc_buffer();
+  if (workbuf == NULL) {
+    free_buffer(dirbuf);
+    return;
+  }
+
+  memset(usedmap, 0, sizeof(usedmap));
+  memset(&vstate, 0, sizeof(vstate));
+  vstate.part     = part;
+  vstate.deadline = getticks() + VALIDATE_TIMEOUT;
+
+  res = mark_system_sectors();
+  if (!res)
+    res = walk_directory(dirbuf->data, workbuf->data, 0);
+
+  if (!res && vstate.removed)
+    res = walk_directory(dirbuf->data, workbuf->data, 1);
+
+  if (!res)
+    res = write_bam();
+
+  free_buffer(workbuf);
+  free_buffer(dirbuf);
+
+  if (!res)
+    set_error_ts(ERROR_OK, vstate.crosslinks, vstate.removed);
+}
+#endif
+
+
 /* ------------------------------------------------------------------------- */
 /*  ops struct                                                               */
 /* ------------------------------------------------------------------------- */
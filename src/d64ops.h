@@ -63,6 +63,20 @@ void    d64_unmount(uint8_t part);
 uint8_t d64_bam_commit(void);
 
 void d64_raw_directory(path_t *path, buffer_t *buf);
+
+/* read files in an image for copies in large chunks */
+uint8_t d64_is_file(buffer_t *buf);
+uint8_t d64_read_data(buffer_t *buf, uint8_t *data, uint16_t size, UINT *bytesread);
+
+#ifdef CONFIG_D64_VALIDATE
+/* rebuild the BAM of an image from its directory and files */
+void d64_validate(uint8_t part);
+#endif
+
+#ifdef CONFIG_D64_DIRINDEX
+/* move a directory handle to the next entry that may have this name */
+int8_t d64_seek_name(dh_t *dh, uint8_t *name);
+#endif
 void d64_invalidate(void);
 
 #endif
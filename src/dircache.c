@@ -0,0 +1,314 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+
+   dircache.c: Cache of converted FAT directory entries
+
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include "config.h"
+#include "dirent.h"
+#include "ff.h"
+#include "flags.h"
+#include "parser.h"
+#include "dircache.h"
+
+#define DIRCACHE_BUCKETS 16
+#define DIRCACHE_END     0xffff
+#define DIRCACHE_NONE    0xff
+
+typedef struct {
+  cbmdirent_t dent;
+  uint16_t    index;    // FatFs directory index behind this entry
+  uint16_t    hash;     // hash of the name
+  uint16_t    next;     // next entry in the same hash bucket
+} dcentry_t;
+
+typedef struct {
+  uint8_t   part;       // partition of the directory, 255 if unused
+  uint8_t   id;         // changes whenever the slot is dropped or reused
+  uint8_t   age;        // number of opendirs since the last use
+  uint8_t   complete;   // all entries of the directory are cached
+  uint8_t   exthide;    // extension hiding state used for the entries
+  uint16_t  gen;        // dir_gen of the partition when the slot was filled
+  uint32_t  cluster;    // start cluster of the directory
+  uint16_t  count;      // number of cached entries
+  DIR       resume;     // directory position behind the last cached entry
+  uint16_t  head[DIRCACHE_BUCKETS];
+  uint16_t  tail[DIRCACHE_BUCKETS];
+  dcentry_t entry[CONFIG_FAT_DIRCACHE_ENTRIES];
+} dcslot_t;
+
+static DIRCACHE_ATTRIB dcslot_t dircache[CONFIG_FAT_DIRCACHE];
+
+/**
+ * name_hash - hash a CBM file name
+ * @name: pointer to the name
+ *
+ * This function returns a case-insensitive hash of up to 16 characters
+ * of @name, so it is the same for every name that match_name considers
+ * equal, with or without ignoring case.
+ */
+static uint16_t name_hash(uint8_t *name) {
+  uint16_t hash = 0;
+
+  for (uint8_t i=0; i < CBM_NAME_LENGTH && name[i] != 0; i++)
+    hash = hash * 31 + tolower_pet(name[i]);
+
+  return hash;
+}
+
+/**
+ * drop_slot - remove a directory from the cache
+ * @s: pointer to the slot
+ */
+static void drop_slot(dcslot_t *s) {
+  s->part = 255;
+  s->id++;
+}
+
+/**
+ * get_slot - get the cache slot of a directory handle
+ * @dh: directory handle
+ *
+ * This function returns a pointer to the slot that holds the directory
+ * of @dh or NULL if the handle doesn't use the cache or the directory was
+ * dropped from the cache or changed since the handle was opened.
+ */
+static dcslot_t *get_slot(dh_t *dh) {
+  dcslot_t *s;
+
+  if (dh->cache_slot == DIRCACHE_NONE)
+    return NULL;
+
+  s = &dircache[dh->cache_slot];
+  if (s->id != dh->cache_id)
+    return NULL;
+
+  if (s->gen != partition[s->part].fatfs.dir_gen) {
+    drop_slot(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+/**
+ * rewind_dir - move the FatFs directory position to the handle's entry
+ * @dh: directory handle
+ *
+ * The FatFs part of a directory handle that was served from the cache
+ * only has a valid index. This function reopens the directory at that
+ * index. It must not read forward with f_readdir because that would
+ * skip entries deleted since the handle was opened.
+ */
+static void rewind_dir(dh_t *dh) {
+  l_seekdir(dh->dir.fat.fs, dh->dir.fat.sclust, &dh->dir.fat,
+            dh->dir.fat.index);
+}
+
+/**
+ * dircache_invalidate - drop all directories from the cache
+ */
+void dircache_invalidate(void) {
+  for (uint8_t i=0; i < CONFIG_FAT_DIRCACHE; i++)
+    drop_slot(&dircache[i]);
+}
+
+/**
+ * dircache_opendir - attach a freshly opened FAT directory to the cache
+ * @dh: directory handle as set up by l_opendir
+ *
+ * This function looks up the directory of @dh in the cache. If it isn't
+ * cached, the least recently used slot is cleared so the entries can be
+ * added while the directory is read from the card.
+ */
+void dircache_opendir(dh_t *dh) {
+  uint16_t  gen     = partition[dh->part].fatfs.dir_gen;
+  uint8_t   exthide = globalflags & EXTENSION_HIDING;
+  dcslot_t *s, *found = NULL, *victim = dircache;
+
+  for (uint8_t i=0; i < CONFIG_FAT_DIRCACHE; i++) {
+    s = &dircache[i];
+
+    if (s->part    == dh->part &&
+        s->cluster == dh->dir.fat.sclust &&
+        s->gen     == gen &&
+        s->exthide == exthide)
+      found = s;
+
+    if (s->part == 255)
+      s->age = 255;
+    else if (s->age < 255)
+      s->age++;
+
+    if (s->age > victim->age)
+      victim = s;
+  }
+
+  if (found == NULL) {
+    found = victim;
+    drop_slot(found);
+    found->part     = dh->part;
+    found->cluster  = dh->dir.fat.sclust;
+    found->gen      = gen;
+    found->exthide  = exthide;
+    found->count    = 0;
+    found->complete = 0;
+    memset(found->head, 0xff, sizeof(found->head));
+  }
+
+  found->age     = 0;
+  dh->cache_slot = found - dircache;
+  dh->cache_id   = found->id;
+  dh->cache_pos  = 0;
+}
+
+/**
+ * dircache_readdir - read the next directory entry from the cache
+ * @dh  : directory handle
+ * @dent: CBM directory entry for returning data
+ *
+ * This function returns 0 if the next entry was copied from the cache,
+ * -1 if the cached directory has no more entries or 1 if the entry must
+ * be read from the card. In the last case the FatFs part of @dh is set
+ * up to continue at the right position.
+ */
+int8_t dircache_readdir(dh_t *dh, cbmdirent_t *dent) {
+  dcslot_t *s = get_slot(dh);
+
+  if (s == NULL) {
+    if (dh->cache_slot != DIRCACHE_NONE) {
+      /* The directory was dropped while it was read */
+      dh->cache_slot = DIRCACHE_NONE;
+      if (dh->cache_pos)
+        rewind_dir(dh);
+    }
+    return 1;
+  }
+
+  if (dh->cache_pos < s->count) {
+    dcentry_t *e = &s->entry[dh->cache_pos++];
+
+    memcpy(dent, &e->dent, sizeof(cbmdirent_t));
+    dh->dir.fat.index = e->index;
+    return 0;
+  }
+
+  if (s->complete) {
+    memset(dent, 0, sizeof(cbmdirent_t));
+    return -1;
+  }
+
+  /* Continue reading an incomplete directory from the card */
+  if (dh->cache_pos)
+    dh->dir.fat = s->resume;
+
+  return 1;
+}
+
+/**
+ * dircache_add - add a directory entry read from the card
+ * @dh  : directory handle
+ * @dent: directory entry that was just read
+ *
+ * This function appends @dent to the cached directory if @dh is reading
+ * the first uncached entry. The handle stops using the cache if the slot
+ * is full or another handle is filling it.
+ */
+void dircache_add(dh_t *dh, cbmdirent_t *dent) {
+  dcslot_t  *s = get_slot(dh);
+  dcentry_t *e;
+  uint8_t    bucket;
+
+  if (s == NULL)
+    return;
+
+  if (s->complete || dh->cache_pos != s->count ||
+      s->count == CONFIG_FAT_DIRCACHE_ENTRIES) {
+    dh->cache_slot = DIRCACHE_NONE;
+    return;
+  }
+
+  e = &s->entry[s->count];
+  memcpy(&e->dent, dent, sizeof(cbmdirent_t));
+  e->index = dh->dir.fat.index;
+  e->hash  = name_hash(dent->name);
+  e->next  = DIRCACHE_END;
+
+  /* Link the entry at the end of its bucket to keep directory order */
+  bucket = e->hash % DIRCACHE_BUCKETS;
+  if (s->head[bucket] == DIRCACHE_END)
+    s->head[bucket] = s->count;
+  else
+    s->entry[s->tail[bucket]].next = s->count;
+  s->tail[bucket] = s->count;
+
+  s->count++;
+  s->resume = dh->dir.fat;
+  dh->cache_pos++;
+}
+
+/**
+ * dircache_end - mark the end of a directory
+ * @dh: directory handle that reached the end of its directory
+ */
+void dircache_end(dh_t *dh) {
+  dcslot_t *s = get_slot(dh);
+
+  if (s != NULL && dh->cache_pos == s->count)
+    s->complete = 1;
+}
+
+/**
+ * dircache_seek_name - move a directory handle to the next entry with a name
+ * @dh  : directory handle
+ * @name: file name without wildcards
+ *
+ * This function moves @dh to the next cached entry whose name may be
+ * @name, so the following readdir returns it. Returns 0 if @dh was moved,
+ * -1 if there are no more entries with this name or 1 if the directory
+ * isn't completely cached and the caller must scan it itself.
+ */
+int8_t dircache_seek_name(dh_t *dh, uint8_t *name) {
+  dcslot_t *s = get_slot(dh);
+  uint16_t  hash, i;
+
+  if (s == NULL || !s->complete)
+    return 1;
+
+  hash = name_hash(name);
+  i = s->head[hash % DIRCACHE_BUCKETS];
+  while (i != DIRCACHE_END && (i < dh->cache_pos || s->entry[i].hash != hash))
+    i = s->entry[i].next;
+
+  if (i == DIRCACHE_END) {
+    dh->cache_pos = s->count;
+    return -1;
+  }
+
+  dh->cache_pos = i;
+  return 0;
+}
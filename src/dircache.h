@@ -0,0 +1,54 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+
+   dircache.h: Cache of converted FAT directory entries
+
+*/
+
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stdint.h>
+#include "dirent.h"
+
+#ifdef CONFIG_FAT_DIRCACHE
+
+void    dircache_invalidate(void);
+void    dircache_opendir(dh_t *dh);
+int8_t  dircache_readdir(dh_t *dh, cbmdirent_t *dent);
+void    dircache_add(dh_t *dh, cbmdirent_t *dent);
+void    dircache_end(dh_t *dh);
+int8_t  dircache_seek_name(dh_t *dh, uint8_t *name);
+
+#else
+
+#  define dircache_invalidate()    do {} while (0)
+#  define dircache_opendir(dh)     do {} while (0)
+#  define dircache_readdir(dh,d)   1
+#  define dircache_add(dh,d)       do {} while (0)
+#  define dircache_end(dh)         do {} while (0)
+
+#endif
+
+#endif
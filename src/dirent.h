@@ -182,6 +182,8 @@ typedef struct {
  * @track : current track
  * @sector: current sector
  * @blocks: number of sectors allocated before the current
+ * @linktrack : track of the next sector to read
+ * @linksector: sector of the next sector to read
  *
  * This structure holds the information required to write to a file
  * in a D64 image and update its directory entry upon close.
@@ -192,6 +194,8 @@ typedef struct d64fh {
   uint8_t track;
   uint8_t sector;
   uint16_t blocks;
+  uint8_t linktrack;
+  uint8_t linksector;
 } d64fh_t;
 
 /**
@@ -199,6 +203,9 @@ typedef struct d64fh {
  * @part: partition number for the handle
  * @fat : fat directory handle
  * @d64 : d64 directory handle
+ * @cache_slot: FAT directory cache slot the handle reads from
+ * @cache_id  : id of the directory that was in the slot on opendir
+ * @cache_pos : number of the next entry in the cache slot
  *
  * This is a union of directory handles for all supported file types
  * which is used as an opaque type to be passed between openddir and
@@ -211,6 +218,11 @@ typedef struct dh_s {
     struct d64dh d64;
     eefs_dir_t   eefs;
   } dir;
+#ifdef CONFIG_FAT_DIRCACHE
+  uint8_t  cache_slot;
+  uint8_t  cache_id;
+  uint16_t cache_pos;
+#endif
 } dh_t;
 
 /* This enum must match the struct param_s below! */
@@ -229,6 +241,10 @@ typedef enum { DIR_TRACK = 0, DIR_START_SECTOR,
  * @file_interleave : interleave factor for file sectors
  * @dir_interleave  : interleave factor for directory sectors
  * @format_function : image-specific format function
+ * @track_lba       : first LBA of each track on one side plus the end of
+ *                    the side (in PROGMEM), NULL for 256 sectors per track
+ * @side_tracks     : number of tracks on one side
+ * @side_lba        : number of sectors on one side
  *
  * This structure holds those parameters that differ between various Dxx
  * disk images and which could be abstracted out easily.
@@ -243,6 +259,9 @@ struct param_s {
   uint8_t dir_interleave;
   // Insert new fields here, otherwise get_param will fail!
   void    (*format_function)(uint8_t part, struct buffer_s *buf, uint8_t *name, uint8_t *idbuf);
+  const uint16_t *track_lba;
+  uint8_t  side_tracks;
+  uint16_t side_lba;
 };
 
 /**
@@ -251,6 +270,7 @@ struct param_s {
  * @current_dir: current directory on FAT as seen by NODISKEMU
  * @fop        : pointer to the fileops structure for this partition
  * @imagehandle: file handle of a mounted image file on this partition
+ * @imagemap   : cluster link map of the mounted image file
  * @imagetype  : disk image type mounted on this partition
  * @d64data    : extended information about a mounted Dxx image
  *
@@ -261,6 +281,9 @@ typedef struct partition_s {
   dir_t                  current_dir;
   const struct fileops_s *fop;
   FIL                    imagehandle;
+#ifdef CONFIG_IMAGE_FASTSEEK
+  DWORD                  imagemap[1 + 2 * CONFIG_IMAGE_FASTSEEK];
+#endif
   uint8_t                imagetype;
   struct param_s         d64data;
 } partition_t;
@@ -44,6 +44,7 @@
 #include "fileops.h"
 #include "filesystem.h"
 #include "flags.h"
+#include "imagecache.h"
 #include "bus.h"
 #include "led.h"
 #include "parser.h"
@@ -56,6 +57,7 @@
 #include "wrapops.h"
 #include "doscmd.h"
 #include "menu.h"
+#include "p00cache.h"
 
 #define CURSOR_RIGHT 0x1d
 
@@ -751,7 +753,7 @@ static void parse_block(void) {
       uint8_t count = params[2];
 
       /* Walk the chain, wrap whenever necessary */
-      buf->secondary = BUFFER_SEC_CHAIN - params[0];
+      set_buffer_secondary(buf, BUFFER_SEC_CHAIN - params[0]);
       buf = buf->pvt.buffer.first;
       while (count--) {
         if (buf->pvt.buffer.next != NULL)
@@ -759,7 +761,7 @@ static void parse_block(void) {
         else
           buf = buf->pvt.buffer.first;
       }
-      buf->secondary = params[0];
+      set_buffer_secondary(buf, params[0]);
       buf->mustflush = 0;
     }
     buf->position = params[1];
@@ -775,6 +777,60 @@ static void parse_block(void) {
 /* ---------- */
 /*  C - Copy  */
 /* ---------- */
+/**
+ * copy_data - copy the contents of a file
+ * @srcbuf: buffer of the source file, opened for reading
+ * @dstbuf: buffer of the destination file, opened for writing
+ *
+ * This function appends the remaining data of the file opened in
+ * @srcbuf to the file opened in @dstbuf. REL files are copied record
+ * by record. Returns 0 if successful, 1 on error.
+ */
+static uint8_t copy_data(buffer_t *srcbuf, buffer_t *dstbuf) {
+  int8_t res;
+
+  /* Files copied to FAT are written in large chunks */
+  res = fat_copy_data(srcbuf, dstbuf);
+  if (res >= 0)
+    return res;
+
+  while (1) {
+    uint8_t tocopy;
+
+    if (srcbuf->recordlen)
+      tocopy = srcbuf->recordlen;
+    else
+      tocopy = 256-dstbuf->position;
+
+    if (tocopy > (srcbuf->lastused - srcbuf->position+1))
+      tocopy = srcbuf->lastused - srcbuf->position + 1;
+
+    if (tocopy > 256-dstbuf->position)
+      tocopy = 256-dstbuf->position;
+
+    memcpy(dstbuf->data + dstbuf->position,
+           srcbuf->data + srcbuf->position,
+           tocopy);
+    mark_buffer_dirty(dstbuf);
+    srcbuf->position += tocopy-1;  /* add 1 less, simplifies the test later */
+    dstbuf->position += tocopy;
+    dstbuf->lastused  = dstbuf->position-1;
+
+    /* End if we just copied the last data block */
+    if (srcbuf->sendeoi && srcbuf->position == srcbuf->lastused)
+      return 0;
+
+    /* Refill the buffers if required */
+    if (srcbuf->recordlen || srcbuf->position++ == srcbuf->lastused)
+      if (srcbuf->refill(srcbuf))
+        return 1;
+
+    if (dstbuf->recordlen || dstbuf->position == 0)
+      if (dstbuf->refill(dstbuf))
+        return 1;
+  }
+}
+
 static void parse_copy(void) {
   path_t srcpath,dstpath;
   uint8_t *srcname,*dstname,*tmp;
@@ -864,44 +920,14 @@ static void parse_copy(void) {
         open_rel(&dstpath, &dent, dstbuf, srcbuf->recordlen, 1);
       else
         open_write(&dstpath, &dent, savedtype, dstbuf, 0);
-    }
-
-    while (1) {
-      uint8_t tocopy;
-
-      if (savedtype == TYPE_REL)
-        tocopy = srcbuf->recordlen;
-      else
-        tocopy = 256-dstbuf->position;
-
-      if (tocopy > (srcbuf->lastused - srcbuf->position+1))
-        tocopy = srcbuf->lastused - srcbuf->position + 1;
 
-      if (tocopy > 256-dstbuf->position)
-        tocopy = 256-dstbuf->position;
-
-      memcpy(dstbuf->data + dstbuf->position,
-             srcbuf->data + srcbuf->position,
-             tocopy);
-      mark_buffer_dirty(dstbuf);
-      srcbuf->position += tocopy-1;  /* add 1 less, simplifies the test later */
-      dstbuf->position += tocopy;
-      dstbuf->lastused  = dstbuf->position-1;
-
-      /* End if we just copied the last data block */
-      if (srcbuf->sendeoi && srcbuf->position == srcbuf->lastused)
-        break;
-
-      /* Refill the buffers if required */
-      if (srcbuf->recordlen || srcbuf->position++ == srcbuf->lastused)
-        if (srcbuf->refill(srcbuf))
-          goto cleanup;
-
-      if (dstbuf->recordlen || dstbuf->position == 0)
-        if (dstbuf->refill(dstbuf))
-          goto cleanup;
+      if (current_error != 0)
+        goto cleanup;
     }
 
+    if (copy_data(srcbuf, dstbuf))
+      goto cleanup;
+
     /* Close current source file */
     /* Free and reallocate the buffer. This is required because most of the  */
     /* file_open code assumes that it will get a "pristine" buffer with      */
@@ -957,6 +983,14 @@ static void parse_changepart(void) {
 /* ------------ */
 /*  D commands  */
 /* ------------ */
+
+/* checks if a large buffer can hold a 512 byte card sector */
+static bool sector_fits(buffer_t *buf) {
+  // FIXME: Assumes 512-byte sectors
+  return buf->pvt.buffer.size >= 2 &&
+         buf->pvt.buffer.next->data == buf->data + 256;
+}
+
 static void parse_direct(void) {
   buffer_t *buf;
   uint8_t drive;
@@ -974,9 +1008,9 @@ static void parse_direct(void) {
 
   if (buf->pvt.buffer.size > 1) {
     uint8_t oldsec = buf->secondary;
-    buf->secondary = BUFFER_SEC_CHAIN - oldsec;
+    set_buffer_secondary(buf, BUFFER_SEC_CHAIN - oldsec);
     buf = buf->pvt.buffer.first;
-    buf->secondary = oldsec;
+    set_buffer_secondary(buf, oldsec);
   }
 
   buf->position = 0;
@@ -997,7 +1031,7 @@ static void parse_direct(void) {
 
   case 'R':
     /* Read sector */
-    if (buf->pvt.buffer.size < 2) { // FIXME: Assumes 512-byte sectors
+    if (!sector_fits(buf)) {
       set_error(ERROR_BUFFER_TOO_SMALL);
       return;
     }
@@ -1019,11 +1053,12 @@ static void parse_direct(void) {
 
   case 'W':
     /* Write sector */
-    if (buf->pvt.buffer.size < 2) { // FIXME: Assumes 512-byte sectors
+    if (!sector_fits(buf)) {
       set_error(ERROR_BUFFER_TOO_SMALL);
       return;
     }
     res = disk_write(drive, buf->data, sector, 1);
+    ff_cache_invalidate(drive, sector, 1);
     switch(res) {
     case RES_OK:
       return;
@@ -1146,8 +1181,10 @@ static void parse_getpartition(void) {
 static void parse_initialize(void) {
   if (disk_state != DISK_OK)
     set_error_ts(ERROR_READ_NOSYNC,18,0);
-  else
+  else {
     free_multiple_buffers(FMB_USER_CLEAN);
+    imgcache_flush(IMGCACHE_ALL);
+  }
 }
 
 
@@ -1350,7 +1387,7 @@ static void handle_memwrite(void) {
           break;
 
         stick_buffer(capture_buffer);
-        capture_buffer->secondary = pgm_read_byte(&capptr->buffer_id);
+        set_buffer_secondary(capture_buffer, pgm_read_byte(&capptr->buffer_id));
 
         break;
       }
@@ -1844,6 +1881,7 @@ static void parse_user(void) {
 
   if (command_buffer[1] == 202) {
     /* The real hard reset command */
+    imgcache_flush(IMGCACHE_ALL);
     system_reset();
   }
 
@@ -1905,6 +1943,7 @@ static void parse_user(void) {
     /* Reset - technically hard-reset */
     /* Faked because Ultima 5 sends UJ. */
     free_multiple_buffers(FMB_USER);
+    imgcache_flush(IMGCACHE_ALL);
     set_error(ERROR_DOSVERSION);
     break;
 
@@ -1918,6 +1957,293 @@ static void parse_user(void) {
 }
 
 
+#ifdef CONFIG_IMAGE_TOOLS
+/**
+ * scratch_partial - delete the incomplete copy of a file
+ * @path  : path of the directory that holds the copy
+ * @name  : name of the file
+ * @unpack: true if @path is the FAT directory, false for the image
+ *
+ * This function deletes the destination file of a failed transfer,
+ * including unclosed (splat) files.
+ */
+static void scratch_partial(path_t *path, uint8_t *name, uint8_t unpack) {
+  cbmdirent_t dent;
+  dh_t dh;
+
+  if (unpack ? fat_opendir(&dh, path) : opendir(&dh, path))
+    return;
+
+  while ((unpack ? fat_readdir(&dh, &dent) : readdir(&dh, &dent)) == 0) {
+    if (match_name(name, &dent, 0)) {
+      if (unpack)
+        fat_delete(path, &dent);
+      else
+        file_delete(path, &dent);
+      return;
+    }
+  }
+}
+
+/**
+ * transfer_file - copy a file between a mounted disk image and FAT
+ * @imgpath: path of the disk image directory
+ * @fatpath: path of the FAT directory
+ * @dent   : directory entry of the source file
+ * @unpack : copy from the image to FAT if true, from FAT to the image if false
+ *
+ * This function copies a single file with the same name and type.
+ * The FAT side is accessed with fatops directly because the partition
+ * uses the image ops while an image is mounted. If the copy fails,
+ * the incomplete destination file is deleted and the first error is
+ * kept in the error channel.
+ * Returns 0 if successful, 1 on error.
+ */
+static uint8_t transfer_file(path_t *imgpath, path_t *fatpath, cbmdirent_t *dent, uint8_t unpack) {
+  buffer_t *srcbuf, *dstbuf;
+  cbmdirent_t newdent;
+  uint8_t type = dent->typeflags & TYPE_MASK;
+  uint8_t res = 1;
+  uint8_t created = 0;
+  uint8_t error;
+
+  /* fat_open_read converts the name in dent */
+  memset(&newdent, 0, sizeof(newdent));
+  memcpy(newdent.name, dent->name, CBM_NAME_LENGTH);
+
+  srcbuf = alloc_buffer();
+  if (srcbuf == NULL)
+    return 1;
+
+  dstbuf = alloc_buffer();
+  if (dstbuf == NULL) {
+    free_buffer(srcbuf);
+    return 1;
+  }
+
+  if (unpack) {
+    if (type == TYPE_REL)
+      open_rel(imgpath, dent, srcbuf, 0, 1);
+    else
+      open_read(imgpath, dent, srcbuf);
+  } else {
+    if (type == TYPE_REL)
+      fat_open_rel(fatpath, dent, srcbuf, 0, 1);
+    else
+      fat_open_read(fatpath, dent, srcbuf);
+  }
+
+  if (current_error != 0)
+    goto cleanup;
+
+  if (unpack) {
+    if (type == TYPE_REL)
+      fat_open_rel(fatpath, &newdent, dstbuf, srcbuf->recordlen, 1);
+    else
+      fat_open_write(fatpath, &newdent, type, dstbuf, 0);
+  } else {
+    if (type == TYPE_REL)
+      open_rel(imgpath, &newdent, dstbuf, srcbuf->recordlen, 1);
+    else
+      open_write(imgpath, &newdent, type, dstbuf, 0);
+  }
+
+  if (current_error == 0) {
+    created = 1;
+    res = copy_data(srcbuf, dstbuf);
+  }
+
+ cleanup:
+  /* closing the files resets the error channel, keep the first error */
+  error = current_error;
+  cleanup_and_free_buffer(srcbuf);
+  cleanup_and_free_buffer(dstbuf);
+  if (error == 0)
+    error = current_error;
+
+  if (error != 0) {
+    if (created)
+      /* the name in newdent is converted for FAT files */
+      scratch_partial(unpack ? fatpath : imgpath,
+                      unpack ? dent->name : newdent.name, unpack);
+    set_error(error);
+    res = 1;
+  }
+
+  return res;
+}
+
+/* returns true for the file types that are copied by XU and XN */
+static uint8_t is_plain_file(cbmdirent_t *dent) {
+  uint8_t type = dent->typeflags & TYPE_MASK;
+
+  return !(dent->typeflags & FLAG_SPLAT) &&
+    type >= TYPE_SEQ && type <= TYPE_REL;
+}
+
+/**
+ * image_unpack - extract all files of the current disk image
+ *
+ * This function copies all files of the disk image mounted in the
+ * current directory to the FAT directory that holds the image.
+ * The number of copied files is reported in the track field.
+ */
+static void image_unpack(void) {
+  path_t imgpath, fatpath;
+  cbmdirent_t dent;
+  dh_t dh;
+  uint8_t count = 0;
+  int8_t res;
+
+  if (partition[current_part].fop != &d64ops) {
+    set_error(ERROR_SYNTAX_UNABLE);
+    return;
+  }
+
+  imgpath.part = current_part;
+  imgpath.dir  = partition[current_part].current_dir;
+  fatpath.part = current_part;
+  fatpath.dir  = partition[current_part].current_dir;
+
+  if (opendir(&dh, &imgpath))
+    return;
+
+  while ((res = readdir(&dh, &dent)) == 0) {
+    if (!is_plain_file(&dent))
+      continue;
+
+    if (transfer_file(&imgpath, &fatpath, &dent, 1))
+      return;
+
+    count++;
+  }
+
+  if (res < 0)
+    set_error_ts(ERROR_OK, count, 0);
+}
+
+/**
+ * image_pack - create a disk image from the current FAT directory
+ * @name: name of the new image, optionally followed by a comma and the disk id
+ *
+ * This function creates a new disk image in the current FAT directory,
+ * formats it with the image name as label and copies all files of the
+ * directory into it. The type of the image is taken from the extension
+ * of @name. The number of copied files is reported in the track field.
+ */
+static void image_pack(uint8_t *name) {
+  /* number of 256 byte sectors of each image type that format supports */
+  static const PROGMEM uint16_t image_sectors[] = {
+    683, 1366, 3200
+  };
+  static const PROGMEM char image_exts[] = "D64D71D81";
+  path_t imgpath, fatpath;
+  cbmdirent_t dent;
+  dh_t dh;
+  uint8_t label[CBM_NAME_LENGTH+1];
+  uint8_t *id, *ext;
+  uint8_t i, error, count = 0;
+  int8_t res;
+  DWORD imgcluster;
+
+  if (partition[current_part].fop != &fatops) {
+    set_error(ERROR_SYNTAX_UNABLE);
+    return;
+  }
+
+  id = ustrchr(name, ',');
+  if (id != NULL)
+    *id++ = 0;
+  else
+    id = (uint8_t *)"00";
+
+  /* the extension selects the image type */
+  ext = ustrrchr(name, '.');
+  if (ext == NULL || ustrlen(name) > CBM_NAME_LENGTH || ustrlen(ext) != 4) {
+    set_error(ERROR_SYNTAX_NONAME);
+    return;
+  }
+
+  for (i = 0; i < sizeof(image_sectors) / sizeof(image_sectors[0]); i++)
+    if (!memcmp_P(ext+1, image_exts + 3*i, 3))
+      break;
+
+  if (i == sizeof(image_sectors) / sizeof(image_sectors[0])) {
+    set_error(ERROR_SYNTAX_UNKNOWN);
+    return;
+  }
+
+  memset(label, 0, sizeof(label));
+  memcpy(label, name, ext - name);
+
+  fatpath.part = current_part;
+  fatpath.dir  = partition[current_part].current_dir;
+  imgpath      = fatpath;
+
+  if (image_create(&imgpath, name, 256L * pgm_read_word(image_sectors + i)))
+    return;
+
+  imgcluster = partition[current_part].imagehandle.org_clust;
+
+  format(current_part, label, id);
+  if (current_error != 0)
+    goto unmount;
+
+  if (fat_opendir(&dh, &fatpath))
+    goto unmount;
+
+  while ((res = fat_readdir(&dh, &dent)) == 0) {
+    if (!is_plain_file(&dent) || dent.pvt.fat.cluster == imgcluster)
+      continue;
+
+    /* other disk images in the directory are not packed */
+    if (check_imageext(dent.pvt.fat.realname[0] ? dent.pvt.fat.realname : dent.name)
+        != IMG_UNKNOWN)
+      continue;
+
+    if (transfer_file(&imgpath, &fatpath, &dent, 0))
+      break;
+
+    count++;
+  }
+
+  if (res < 0)
+    set_error_ts(ERROR_OK, count, 0);
+
+ unmount:
+  /* unmounting resets the error channel, keep an earlier error */
+  error = current_error;
+  image_unmount(current_part);
+  if (error != 0)
+    set_error(error);
+}
+#endif
+
+#ifdef CONFIG_D64_VALIDATE
+/* -------------- */
+/*  V - Validate  */
+/* -------------- */
+static void parse_validate(void) {
+  uint8_t *str = command_buffer + 1;
+  uint8_t part;
+
+  clean_cmdbuffer();
+
+  part = parse_partition(&str);
+  if (part >= max_part) {
+    set_error_ts(ERROR_PARTITION_ILLEGAL,part+1,0);
+    return;
+  }
+
+  /* FAT has no BAM, nothing to do there */
+  if (partition[part].fop != &d64ops)
+    return;
+
+  free_multiple_buffers(FMB_USER_CLEAN);
+  d64_validate(part);
+}
+#endif
+
 /* ------------ */
 /*  X commands  */
 /* ------------ */
@@ -2036,6 +2362,33 @@ static void parse_xcommand(void) {
     break;
 #endif
 
+#ifdef CONFIG_P00CACHE
+  case 'P':
+    /* P00 name cache statistics, XP- also clears the counters */
+    if (command_buffer[2] == '-') {
+      p00cache_hits   = 0;
+      p00cache_misses = 0;
+    }
+    set_error_ts(ERROR_STATUS,device_address,2);
+    break;
+#endif
+
+#ifdef CONFIG_IMAGE_TOOLS
+  case 'U':
+    /* Unpack the current disk image */
+    image_unpack();
+    break;
+
+  case 'N':
+    /* New disk image from the current directory */
+    if (command_buffer[2] != ':') {
+      set_error(ERROR_SYNTAX_NONAME);
+      break;
+    }
+    image_pack(command_buffer + 3);
+    break;
+#endif
+
   case 'W':
     /* Write configuration */
     write_configuration();
@@ -2230,6 +2583,12 @@ void parse_doscommand(void) {
     parse_user();
     break;
 
+#ifdef CONFIG_D64_VALIDATE
+  case 'V':
+    parse_validate();
+    break;
+#endif
+
   case 'X':
     parse_xcommand();
     break;
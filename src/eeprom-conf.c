@@ -116,7 +116,7 @@ void read_configuration(void) {
 #endif
 
   size = eeprom_read_word(&storedconfig.structsize);
-  printf("%d/%d bytes read from EEPROM\n", size, sizeof(storedconfig));
+  printf("%u/%u bytes read from EEPROM\n", (unsigned int)size, (unsigned int)sizeof(storedconfig));
 
   /* write, then abort if the size bytes are not set */
   if (size == 0xffff) {
@@ -41,6 +41,7 @@
 #include "utils.h"
 #include "errormsg.h"
 #include "menu.h"
+#include "p00cache.h"
 
 uint8_t current_error;
 uint8_t error_buffer[CONFIG_ERROR_BUFFER_SIZE];
@@ -229,6 +230,19 @@ void set_error_ts(uint8_t errornum, uint8_t track, uint8_t sector) {
         i++;
       }
       break;
+
+#ifdef CONFIG_P00CACHE
+    case 2: // P00 name cache statistics
+      *msg++ = 'P';
+      msg = appendlong(msg, p00cache_hits);
+      *msg++ = ':';
+      msg = appendlong(msg, p00cache_misses);
+      *msg++ = ':';
+      msg = appendlong(msg, p00cache_entries());
+      *msg++ = '/';
+      msg = appendlong(msg, p00cache_capacity());
+      break;
+#endif
     }
 
   } else if (errornum == ERROR_LONGVERSION || errornum == ERROR_DOSVERSION) {
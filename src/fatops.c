@@ -41,8 +41,10 @@
 #include "ff.h"
 #include "fileops.h"
 #include "flags.h"
+#include "imagecache.h"
 #include "led.h"
 #include "p00cache.h"
+#include "dircache.h"
 #include "parser.h"
 #include "progmem.h"
 #include "uart.h"
@@ -64,6 +66,13 @@ typedef enum { EXT_UNKNOWN, EXT_IS_X00, EXT_IS_TYPE } exttype_t;
 
 uint8_t file_extension_mode;
 
+#ifdef CONFIG_FAT_STREAM_SIZE
+/* Read-ahead buffer for one sequential file, see fat_file_stream */
+static uint8_t   stream_data[CONFIG_FAT_STREAM_SIZE];
+static buffer_t *stream_owner;
+static uint16_t  stream_pos, stream_len;
+#endif
+
 /* ------------------------------------------------------------------------- */
 /*  Utility functions                                                        */
 /* ------------------------------------------------------------------------- */
@@ -377,6 +386,82 @@ static uint8_t fat_file_read(buffer_t *buf) {
   return 0;
 }
 
+#ifdef CONFIG_FAT_STREAM_SIZE
+/**
+ * fat_file_stream - read the next data block through the stream buffer
+ * @buf: buffer to be worked on
+ *
+ * This function is the refill-callback for sequential reads of files
+ * that own the stream buffer. Instead of reading 254 bytes from the
+ * file per call, which splits most card sectors over two calls, the
+ * stream buffer is filled with whole sectors at once and the bus
+ * buffer is refilled from there.
+ */
+static uint8_t fat_file_stream(buffer_t *buf) {
+  FIL *fh = &buf->pvt.fat.fh;
+  FRESULT res;
+  UINT bytesread, len;
+  uint8_t copied = 0;
+
+  uart_putc('#');
+
+  buf->fptr = fh->fptr - buf->pvt.fat.headersize - (stream_len - stream_pos);
+
+  while (copied < 254) {
+    if (stream_pos == stream_len) {
+      /* refill, ending on a sector boundary of the file */
+      len = CONFIG_FAT_STREAM_SIZE - (fh->fptr & 511);
+      res = f_read(fh, stream_data, len, &bytesread);
+      if (res != FR_OK) {
+        parse_error(res,1);
+        free_buffer(buf);
+        return 1;
+      }
+
+      if (bytesread == 0)
+        break;
+
+      stream_pos = 0;
+      stream_len = bytesread;
+    }
+
+    len = stream_len - stream_pos;
+    if (len > 254U - copied)
+      len = 254 - copied;
+
+    memcpy(buf->data + 2 + copied, stream_data + stream_pos, len);
+    stream_pos += len;
+    copied     += len;
+  }
+
+  /* The bus protocol can't handle 0-byte-files */
+  if (copied == 0) {
+    copied = 1;
+    buf->data[2] = 13;
+  }
+
+  buf->position = 2;
+  buf->lastused = copied+1;
+  if (copied < 254 ||
+      (fh->fsize == fh->fptr && stream_pos == stream_len))
+    buf->sendeoi = 1;
+  else
+    buf->sendeoi = 0;
+
+  return 0;
+}
+
+/* give up the stream buffer, reads continue through fat_file_read */
+static void fat_stream_release(buffer_t *buf) {
+  if (stream_owner == buf) {
+    stream_owner = NULL;
+    buf->refill  = fat_file_read;
+  }
+}
+#else
+#  define fat_stream_release(buf) do {} while (0)
+#endif
+
 /**
  * write_data - write the current buffer data
  * @buf: buffer to be worked on
@@ -509,6 +594,9 @@ uint8_t fat_file_seek(buffer_t *buf, uint32_t position, uint8_t index) {
     if (fat_file_write(buf))
       return 1;
 
+  /* the stream buffer only supports sequential reads */
+  fat_stream_release(buf);
+
   if (buf->pvt.fat.fh.fsize >= pos) {
     FRESULT res = f_lseek(&buf->pvt.fat.fh, pos);
     if (res != FR_OK) {
@@ -563,6 +651,8 @@ static uint8_t fat_file_close(buffer_t *buf) {
       return 1;
   }
 
+  fat_stream_release(buf);
+
   res = f_close(&buf->pvt.fat.fh);
   parse_error(res,1);
   buf->cleanup = callback_dummy;
@@ -573,6 +663,139 @@ static uint8_t fat_file_close(buffer_t *buf) {
     return 0;
 }
 
+/**
+ * fat_copy_data - copy the contents of a file to a FAT file
+ * @src: buffer of the source file, opened for reading
+ * @dst: buffer of the destination file, opened for writing
+ *
+ * This function copies all data of the file opened in @src to the end
+ * of the file opened in @dst with large f_read/f_write calls instead of
+ * one data block at a time, so FatFs can transfer whole sector runs.
+ * Files in disk images are collected sector by sector through the
+ * image cache into the stream buffer and written from there.
+ * Data that is still pending in @dst is written first. @src is left at
+ * the end of the file. Returns -1 if the files must be copied block by
+ * block, 1 on error or 0 if successful.
+ */
+int8_t fat_copy_data(buffer_t *src, buffer_t *dst) {
+  FIL *sfh = &src->pvt.fat.fh;
+  FIL *dfh = &dst->pvt.fat.fh;
+  FRESULT res;
+  UINT len, bytesread, byteswritten;
+  uint8_t *scratch;
+  uint16_t size;
+  uint8_t image = 0;
+  int8_t result = 1;
+
+  if (dst->refill != fat_file_write || src->recordlen || dst->recordlen)
+    return -1;
+
+  if (src->refill == fat_file_read
+#ifdef CONFIG_FAT_STREAM_SIZE
+      || src->refill == fat_file_stream
+#endif
+     ) {
+    /* empty files are copied as a single CR like on the bus */
+    if (sfh->fsize == src->pvt.fat.headersize)
+      return -1;
+  } else {
+#ifdef CONFIG_FAT_STREAM_SIZE
+    /* image files only gain something if the stream buffer is free */
+    if (!d64_is_file(src) || src->sendeoi ||
+        (stream_owner != NULL && stream_owner->allocated &&
+         stream_owner->refill == fat_file_stream))
+      return -1;
+
+    image = 1;
+#else
+    return -1;
+#endif
+  }
+
+  /* write the data that is still pending in the destination buffer */
+  if (dst->position > 2) {
+    len = dst->position - 2;
+    dst->position = 2;
+
+    res = f_write(dfh, dst->data + 2, len, &byteswritten);
+    if (res != FR_OK)
+      goto error;
+
+    if (byteswritten != len)
+      goto full;
+  }
+
+  /* use the stream buffer unless another file reads through it */
+  scratch = src->data;
+  size    = 256;
+#ifdef CONFIG_FAT_STREAM_SIZE
+  fat_stream_release(src);
+  if (stream_owner == NULL || !stream_owner->allocated ||
+      stream_owner->refill != fat_file_stream) {
+    stream_owner = NULL;
+    scratch = stream_data;
+    size    = CONFIG_FAT_STREAM_SIZE;
+  }
+#endif
+
+  if (!image) {
+    res = f_lseek(sfh, src->pvt.fat.headersize);
+    if (res != FR_OK) {
+      parse_error(res,1);
+      goto done;
+    }
+  }
+
+  while (1) {
+    if (image) {
+      if (d64_read_data(src, scratch, size, &bytesread))
+        goto done;
+    } else {
+      /* end the reads on a sector boundary of the source file */
+      len = size;
+      if (len > 512)
+        len -= sfh->fptr & 511;
+
+      res = f_read(sfh, scratch, len, &bytesread);
+      if (res != FR_OK) {
+        parse_error(res,1);
+        goto done;
+      }
+    }
+
+    if (bytesread == 0)
+      break;
+
+    res = f_write(dfh, scratch, bytesread, &byteswritten);
+    if (res != FR_OK)
+      goto error;
+
+    if (byteswritten != bytesread)
+      goto full;
+  }
+
+  src->position = 2;
+  src->lastused = 2;
+  src->sendeoi  = 1;
+  result = 0;
+  goto done;
+
+ full:
+  set_error(ERROR_DISK_FULL);
+  goto done;
+
+ error:
+  parse_error(res,0);
+
+ done:
+  mark_buffer_clean(dst);
+  dst->mustflush = 0;
+  dst->position  = 2;
+  dst->lastused  = 2;
+  dst->fptr      = dfh->fptr - dst->pvt.fat.headersize;
+  return result;
+}
+
 /* ------------------------------------------------------------------------- */
 /*  Internal handlers for the various operations                             */
 /* ------------------------------------------------------------------------- */
@@ -615,6 +838,17 @@ void fat_open_read(path_t *path, cbmdirent_t *dent, buffer_t *buf) {
   buf->refill    = fat_file_read;
   buf->seek      = fat_file_seek;
 
+#ifdef CONFIG_FAT_STREAM_SIZE
+  /* use the stream buffer if no other file has it */
+  if (stream_owner == NULL || !stream_owner->allocated ||
+      stream_owner->refill != fat_file_stream) {
+    stream_owner = buf;
+    stream_pos   = 0;
+    stream_len   = 0;
+    buf->refill  = fat_file_stream;
+  }
+#endif
+
   stick_buffer(buf);
 
   /* Call the refill once for the first block of data */
@@ -656,11 +890,20 @@ FRESULT create_file(path_t *path, cbmdirent_t *dent, uint8_t type, buffer_t *buf
           break;
       }
     }
-  } while (res == FR_EXIST);
+  } while (res == FR_EXIST && x00ext != NULL);
 
   if (res != FR_OK)
     return res;
 
+#ifdef CONFIG_FAT_PREALLOC
+  /* Reserve a contiguous cluster run so files saved at the same time */
+  /* don't interleave. Failure is fine, the file then grows on demand */
+  FATFS *fs = &partition[path->part].fatfs;
+  DWORD clsize = (DWORD)fs->csize * 512;
+
+  f_prealloc(&buf->pvt.fat.fh, (CONFIG_FAT_PREALLOC + clsize - 1) / clsize);
+#endif
+
   if (x00ext != NULL || recordlen) {
     UINT byteswritten;
 
@@ -795,6 +1038,7 @@ uint8_t fat_opendir(dh_t *dh, path_t *path) {
     parse_error(res,1);
     return 1;
   }
+  dircache_opendir(dh);
   return 0;
 }
 
@@ -812,6 +1056,12 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
   FILINFO finfo;
   uint8_t *ptr,*nameptr;
   uint8_t typechar;
+  int8_t  cached;
+
+  /* Use the cached entry if there is one */
+  cached = dircache_readdir(dh, dent);
+  if (cached <= 0)
+    return cached;
 
   finfo.lfn = ops_scratch;
 
@@ -830,8 +1080,10 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
 
   memset(dent, 0, sizeof(cbmdirent_t));
 
-  if (!finfo.fname[0])
+  if (!finfo.fname[0]) {
+    dircache_end(dh);
     return -1;
+  }
 
   dent->opstype = OPSTYPE_FAT;
 
@@ -968,6 +1220,7 @@ int8_t fat_readdir(dh_t *dh, cbmdirent_t *dent) {
   dent->date.minute = (finfo.ftime >> 5) & 0x3f;
   dent->date.second = (finfo.ftime & 0x1f) << 1;
 
+  dircache_add(dh, dent);
   return 0;
 }
 
@@ -1438,6 +1691,8 @@ void fatops_init(uint8_t preserve_path) {
   /* Invalidate some caches */
   d64_invalidate();
   p00cache_invalidate();
+  dircache_invalidate();
+  imgcache_invalidate(IMGCACHE_ALL);
 
 #ifndef HAVE_HOTPLUG
   if (!max_part) {
@@ -1447,6 +1702,28 @@ void fatops_init(uint8_t preserve_path) {
 #endif
 }
 
+/**
+ * fatops_idle - count free clusters in the background
+ *
+ * This function scans one FAT sector of the first partition whose
+ * number of free clusters is not known yet, e.g. because the FSInfo
+ * sector of a FAT32 card was not valid. It should be called while the
+ * bus is idle so the next directory listing can print the number of
+ * free blocks without a full FAT scan.
+ */
+void fatops_idle(void) {
+  uint8_t i;
+
+  for (i = 0; i < max_part; i++) {
+    FATFS *fs = &partition[i].fatfs;
+
+    if (fs->fs_type && fs->free_clust > fs->max_clust - 2) {
+      l_scanfree(fs, 1);
+      return;
+    }
+  }
+}
+
 /**
  * image_unmount - generic unmounting function for images
  * @part: partition number
@@ -1466,6 +1743,9 @@ uint8_t image_unmount(uint8_t part) {
   if (partition[part].fop == &d64ops)
     d64_unmount(part);
 
+  imgcache_flush(part);
+  imgcache_invalidate(part);
+
   if (display_found) {
     /* Send current path to display */
     path_t path;
@@ -1503,6 +1783,71 @@ uint8_t image_chdir(path_t *path, cbmdirent_t *dent) {
   return 1;
 }
 
+#ifdef CONFIG_IMAGE_TOOLS
+/**
+ * image_create - create and mount a new disk image file
+ * @path: path of the directory for the image, changed to the image root
+ * @name: name of the image file
+ * @size: size of the image file in bytes
+ *
+ * This function creates a new file of @size bytes for a disk image in
+ * the directory given by @path and mounts it like a chdir into the
+ * image would. The contents of the image are undefined, it must be
+ * formatted before use. Returns 0 if successful, 1 otherwise.
+ */
+uint8_t image_create(path_t *path, uint8_t *name, uint32_t size) {
+  FATFS *fs = &partition[path->part].fatfs;
+  FIL *fh = &partition[path->part].imagehandle;
+  FRESULT res;
+
+  free_multiple_buffers(FMB_USER_CLEAN);
+
+  ustrcpy(ops_scratch, name);
+  pet2asc(ops_scratch);
+
+  fs->curr_dir = path->dir.fat;
+  res = f_open(fs, fh, ops_scratch, FA_WRITE | FA_READ | FA_CREATE_NEW);
+  if (res != FR_OK) {
+    parse_error(res,0);
+    return 1;
+  }
+
+#ifdef CONFIG_FAT_PREALLOC
+  /* keep the image contiguous if possible, failure is fine */
+  DWORD clsize = (DWORD)fs->csize * 512;
+
+  f_prealloc(fh, (size + clsize - 1) / clsize);
+#endif
+
+  /* extending the file in write mode allocates its clusters */
+  res = f_lseek(fh, size);
+  if (res == FR_OK && fh->fsize != size)
+    res = FR_DENIED;
+
+  if (res == FR_OK)
+    res = f_sync(fh);
+
+  if (res != FR_OK) {
+    if (res == FR_DENIED)
+      set_error(ERROR_DISK_FULL);
+    else
+      parse_error(res,0);
+
+    f_close(fh);
+    f_unlink(fs, ops_scratch);
+    return 1;
+  }
+
+  if (d64_mount(path, ops_scratch)) {
+    f_close(fh);
+    return 1;
+  }
+
+  partition[path->part].fop = &d64ops;
+  return 0;
+}
+#endif
+
 /**
  * image_mkdir - generic mkdir for image files
  * @path   : path of the directory
@@ -1530,6 +1875,14 @@ uint8_t image_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes) {
   FRESULT res;
   UINT bytesread;
 
+#ifdef CONFIG_IMAGE_CACHE
+  if (offset != -1 && offset + bytes <= partition[part].imagehandle.fsize)
+    return imgcache_read(part, offset, buffer, bytes);
+
+  /* uncached access, make sure the file is up to date */
+  imgcache_flush(part);
+#endif
+
   if (offset != -1) {
     res = f_lseek(&partition[part].imagehandle, offset);
     if (res != FR_OK) {
@@ -1561,11 +1914,22 @@ uint8_t image_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes) {
  * This function seeks to offset in the image file and writes bytes
  * byte into buffer. It returns 0 on success, 1 if less than
  * bytes byte could be written and 2 on failure.
+ * With CONFIG_IMAGE_CACHE writes inside the image file are cached
+ * and @flush is ignored for them, see imgcache_flush.
  */
 uint8_t image_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes, uint8_t flush) {
   FRESULT res;
   UINT byteswritten;
 
+#ifdef CONFIG_IMAGE_CACHE
+  if (offset != -1 && offset + bytes <= partition[part].imagehandle.fsize)
+    return imgcache_write(part, offset, buffer, bytes);
+
+  /* uncached access, cached blocks would be stale afterwards */
+  imgcache_flush(part);
+  imgcache_invalidate(part);
+#endif
+
   if (offset != -1) {
     res = f_lseek(&partition[part].imagehandle, offset);
     if (res != FR_OK) {
@@ -35,12 +35,14 @@
 
 /* API */
 void     fatops_init(uint8_t preserve_dir);
+void     fatops_idle(void);
 void     parse_error(FRESULT res, uint8_t readflag);
 uint8_t  fat_delete(path_t *path, cbmdirent_t *dent);
 uint8_t  fat_chdir(path_t *path, cbmdirent_t *dent);
 void     fat_mkdir(path_t *path, uint8_t *dirname);
 void     fat_open_read(path_t *path, cbmdirent_t *filename, buffer_t *buf);
 void     fat_open_write(path_t *path, cbmdirent_t *filename, uint8_t type, buffer_t *buf, uint8_t append);
+void     fat_open_rel(path_t *path, cbmdirent_t *dent, buffer_t *buf, uint8_t length, uint8_t mode);
 uint8_t  fat_getdirlabel(path_t *path, uint8_t *label);
 uint8_t  fat_getid(path_t *path, uint8_t *id);
 uint16_t fat_freeblocks(uint8_t part);
@@ -48,6 +50,7 @@ uint8_t  fat_opendir(dh_t *dh, path_t *dir);
 int8_t   fat_readdir(dh_t *dh, cbmdirent_t *dent);
 void     fat_read_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector);
 void     fat_write_sector(buffer_t *buf, uint8_t part, uint8_t track, uint8_t sector);
+int8_t   fat_copy_data(buffer_t *src, buffer_t *dst);
 void     format_dummy(uint8_t drive, uint8_t *name, uint8_t *id);
 
 extern const fileops_t fatops;
@@ -57,6 +60,9 @@ extern uint8_t file_extension_mode;
 uint8_t image_unmount(uint8_t part);
 uint8_t image_chdir(path_t *path, cbmdirent_t *dent);
 void    image_mkdir(path_t *path, uint8_t *dirname);
+#ifdef CONFIG_IMAGE_TOOLS
+uint8_t image_create(path_t *path, uint8_t *name, uint32_t size);
+#endif
 uint8_t image_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes);
 uint8_t image_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes, uint8_t flush);
 
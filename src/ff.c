@@ -92,6 +92,166 @@ BUF static_buf;
 # define FPBUF (fp->buf)
 #endif
 
+/*-----------------------------------------------------------------------*/
+/* Sector cache below the window                                         */
+/*-----------------------------------------------------------------------*/
+
+#define SC_FAT  0       /* Sector classes, each has its own pool */
+#define SC_DIR  1
+#define SC_DATA 2
+
+#if _USE_SECTOR_CACHE != 0
+#ifndef CONFIG_SECTOR_CACHE_FAT
+#  define CONFIG_SECTOR_CACHE_FAT 0
+#endif
+#ifndef CONFIG_SECTOR_CACHE_DIR
+#  define CONFIG_SECTOR_CACHE_DIR 0
+#endif
+#ifndef CONFIG_SECTOR_CACHE_DATA
+#  define CONFIG_SECTOR_CACHE_DATA 0
+#endif
+
+#define SC_ENTRIES (CONFIG_SECTOR_CACHE_FAT + CONFIG_SECTOR_CACHE_DIR + CONFIG_SECTOR_CACHE_DATA)
+
+static const PROGMEM
+BYTE sc_pool_start[4] = {
+  0,
+  CONFIG_SECTOR_CACHE_FAT,
+  CONFIG_SECTOR_CACHE_FAT + CONFIG_SECTOR_CACHE_DIR,
+  SC_ENTRIES
+};
+
+static struct {
+  DWORD sector;
+  WORD  stamp;          /* Last use, 0 if the entry is empty */
+  BYTE  drive;
+} sc_tag[SC_ENTRIES];
+
+static BYTE sc_data[SC_ENTRIES][S_MAX_SIZ];
+static WORD sc_clock;
+
+/* Find a cached sector, returns SC_ENTRIES if it is not in the cache */
+static
+BYTE sc_find (
+  BYTE drv,
+  DWORD sector
+)
+{
+  BYTE i;
+
+  for (i = 0; i < SC_ENTRIES; i++)
+    if (sc_tag[i].stamp && sc_tag[i].sector == sector && sc_tag[i].drive == drv)
+      break;
+  return i;
+}
+
+static
+void sc_touch (
+  BYTE i
+)
+{
+  if (++sc_clock == 0) {
+    /* Wrapped around, restart the ages of all entries */
+    BYTE j;
+
+    for (j = 0; j < SC_ENTRIES; j++)
+      if (sc_tag[j].stamp)
+        sc_tag[j].stamp = 1;
+    sc_clock = 2;
+  }
+  sc_tag[i].stamp = sc_clock;
+}
+
+static
+DRESULT cache_read (    /* Read one sector, through the cache */
+  BYTE drv,
+  BYTE *buff,
+  DWORD sector,
+  BYTE cls              /* Class of the sector, selects the pool for a miss */
+)
+{
+  BYTE i, end, victim;
+
+  i = sc_find(drv, sector);
+  if (i < SC_ENTRIES) {
+    memcpy(buff, sc_data[i], S_MAX_SIZ);
+    sc_touch(i);
+    return RES_OK;
+  }
+
+  if (disk_read(drv, buff, sector, 1) != RES_OK)
+    return RES_ERROR;
+
+  /* Replace the least recently used entry of the pool */
+  i   = pgm_read_byte(sc_pool_start + cls);
+  end = pgm_read_byte(sc_pool_start + cls + 1);
+  if (i == end)
+    return RES_OK;
+
+  for (victim = i; i < end; i++)
+    if (sc_tag[i].stamp < sc_tag[victim].stamp)
+      victim = i;
+
+  memcpy(sc_data[victim], buff, S_MAX_SIZ);
+  sc_tag[victim].sector = sector;
+  sc_tag[victim].drive  = drv;
+  sc_touch(victim);
+  return RES_OK;
+}
+
+#if !_FS_READONLY
+static
+DRESULT cache_write (   /* Write one sector to the disk, updating the cache */
+  BYTE drv,
+  const BYTE *buff,
+  DWORD sector
+)
+{
+  DRESULT res;
+  BYTE i;
+
+  res = disk_write(drv, buff, sector, 1);
+  i = sc_find(drv, sector);
+  if (i < SC_ENTRIES) {
+    if (res == RES_OK)
+      memcpy(sc_data[i], buff, S_MAX_SIZ);
+    else
+      sc_tag[i].stamp = 0;
+  }
+  return res;
+}
+#endif
+
+/**
+ * ff_cache_invalidate - drop sectors from the cache
+ * @drv   : physical drive number
+ * @sector: first sector to drop
+ * @count : number of sectors to drop
+ *
+ * This function must be called after sectors of a mounted drive were
+ * written without going through FatFs.
+ */
+void ff_cache_invalidate (
+  BYTE drv,
+  DWORD sector,
+  DWORD count
+)
+{
+  BYTE i;
+
+  for (i = 0; i < SC_ENTRIES; i++)
+    if (sc_tag[i].drive == drv && sc_tag[i].sector - sector < count)
+      sc_tag[i].stamp = 0;
+}
+
+#else
+#  define cache_read(drv, buff, sector, cls) disk_read(drv, buff, sector, 1)
+#  define cache_write(drv, buff, sector)     disk_write(drv, buff, sector, 1)
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Change window offset                                                  */
 /*-----------------------------------------------------------------------*/
@@ -100,7 +260,8 @@ static
 BOOL move_window (      /* TRUE: successful, FALSE: failed */
   FATFS *fs,            /* File system object */
   BUF *buf,
-  DWORD sector          /* Sector number to make apperance in the fs->buf.data[] */
+  DWORD sector,         /* Sector number to make apperance in the fs->buf.data[] */
+  BYTE cls              /* Sector class for the cache if not in the FAT area */
 )                       /* Move to zero only writes back dirty window */
 {
   DWORD wsect;
@@ -120,19 +281,21 @@ BOOL move_window (      /* TRUE: successful, FALSE: failed */
 #if !_FS_READONLY
     BYTE n;
     if (buf->dirty) {                   /* Write back dirty window if needed */
-      if (disk_write(ofs->drive, buf->data, wsect, 1) != RES_OK)
+      if (cache_write(ofs->drive, buf->data, wsect) != RES_OK)
         return FALSE;
       buf->dirty = FALSE;
       if (wsect < (ofs->fatbase + ofs->sects_fat)) {  /* In FAT area */
         for (n = ofs->n_fats; n >= 2; n--) {          /* Reflect the change to FAT copy */
           wsect += ofs->sects_fat;
-          disk_write(ofs->drive, buf->data, wsect, 1);
+          cache_write(ofs->drive, buf->data, wsect);
         }
       }
     }
 #endif
     if (sector) {
-      if (disk_read(fs->drive, buf->data, sector, 1) != RES_OK)
+      if (sector >= fs->fatbase && sector < fs->fatbase + fs->sects_fat * fs->n_fats)
+        cls = SC_FAT;
+      if (cache_read(fs->drive, buf->data, sector, cls) != RES_OK)
         return FALSE;
       buf->sect = sector;
 #if _USE_1_BUF != 0
@@ -152,7 +315,7 @@ BOOL move_fs_window(
   DWORD  sector
 )
 {
-  return move_window(fs,&FSBUF,sector);
+  return move_window(fs,&FSBUF,sector,SC_DIR);
 }
 
 
@@ -164,7 +327,7 @@ BOOL move_fp_window(
   DWORD  sector
 )
 {
-  return move_window(fp->fs,&FPBUF,sector);
+  return move_window(fp->fs,&FPBUF,sector,SC_DATA);
 }
 
 
@@ -180,6 +343,9 @@ FRESULT sync (          /* FR_OK: successful, FR_RW_ERROR: failed */
   FATFS *fs             /* File system object */
 )
 {
+#if _USE_DIRGEN
+  fs->dir_gen++;
+#endif
   FSBUF.dirty = TRUE;
   if (!move_fs_window(fs, 0)) return FR_RW_ERROR;
 #if _USE_FSINFO
@@ -192,7 +358,7 @@ FRESULT sync (          /* FR_OK: successful, FR_RW_ERROR: failed */
     ST_DWORD(&FSBUF.data[FSI_StrucSig], 0x61417272);
     ST_DWORD(&FSBUF.data[FSI_Free_Count], fs->free_clust);
     ST_DWORD(&FSBUF.data[FSI_Nxt_Free], fs->last_clust);
-    disk_write(fs->drive, FSBUF.data, fs->fsi_sector, 1);
+    cache_write(fs->drive, FSBUF.data, fs->fsi_sector);
     fs->fsi_flag = 0;
   }
 #endif
@@ -322,6 +488,8 @@ BOOL remove_chain (     /* TRUE: successful, FALSE: failed */
 #if _USE_FSINFO
       fs->fsi_flag = 1;
 #endif
+    } else if (clust < fs->scan_clust) {
+      fs->scan_free++;                  /* Already passed by the free cluster scan */
     }
     clust = nxt;
   }
@@ -379,6 +547,8 @@ DWORD create_chain (    /* 0: No free cluster, 1: Error, >=2: New cluster number
 #if _USE_FSINFO
     fs->fsi_flag = 1;
 #endif
+  } else if (ncl < fs->scan_clust) {
+    fs->scan_free--;                      /* Already passed by the free cluster scan */
   }
 
   return ncl;   /* Return new cluster number */
@@ -405,6 +575,39 @@ DWORD clust2sect (      /* !=0: sector number, 0: failed - invalid cluster# */
 
 
 
+#if _USE_FASTSEEK != 0
+/*-----------------------------------------------------------------------*/
+/* Look up a cluster in the cluster link map                             */
+/*-----------------------------------------------------------------------*/
+/* The map is tbl[0] = number of runs, followed by one pair per run:    */
+/* cluster count of the file up to the end of the run, first cluster.   */
+
+static
+DWORD clmt_clust (      /* 0: not mapped, >=2: cluster number */
+  FIL *fp,              /* Pointer to the file object */
+  DWORD ofs             /* File offset inside the wanted cluster */
+)
+{
+  DWORD *tbl = fp->cltbl;
+  DWORD cl;
+  UINT lo, hi, mid;
+
+
+  if (!tbl) return 0;
+  cl = ofs / ((DWORD)fp->fs->csize * SS(fp->fs));  /* Cluster index in the file */
+  lo = 0; hi = (UINT)tbl[0];
+  while (lo < hi) {                     /* Find the first run ending after cl */
+    mid = (lo + hi) / 2;
+    if (tbl[1 + 2 * mid] > cl) hi = mid;
+    else lo = mid + 1;
+  }
+  if (lo >= tbl[0]) return 0;           /* Beyond the mapped part of the file */
+  return tbl[2 + 2 * lo] + cl - (lo ? tbl[2 * lo - 1] : 0);
+}
+#endif
+
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Move directory pointer to next                                        */
@@ -812,7 +1015,7 @@ FRESULT reserve_direntry (  /* FR_OK: successful, FR_DENIED: no free entry, FR_R
   FSBUF.sect = sector = clust2sect(fs, clust);
   memset(FSBUF.data, 0, SS(fs));
   for (n = fs->csize; n; n--) {
-    if (disk_write(fs->drive, FSBUF.data, sector, 1) != RES_OK)
+    if (cache_write(fs->drive, FSBUF.data, sector) != RES_OK)
       return FR_RW_ERROR;
     sector++;
   }
@@ -890,6 +1093,7 @@ FRESULT mount_drv(
 
   memset(fs, 0, sizeof(FATFS));       /* Clean-up the file system object */
   fs->drive = LD2PD(drv);             /* Bind the logical drive and a physical drive */
+  ff_cache_invalidate(fs->drive, 0, 0xffffffff); /* The medium may have changed */
   stat = disk_initialize(fs->drive);  /* Initialize low level disk I/O layer */
   if (stat & STA_NOINIT)              /* Check if the drive is ready */
     return FR_NOT_READY;
@@ -1027,6 +1231,8 @@ FRESULT mount_drv(
       LD_DWORD(&FSBUF.data[FSI_StrucSig]) == 0x61417272) {
       fs->last_clust = LD_DWORD(&FSBUF.data[FSI_Nxt_Free]);
       fs->free_clust = LD_DWORD(&FSBUF.data[FSI_Free_Count]);
+      if (fs->free_clust > fs->max_clust - 2)
+        fs->free_clust = 0xFFFFFFFF;      /* Unknown or bogus, needs a scan */
     }
   }
 # endif
@@ -1511,6 +1717,12 @@ FRESULT f_open (
   fp->fsize = LD_DWORD(&dir[DIR_FileSize]);         /* File size */
   fp->fptr = 0;                                     /* Initialize file pointer */
   fp->csect = 1;                                    /* Sector counter */
+#if _USE_FASTSEEK != 0
+  fp->cltbl = NULL;                                 /* No cluster link map */
+#endif
+#if !_FS_READONLY && _USE_PREALLOC != 0
+  fp->prealloc = 0;                                 /* No reserved clusters */
+#endif
   fp->fs = fs; //fp->id = fs->id;       /* Owner file system object of the file */
 
 #if !_FS_READONLY
@@ -1532,6 +1744,12 @@ FRESULT l_opencluster (
   fp->fsize = (DWORD)fs->csize * SS(fs);
   fp->fptr = 0;
   fp->csect = 1;
+#if _USE_FASTSEEK != 0
+  fp->cltbl = NULL;
+#endif
+#if !_FS_READONLY && _USE_PREALLOC != 0
+  fp->prealloc = 0;
+#endif
   fp->fs = fs;
 
   return FR_OK;
@@ -1552,7 +1770,7 @@ FRESULT f_read (
 {
   FRESULT res;
   DWORD clust, sect, remain;
-  UINT rcnt, cc;
+  UINT rcnt, cc, before;
   BYTE *rbuff = buff;
   FATFS *fs = fp->fs;
 
@@ -1571,8 +1789,15 @@ FRESULT f_read (
       if (--fp->csect) {                        /* Decrement left sector counter */
         sect = fp->curr_sect + 1;               /* Get current sector */
       } else {                                  /* On the cluster boundary, get next cluster */
-        clust = (fp->fptr == 0) ?
-          fp->org_clust : get_cluster(fs, fp->curr_clust);
+        if (fp->fptr == 0)
+          clust = fp->org_clust;
+        else {
+#if _USE_FASTSEEK != 0
+          clust = clmt_clust(fp, fp->fptr);
+          if (!clust)
+#endif
+            clust = get_cluster(fs, fp->curr_clust);
+        }
         if (clust < 2 || clust >= fs->max_clust)
           goto fr_error;
         fp->curr_clust = clust;                 /* Current cluster */
@@ -1585,11 +1810,28 @@ FRESULT f_read (
       fp->curr_sect = sect;           /* Update current sector */
       cc = btr / SS(fs);              /* When left bytes >= SS(fs), */
       if (cc) {                       /* Read maximum contiguous sectors directly */
-        if (cc > fp->csect) cc = fp->csect;
+        if (cc > 255) cc = 255;       /* disk_read count limit */
+        clust = fp->curr_clust;
+        before = 0;                   /* Sectors of the run before cluster clust */
+        rcnt = fp->csect;             /* Sectors of the run up to the end of clust */
+        while (rcnt < cc) {           /* Extend the run over contiguous clusters */
+          DWORD next = get_cluster(fs, clust);
+          if (next != clust + 1 || next >= fs->max_clust) break;
+          clust = next;
+          before = rcnt;
+          rcnt += fs->csize;
+        }
+        if (cc > rcnt) cc = rcnt;
         if (disk_read(fs->drive, rbuff, sect, (BYTE)cc) != RES_OK)
           goto fr_error;
-        fp->csect -= (BYTE)(cc - 1);
-        fp->curr_sect += cc - 1;
+        if (clust != fp->curr_clust) {  /* Run ended in a later cluster */
+          fp->curr_clust = clust;
+          fp->curr_sect  = clust2sect(fs, clust) + (cc - before) - 1;
+          fp->csect      = fs->csize - (BYTE)(cc - before) + 1;
+        } else {
+          fp->csect -= (BYTE)(cc - 1);
+          fp->curr_sect += cc - 1;
+        }
         rcnt = cc * SS(fs);
         continue;
       }
@@ -1626,7 +1868,7 @@ FRESULT f_write (
 {
   FRESULT res;
   DWORD clust, sect;
-  UINT wcnt, cc;
+  UINT wcnt, cc, before;
   const BYTE *wbuff = buff;
   FATFS *fs = fp->fs;
 
@@ -1649,7 +1891,11 @@ FRESULT f_write (
           if (clust == 0)                         /* No cluster is created yet */
             fp->org_clust = clust = create_chain(fs, 0);    /* Create a new cluster chain */
         } else {                                  /* Middle or end of file */
-          clust = create_chain(fs, fp->curr_clust);         /* Trace or streach cluster chain */
+#if _USE_FASTSEEK != 0
+          clust = clmt_clust(fp, fp->fptr);       /* Mapped clusters need no chain trace */
+          if (!clust)
+#endif
+            clust = create_chain(fs, fp->curr_clust);       /* Trace or streach cluster chain */
         }
         if (clust == 0) break;                    /* Disk full */
         if (clust == 1 || clust >= fs->max_clust) goto fw_error;
@@ -1661,11 +1907,30 @@ FRESULT f_write (
       fp->curr_sect = sect;                       /* Update current sector */
       cc = btw / SS(fs);                          /* When left bytes >= SS(fs), */
       if (cc) {                                   /* Write maximum contiguous sectors directly */
-        if (cc > fp->csect) cc = fp->csect;
+        if (cc > 255) cc = 255;                   /* disk_write count limit */
+        clust = fp->curr_clust;
+        before = 0;                               /* Sectors of the run before cluster clust */
+        wcnt = fp->csect;                         /* Sectors of the run up to the end of clust */
+        while (wcnt < cc) {                       /* Extend the run over contiguous clusters, */
+          DWORD next = create_chain(fs, clust);   /* stretching the chain if required */
+          if (next == 1) goto fw_error;
+          if (next != clust + 1 || next >= fs->max_clust) break;
+          clust = next;
+          before = wcnt;
+          wcnt += fs->csize;
+        }
+        if (cc > wcnt) cc = wcnt;
         if (disk_write(fs->drive, wbuff, sect, (BYTE)cc) != RES_OK)
           goto fw_error;
-        fp->csect -= (BYTE)(cc - 1);
-        fp->curr_sect += cc - 1;
+        ff_cache_invalidate(fs->drive, sect, cc);
+        if (clust != fp->curr_clust) {            /* Run ended in a later cluster */
+          fp->curr_clust = clust;
+          fp->curr_sect  = clust2sect(fs, clust) + (cc - before) - 1;
+          fp->csect      = fs->csize - (BYTE)(cc - before) + 1;
+        } else {
+          fp->csect -= (BYTE)(cc - 1);
+          fp->curr_sect += cc - 1;
+        }
         wcnt = cc * SS(fs);
         continue;
       }
@@ -1737,6 +2002,125 @@ FRESULT f_sync (
 
 
 
+#if !_FS_READONLY && _USE_PREALLOC != 0
+/*-----------------------------------------------------------------------*/
+/* Reserve a contiguous cluster run for an empty file                    */
+/*-----------------------------------------------------------------------*/
+
+/* Number of clusters searched for a free run before giving up */
+#define PREALLOC_SEARCH 4096
+
+FRESULT f_prealloc (
+  FIL *fp,      /* Pointer to the file object */
+  DWORD count   /* Number of clusters to reserve */
+)
+{
+  FRESULT res;
+  DWORD ncl, start, run, left, cstat, mcl;
+  FATFS *fs = fp->fs;
+
+
+  res = validate(fs /*, fp->id*/);          /* Check validity of the object */
+  if (res != FR_OK) return res;
+  if (fp->flag & FA__ERROR) return FR_RW_ERROR;
+  if (!(fp->flag & FA_WRITE)) return FR_DENIED;
+  mcl = fs->max_clust;
+  if (fp->org_clust || count == 0 || count > mcl - 2) return FR_DENIED;
+
+  /* Look for a free run behind the last allocation */
+  ncl = fs->last_clust;
+  if (ncl < 2 || ncl >= mcl) ncl = 1;
+  start = run = 0;
+  left = mcl - 2;
+  if (left > count + PREALLOC_SEARCH) left = count + PREALLOC_SEARCH;
+  for (; left; left--) {
+    if (++ncl >= mcl) {                     /* Wrap around, runs can't */
+      ncl = 2;
+      run = 0;
+    }
+    cstat = get_cluster(fs, ncl);
+    if (cstat == 1) return FR_RW_ERROR;
+    if (cstat != 0) {
+      run = 0;
+      continue;
+    }
+    if (run++ == 0) start = ncl;
+    if (run == count) break;
+  }
+  if (run < count) return FR_DENIED;        /* No run found, allocate on demand */
+
+  /* Link the run into a chain */
+  for (ncl = start; ncl < start + count - 1; ncl++)
+    if (!put_cluster(fs, ncl, ncl + 1)) goto fp_error;
+  if (!put_cluster(fs, ncl, 0x0FFFFFFF)) goto fp_error;
+
+  fs->last_clust = ncl;
+  if (fs->free_clust != 0xFFFFFFFF) {
+    fs->free_clust -= count;
+#if _USE_FSINFO
+    fs->fsi_flag = 1;
+#endif
+  } else if (start < fs->scan_clust) {      /* Partly passed by the free cluster scan */
+    fs->scan_free -= (fs->scan_clust - start < count) ? fs->scan_clust - start : count;
+  }
+
+  fp->org_clust = start;
+  fp->prealloc = 1;
+  fp->flag |= FA__WRITTEN;
+  return FR_OK;
+
+fp_error: /* Abort this file due to an unrecoverable error */
+  fp->flag |= FA__ERROR;
+  return FR_RW_ERROR;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Release the reserved clusters behind the end of the file              */
+/*-----------------------------------------------------------------------*/
+
+static
+BOOL trim_chain (       /* TRUE: successful, FALSE: failed */
+  FIL *fp               /* Pointer to the file object */
+)
+{
+  DWORD clust, ncl, n;
+  FATFS *fs = fp->fs;
+
+
+  fp->prealloc = 0;
+  if (fp->fsize == 0) {                     /* Nothing written, remove the whole run */
+    if (!remove_chain(fs, fp->org_clust)) return FALSE;
+    fs->last_clust = fp->org_clust - 1;
+    fp->org_clust = 0;
+    fp->flag |= FA__WRITTEN;
+    return TRUE;
+  }
+
+  /* Find the cluster holding the last byte of the file */
+  clust = fp->org_clust;
+  n = (fp->fsize - 1) / ((DWORD)fs->csize * SS(fs));
+  while (n--) {
+    clust = get_cluster(fs, clust);
+    if (clust < 2 || clust >= fs->max_clust) return FALSE;
+  }
+
+  ncl = get_cluster(fs, clust);
+  if (ncl < 2) return FALSE;
+  if (ncl < fs->max_clust) {
+    if (!put_cluster(fs, clust, 0x0FFFFFFF)) return FALSE;
+    if (!remove_chain(fs, ncl)) return FALSE;
+    fs->last_clust = clust;                 /* Next allocation continues here */
+  }
+  return TRUE;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Close File                                                            */
 /*-----------------------------------------------------------------------*/
@@ -1749,11 +2133,21 @@ FRESULT f_close (
 
 
 #if !_FS_READONLY
+#if _USE_PREALLOC != 0
+  if (fp->prealloc && validate(fp->fs) == FR_OK &&
+      !(fp->flag & FA__ERROR) && !trim_chain(fp))
+    fp->flag |= FA__ERROR;
+#endif
   res = f_sync(fp);
 #else
   res = validate(fp->fs /*, fp->id*/);
 #endif
-  if (res == FR_OK) fp->fs = NULL;
+  if (res == FR_OK) {
+    fp->fs = NULL;
+#if _USE_FASTSEEK != 0
+    fp->cltbl = NULL;
+#endif
+  }
   return res;
 }
 
@@ -1798,6 +2192,13 @@ FRESULT f_lseek (
     } else {
       fp->csect = 1;
 
+#if _USE_FASTSEEK != 0
+      clust = clmt_clust(fp, ofs - 1);
+      if (clust) {                /* Target cluster is in the link map */
+        fp->fptr = (((DWORD)((ofs-1)/csize))*csize);  /* Set file R/W pointer to start of cluster */
+        ofs-=fp->fptr;            /* Offset in the cluster, 1..csize */
+      } else
+#endif
       if(fp->fptr && ofs > fp->fptr) {
         fp->fptr = (((DWORD)((fp->fptr-1)/csize))*csize);  /* Set file R/W pointer to start of cluster */
         ofs-=fp->fptr;            /* subtract off clusters traversed */
@@ -1857,6 +2258,57 @@ fk_error: /* Abort this file due to an unrecoverable error */
 
 
 
+#if _USE_FASTSEEK != 0
+/*-----------------------------------------------------------------------*/
+/* Build a cluster link map for a file                                   */
+/*-----------------------------------------------------------------------*/
+/* On success the map is attached to the file object, it stays valid    */
+/* as long as the existing cluster chain is not changed. FR_DENIED means */
+/* the chain has more runs than fit into the table.                      */
+
+FRESULT f_linkmap (
+  FIL *fp,      /* Pointer to the file object */
+  DWORD *tbl,   /* Pointer to the map table */
+  UINT size     /* Size of the map table in DWORDs */
+)
+{
+  FRESULT res;
+  DWORD clust, pclust, start, ncl;
+  UINT runs;
+  FATFS *fs = fp->fs;
+
+
+  res = validate(fs /*, fp->id*/);          /* Check validity of the object */
+  if (res != FR_OK) return res;
+  fp->cltbl = NULL;
+  if (fp->flag & FA__ERROR) return FR_RW_ERROR;
+  if (!move_fp_window(fp,0)) return FR_RW_ERROR;
+
+  runs = 0; ncl = 0;
+  clust = fp->org_clust;
+  while (clust >= 2 && clust < fs->max_clust) {
+    start = clust;
+    do {                                    /* Follow a run of contiguous clusters */
+      pclust = clust;
+      ncl++;
+      clust = get_cluster(fs, clust);
+    } while (clust == pclust + 1 && clust < fs->max_clust);
+    if (clust == 1) return FR_RW_ERROR;
+    if (2 * runs + 3 > size) return FR_DENIED;  /* Table full */
+    tbl[1 + 2 * runs] = ncl;                /* Cluster count up to the end of the run */
+    tbl[2 + 2 * runs] = start;              /* First cluster of the run */
+    runs++;
+  }
+  tbl[0] = runs;
+  fp->cltbl = tbl;
+
+  return FR_OK;
+}
+#endif
+
+
+
+
 #if _FS_MINIMIZE <= 1
 /*-----------------------------------------------------------------------*/
 /* Create a directroy object                                             */
@@ -1956,6 +2408,29 @@ FRESULT l_opendir(FATFS* fs, DWORD cluster, DIR *dj) {
 }
 
 
+/**
+ * l_seekdir - open a directory by cluster number at a given entry
+ * @fs     : Pointer to the FATFS structure of the target file system
+ * @cluster: Number of the start cluster of the directory (0=root)
+ * @dj     : Pointer to the DIR structure to be filled
+ * @index  : Index of the directory entry to move to
+ *
+ * This function works like l_opendir, but moves the directory object to
+ * entry @index. Unlike reading forward with f_readdir it does not skip
+ * entries, so the position is exact even if entries in front of @index
+ * were deleted. Returns FR_OK or FR_RW_ERROR if the directory is shorter.
+ */
+FRESULT l_seekdir(FATFS* fs, DWORD cluster, DIR *dj, WORD index) {
+  l_opendir(fs, cluster, dj);
+
+  while (dj->index < index)
+    if (!next_dir_entry(dj))
+      return FR_RW_ERROR;
+
+  return FR_OK;
+}
+
+
 
 
 
@@ -2148,6 +2623,66 @@ ft_error: /* Abort this file due to an unrecoverable error */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Count free clusters, resuming where the previous call stopped         */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT scan_free (
+  FATFS *fs,          /* Pointer to file system object */
+  DWORD maxclust,     /* Stop after maxclust free clusters were found (0 = no limit) */
+  UINT sectors        /* Stop after scanning this many FAT sectors (0 = no limit) */
+)
+{
+  DWORD sect;
+  WORD ofs, entries;
+  BYTE *p, limited = (sectors != 0);
+
+  if (fs->free_clust <= fs->max_clust - 2) return FR_OK;
+
+  if (fs->scan_clust < 2) {             /* Start a new scan */
+    fs->scan_clust = 2;
+    fs->scan_free  = 0;
+  }
+
+  if (fs->fs_type == FS_FAT12) {        /* Small enough to finish in one go */
+    for (; fs->scan_clust < fs->max_clust; fs->scan_clust++) {
+      sect = get_cluster(fs, fs->scan_clust);
+      if (sect == 1) return FR_RW_ERROR;
+      if (sect == 0) fs->scan_free++;
+    }
+  } else {
+    entries = SS(fs) / (fs->fs_type == FS_FAT16 ? 2 : 4);
+    while (fs->scan_clust < fs->max_clust) {
+      if (maxclust && fs->scan_free >= maxclust) return FR_OK;
+      if (limited && !sectors--) return FR_OK;
+
+      sect = fs->fatbase + fs->scan_clust / entries;
+      ofs  = fs->scan_clust % entries;
+      if (!move_fs_window(fs, sect)) return FR_RW_ERROR;
+      p = FSBUF.data;
+      do {
+        if (fs->fs_type == FS_FAT16) {
+          if (LD_WORD(p + 2 * ofs) == 0) fs->scan_free++;
+        } else {
+          if ((LD_DWORD(p + 4 * ofs) & 0x0FFFFFFF) == 0) fs->scan_free++;
+        }
+      } while (++fs->scan_clust < fs->max_clust && ++ofs < entries);
+    }
+  }
+
+  /* Scan complete, from now on the count is updated on every change */
+  fs->free_clust = fs->scan_free;
+  fs->scan_clust = 0;
+#if _USE_FSINFO
+  if (fs->fs_type == FS_FAT32) fs->fsi_flag = 1;
+#endif
+  return FR_OK;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get Number of Free Clusters, stop if maxclust found                   */
 /*-----------------------------------------------------------------------*/
@@ -2160,58 +2695,36 @@ FRESULT l_getfree (
 )
 {
   FRESULT res;
-  DWORD n, clust, sect;
-  BYTE fat, f, *p;
 
   /* Get drive number */
   res = auto_mount(&drv, &fs, 0);
   if (res != FR_OK) return res;
 
-  /* If number of free cluster is valid, return it without cluster scan. */
-  if (fs->free_clust <= fs->max_clust - 2) {
+  /* Continue the scan if the number of free clusters is not known yet */
+  res = scan_free(fs, maxclust, 0);
+  if (res != FR_OK) return res;
+
+  if (fs->free_clust <= fs->max_clust - 2)
     *nclust = fs->free_clust;
-    return FR_OK;
-  }
+  else
+    *nclust = maxclust;     /* Scan stopped early, at least maxclust are free */
+  return FR_OK;
+}
 
-  /* Get number of free clusters */
-  fat = fs->fs_type;
-  n = 0;
-  if (fat == FS_FAT12) {
-    clust = 2;
-    do {
-      if ((WORD)get_cluster(fs, clust) == 0) n++;
-    } while (++clust < fs->max_clust);
-  } else {
-    clust = fs->max_clust;
-    sect = fs->fatbase;
-    f = 0; p = 0;
-    do {
-      if (maxclust && n >= maxclust) {
-        n = maxclust;
-        break;
-      }
-      if (!f) {
-        if (!move_fs_window(fs, sect++)) return FR_RW_ERROR;
-        p = FSBUF.data;
-      }
-      if (fat == FS_FAT16) {
-        if (LD_WORD(p) == 0) n++;
-        p += 2; f += 1;
-      } else {
-        if (LD_DWORD(p) == 0) n++;
-        p += 4; f += 2;
-      }
-    } while (--clust);
-  }
-  if (n < maxclust) {
-    fs->free_clust = n;
-#if _USE_FSINFO
-    if (fat == FS_FAT32) fs->fsi_flag = 1;
-#endif
-  }
 
-  *nclust = n;
-  return FR_OK;
+
+
+/*-----------------------------------------------------------------------*/
+/* Continue counting free clusters in the background                     */
+/*-----------------------------------------------------------------------*/
+
+FRESULT l_scanfree (
+  FATFS *fs,          /* Pointer to file system object */
+  UINT sectors        /* Number of FAT sectors to scan at most */
+)
+{
+  if (!fs->fs_type) return FR_NOT_ENABLED;
+  return scan_free(fs, 0, sectors);
 }
 
 /*-----------------------------------------------------------------------*/
@@ -2388,7 +2901,7 @@ FRESULT f_mkdir (
   fw = FSBUF.data;
   memset(fw, 0, SS(fs));                       /* Clear the new directory table */
   for (n = 1; n < fs->csize; n++) {
-    if (disk_write(fs->drive, fw, ++dsect, 1) != RES_OK)
+    if (cache_write(fs->drive, fw, ++dsect) != RES_OK)
       return FR_RW_ERROR;
   }
   memset(&fw[DIR_Name], ' ', 8+3);             /* Create "." entry */
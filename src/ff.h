@@ -112,6 +112,42 @@
 #define _USE_TRUNCATE 0
 #define _USE_UTIME   0
 
+/* If set to 1, f_linkmap() can attach a run-length cluster map to an open
+/  file. f_lseek() and the cluster changes in f_read()/f_write() then look
+/  up clusters in the map instead of following the FAT chain.  */
+#ifdef CONFIG_IMAGE_FASTSEEK
+#define _USE_FASTSEEK 1
+#else
+#define _USE_FASTSEEK 0
+#endif
+
+/* If set to 1, f_prealloc() can reserve a contiguous cluster run for a new
+/  file. Clusters that were not used up are released by f_close().  */
+#ifdef CONFIG_FAT_PREALLOC
+#define _USE_PREALLOC 1
+#else
+#define _USE_PREALLOC 0
+#endif
+
+/* If set to 1, FATFS counts the changes to its directories in dir_gen so
+/  a cache of converted directory entries can detect stale data.  */
+#ifdef CONFIG_FAT_DIRCACHE
+#define _USE_DIRGEN 1
+#else
+#define _USE_DIRGEN 0
+#endif
+
+/* If set to 1, a sector cache sits below the FatFs window. It keeps
+/  recently used sectors in separate LRU pools for FAT, directory and file
+/  data sectors so switching the window between them does not always need
+/  a card read. The cache is write-through, the pool sizes are set by
+/  CONFIG_SECTOR_CACHE_FAT, _DIR and _DATA.  */
+#if defined(CONFIG_SECTOR_CACHE_FAT) || defined(CONFIG_SECTOR_CACHE_DIR) || defined(CONFIG_SECTOR_CACHE_DATA)
+#define _USE_SECTOR_CACHE 1
+#else
+#define _USE_SECTOR_CACHE 0
+#endif
+
 #include "integer.h"
 
 #if _USE_LFN_DBCS != 0
@@ -160,6 +196,11 @@ typedef struct _FATFS {
 #if !_FS_READONLY
     DWORD   last_clust;     /* Last allocated cluster */
     DWORD   free_clust;     /* Number of free clusters */
+    DWORD   scan_clust;     /* Next cluster of the free cluster scan, 0 if none is running */
+    DWORD   scan_free;      /* Free clusters found by the scan so far */
+#if _USE_DIRGEN
+    WORD    dir_gen;        /* Incremented whenever a directory entry changes */
+#endif
 #if _USE_FSINFO
     DWORD   fsi_sector;     /* fsinfo sector */
     BYTE    fsi_flag;       /* fsinfo dirty flag (1:must be written back) */
@@ -204,6 +245,12 @@ typedef struct _FIL {
     DWORD   dir_sect;       /* Sector containing the directory entry */
     BYTE*   dir_ptr;        /* Ponter to the directory entry in the window */
 #endif
+#if _FS_READONLY == 0 && _USE_PREALLOC != 0
+    BYTE    prealloc;       /* Clusters behind the file end are released on close */
+#endif
+#if _USE_FASTSEEK != 0
+    DWORD*  cltbl;          /* Pointer to the cluster link map (NULL: none) */
+#endif
 #if _USE_LESS_BUF == 0 && _USE_1_BUF == 0
     BUF   buf;              /* File R/W buffer */
 #endif
@@ -313,8 +360,21 @@ FRESULT f_chdir (const UCHAR*);                             /* Change current di
 
 /* Low Level functions */
 FRESULT l_opendir(FATFS* fs, DWORD cluster, DIR *dirobj);   /* Open an existing directory by its start cluster */
+FRESULT l_seekdir(FATFS* fs, DWORD cluster, DIR *dirobj, WORD index); /* Same, but move to an entry index */
 FRESULT l_opencluster(FATFS *fs, FIL *fp, DWORD clust);     /* Open a cluster by number as a read-only file */
 FRESULT l_getfree (FATFS*, const UCHAR*, DWORD*, DWORD);    /* Get number of free clusters on the drive, limited */
+FRESULT l_scanfree (FATFS*, UINT);                          /* Continue counting free clusters for a few FAT sectors */
+#if _USE_FASTSEEK != 0
+FRESULT f_linkmap (FIL*, DWORD*, UINT);                     /* Build a cluster link map for a file */
+#endif
+#if _FS_READONLY == 0 && _USE_PREALLOC != 0
+FRESULT f_prealloc (FIL*, DWORD);                           /* Reserve contiguous clusters for an empty file */
+#endif
+#if _USE_SECTOR_CACHE != 0
+void ff_cache_invalidate (BYTE, DWORD, DWORD);              /* Drop cached sectors written behind FatFs' back */
+#else
+static inline void ff_cache_invalidate(BYTE drv, DWORD sector, DWORD count) {}
+#endif
 
 #if _USE_STRFUNC
 #define feof(fp) ((fp)->fptr == (fp)->fsize)
@@ -475,7 +475,7 @@ static void load_directory(uint8_t secondary) {
 
   uint8_t *name;
 
-  buf->secondary = secondary;
+  set_buffer_secondary(buf, secondary);
   buf->read      = 1;
   buf->lastused  = 31;
 
@@ -694,14 +694,14 @@ scandone:
 uint8_t directbuffer_refill(buffer_t *buf) {
   uint8_t sec = buf->secondary;
 
-  buf->secondary = BUFFER_SEC_CHAIN - sec;
+  set_buffer_secondary(buf, BUFFER_SEC_CHAIN - sec);
 
   if (buf->pvt.buffer.next == NULL)
     buf = buf->pvt.buffer.first;
   else
     buf = buf->pvt.buffer.next;
 
-  buf->secondary = sec;
+  set_buffer_secondary(buf, sec);
   buf->position  = 0;
   buf->mustflush = 0;
   return 0;
@@ -748,12 +748,12 @@ static void open_buffer(uint8_t secondary) {
       return;
 
     /* Allocate a chain of linked buffers */
-    buf = alloc_linked_buffers(count);
+    buf = alloc_linked_buffers(count, false);
     if (buf == NULL)
       return;
 
     do {
-      buf->secondary       = BUFFER_SEC_CHAIN - secondary;
+      set_buffer_secondary(buf, BUFFER_SEC_CHAIN - secondary);
       buf->refill          = directbuffer_refill;
       buf->cleanup         = largebuffer_cleanup;
       buf->read            = 1;
@@ -768,7 +768,7 @@ static void open_buffer(uint8_t secondary) {
     buf = prev->pvt.buffer.first;
 
     /* Set the first buffer as active by using the real secondary */
-    buf->secondary = secondary;
+    set_buffer_secondary(buf, secondary);
 
   } else {
     /* Normal buffer request */
@@ -777,7 +777,7 @@ static void open_buffer(uint8_t secondary) {
     if (!buf)
       return;
 
-    buf->secondary        = secondary;
+    set_buffer_secondary(buf, secondary);
     buf->read             = 1;
     buf->position         = 1;  /* Sic! */
     buf->lastused         = 255;
@@ -806,7 +806,7 @@ void file_open_previous(void) {
   if (!buf)
     return;
 
-  buf->secondary = 0;
+  set_buffer_secondary(buf, 0);
 
   display_filename_read(path.part, CBM_NAME_LENGTH, dent.name);
   open_read(&path, &dent, buf);
@@ -1033,7 +1033,7 @@ void file_open(uint8_t secondary) {
   if (!buf)
     return;
 
-  buf->secondary = secondary;
+  set_buffer_secondary(buf, secondary);
 
   if(filetype == TYPE_REL) {
     display_filename_write(path.part,CBM_NAME_LENGTH,dent.name);
@@ -0,0 +1,146 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   arch-config.h: The main architecture-specific config header for the
+                 host-native benchmark build
+
+*/
+
+#ifndef ARCH_CONFIG_H
+#define ARCH_CONFIG_H
+
+#include <stdint.h>
+
+/* ----- Host-native build: no real hardware at all ------ */
+
+/* Return value of buttons_read() */
+typedef unsigned int rawbutton_t;
+
+/* Interrupt handler for system tick */
+#define SYSTEM_TICK_HANDLER void host_tick_handler(void)
+
+/* P00 name cache is in normal RAM */
+#define P00CACHE_ATTRIB
+
+/* DNP BAM cache is in normal RAM */
+#define BAMCACHE_ATTRIB
+
+/* FAT directory cache is in normal RAM */
+#define DIRCACHE_ATTRIB
+
+/* Buffer pool arena in normal RAM, see system.c */
+#ifdef CONFIG_BUFFER_POOL
+extern uint8_t host_pool_arena[];
+#  define BUFFER_POOL_START host_pool_arena
+#  define BUFFER_POOL_END   (host_pool_arena + CONFIG_BUFFER_POOL * 256)
+#endif
+
+/* EEPROMFS: kept in the RAM-backed EEPROM emulation */
+#  define EEPROMFS_OFFSET     512
+#  define EEPROMFS_SIZE       7680
+#  define EEPROMFS_ENTRIES    16
+#  define EEPROMFS_SECTORSIZE 64
+
+#if CONFIG_HARDWARE_VARIANT == 200
+/* ---------- Hardware configuration: host build ---------- */
+/* The disk is an image file mapped into memory, see memdisk.c */
+#  define HAVE_MEMDISK
+
+static inline uint8_t device_hw_address(void) {
+  return CONFIG_DEFAULT_ADDR;
+}
+
+static inline void device_hw_address_init(void) {}
+
+static inline void leds_init(void) {}
+static inline void set_busy_led(uint8_t state) {}
+static inline void set_dirty_led(uint8_t state) {}
+static inline void toggle_dirty_led(void) {}
+
+static inline void buttons_init(void) {}
+
+static inline rawbutton_t buttons_read(void) {
+  return 0;
+}
+
+static inline void iec_interrupts_init(void) {}
+
+#  ifdef CONFIG_HAVE_IEEE
+/* The IEEE-488 bus is simulated by host/ieeebus.c */
+#    include "ieeebus.h"
+#    define IEEE_INPUT_ATN        ieeebus_ctrl_pin()
+#    define IEEE_PORT_ATN         ieeebus_regs.ctrl_port
+#    define IEEE_DDR_ATN          ieeebus_regs.ctrl_ddr
+#    define IEEE_PIN_ATN          IEEEBUS_ATN
+#    define IEEE_INPUT_NDAC       ieeebus_ctrl_pin()
+#    define IEEE_PORT_NDAC        ieeebus_regs.ctrl_port
+#    define IEEE_DDR_NDAC         ieeebus_regs.ctrl_ddr
+#    define IEEE_PIN_NDAC         IEEEBUS_NDAC
+#    define IEEE_INPUT_NRFD       ieeebus_ctrl_pin()
+#    define IEEE_PORT_NRFD        ieeebus_regs.ctrl_port
+#    define IEEE_DDR_NRFD         ieeebus_regs.ctrl_ddr
+#    define IEEE_PIN_NRFD         IEEEBUS_NRFD
+#    define IEEE_INPUT_DAV        ieeebus_ctrl_pin()
+#    define IEEE_PORT_DAV         ieeebus_regs.ctrl_port
+#    define IEEE_DDR_DAV          ieeebus_regs.ctrl_ddr
+#    define IEEE_PIN_DAV          IEEEBUS_DAV
+#    define IEEE_INPUT_EOI        ieeebus_ctrl_pin()
+#    define IEEE_PORT_EOI         ieeebus_regs.ctrl_port
+#    define IEEE_DDR_EOI          ieeebus_regs.ctrl_ddr
+#    define IEEE_PIN_EOI          IEEEBUS_EOI
+#    define IEEE_INPUT_IFC        ieeebus_ctrl_pin()
+#    define IEEE_PORT_IFC         ieeebus_regs.ctrl_port
+#    define IEEE_DDR_IFC          ieeebus_regs.ctrl_ddr
+#    define IEEE_PIN_IFC          IEEEBUS_IFC
+#    define IEEE_PORT_TE          ieeebus_regs.ctrl_port
+#    define IEEE_DDR_TE           ieeebus_regs.ctrl_ddr
+#    define IEEE_PIN_TE           IEEEBUS_TE
+#    define IEEE_D_PIN            ieeebus_data_pin()
+#    define IEEE_D_PORT           ieeebus_regs.data_port
+#    define IEEE_D_DDR            ieeebus_regs.data_ddr
+
+/* ATN interrupt, triggered by the controller in ieeebus.c */
+#    define EIMSK                 ieeebus_regs.eimsk
+#    define EICRA                 ieeebus_regs.eicra
+#    define INT0                  0
+#    define ISC00                 0
+#    define ISC01                 1
+#    define _BV(bit)              (1 << (bit))
+
+static inline void ieee_interface_init(void) {}
+#  endif
+
+#else
+#  error "CONFIG_HARDWARE_VARIANT is unset or set to an unknown value."
+#endif
+
+
+/* ---------------- End of user-configurable options ---------------- */
+
+static inline void display_intrq_init(void) {}
+
+static inline unsigned int display_intrq_active(void) {
+  return 0;
+}
+
+#endif
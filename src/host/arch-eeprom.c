@@ -0,0 +1,90 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   arch-eeprom.c: RAM-backed EEPROM emulation
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "config.h"
+#include "arch-eeprom.h"
+
+#define EEPROM_SIZE 8192
+
+/* start/end of the EEMEM section, provided by the linker */
+extern uint8_t __start_host_eeprom[];
+extern uint8_t __stop_host_eeprom[];
+
+static uint8_t eeprom_data[EEPROM_SIZE];
+
+/* converts from a pointer to an address in the EEPROM */
+static unsigned int convert_address(void *a) {
+  uint8_t *ptr = a;
+
+  if (ptr >= __start_host_eeprom && ptr < __stop_host_eeprom)
+    return ptr - __start_host_eeprom;
+  else
+    return (uintptr_t)a & (EEPROM_SIZE-1);
+}
+
+uint8_t eeprom_read_byte(void *addr) {
+  return eeprom_data[convert_address(addr)];
+}
+
+uint16_t eeprom_read_word(void *addr) {
+  unsigned int a = convert_address(addr);
+
+  return eeprom_data[a] | (eeprom_data[(a+1) & (EEPROM_SIZE-1)] << 8);
+}
+
+void eeprom_read_block(void *destptr, void *addr, unsigned int length) {
+  uint8_t *dest = destptr;
+  unsigned int a = convert_address(addr);
+
+  while (length--) {
+    *dest++ = eeprom_data[a];
+    a = (a + 1) & (EEPROM_SIZE-1);
+  }
+}
+
+void eeprom_write_byte(void *addr, uint8_t value) {
+  eeprom_data[convert_address(addr)] = value;
+}
+
+void eeprom_write_word(void *addr, uint16_t value) {
+  unsigned int a = convert_address(addr);
+
+  eeprom_data[a] = value & 0xff;
+  eeprom_data[(a+1) & (EEPROM_SIZE-1)] = value >> 8;
+}
+
+void eeprom_write_block(void *srcptr, void *addr, unsigned int length) {
+  uint8_t *src = srcptr;
+  unsigned int a = convert_address(addr);
+
+  while (length--) {
+    eeprom_data[a] = *src++;
+    a = (a + 1) & (EEPROM_SIZE-1);
+  }
+}
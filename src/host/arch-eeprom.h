@@ -0,0 +1,45 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   arch-eeprom.h: RAM-backed EEPROM emulation for the host build
+
+*/
+
+#ifndef ARCH_EEPROM_H
+#define ARCH_EEPROM_H
+
+/* EEPROM variables are collected in their own section so their */
+/* addresses can be translated to offsets in the emulated EEPROM */
+#define EEMEM __attribute__((section("host_eeprom")))
+
+/* No safety required */
+#define eeprom_safety() do {} while (0)
+
+uint8_t  eeprom_read_byte(void *addr);
+uint16_t eeprom_read_word(void *addr);
+void     eeprom_read_block(void *destptr, void *addr, unsigned int length);
+void     eeprom_write_byte(void *addr, uint8_t value);
+void     eeprom_write_word(void *addr, uint16_t value);
+void     eeprom_write_block(void *srcptr, void *addr, unsigned int length);
+
+#endif
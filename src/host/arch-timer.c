@@ -0,0 +1,86 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   arch-timer.c: Architecture-specific timer functions (host version)
+
+*/
+
+#include <sys/time.h>
+#include <unistd.h>
+#include "config.h"
+#include "timer.h"
+
+/* Note: <time.h> can't be used here because src/time.h shadows it */
+
+static struct timeval tick_base;
+static struct timeval timeout_end;
+
+/* returns the microseconds elapsed from a to b */
+static int64_t timeval_diff_us(const struct timeval *a, const struct timeval *b) {
+  return (int64_t)(b->tv_sec - a->tv_sec) * 1000000 +
+         (b->tv_usec - a->tv_usec);
+}
+
+void timer_init(void) {
+  gettimeofday(&tick_base, NULL);
+  ticks = 0;
+}
+
+/**
+ * host_update_ticks - update the tick counter
+ *
+ * There is no timer interrupt in the host build, so the tick counter
+ * is derived from the system clock whenever this function is called.
+ */
+void host_update_ticks(void) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  ticks = timeval_diff_us(&tick_base, &now) / (1000000 / HZ);
+}
+
+void delay_us(unsigned int time) {
+  usleep(time);
+  host_update_ticks();
+}
+
+void delay_ms(unsigned int time) {
+  delay_us(time * 1000);
+}
+
+void start_timeout(unsigned int usecs) {
+  gettimeofday(&timeout_end, NULL);
+  timeout_end.tv_sec  += usecs / 1000000;
+  timeout_end.tv_usec += usecs % 1000000;
+  if (timeout_end.tv_usec >= 1000000) {
+    timeout_end.tv_sec++;
+    timeout_end.tv_usec -= 1000000;
+  }
+}
+
+unsigned int has_timed_out(void) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return timeval_diff_us(&timeout_end, &now) >= 0;
+}
@@ -0,0 +1,44 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   atomic.h: ATOMIC_BLOCK replacement for the host build
+
+*/
+
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+/* The host build is single-threaded and never interrupted by */
+/* the firmware's own interrupt handlers, so an atomic block  */
+/* is simply a block that runs exactly once.                  */
+#define ATOMIC_BLOCK(type) for (type, __ToDo = 1; __ToDo; __ToDo = 0)
+
+#define ATOMIC_RESTORESTATE unsigned int __state __attribute__((unused)) = 0
+#define ATOMIC_FORCEON      unsigned int __state __attribute__((unused)) = 0
+
+#define NONATOMIC_BLOCK(type) ATOMIC_BLOCK(type)
+
+#define NONATOMIC_RESTORESTATE ATOMIC_RESTORESTATE
+#define NONATOMIC_FORCEOFF     ATOMIC_FORCEON
+
+#endif
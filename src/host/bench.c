@@ -0,0 +1,499 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   bench.c: Benchmark driver for the host-native build
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "config.h"
+#include "buffers.h"
+#include "d64ops.h"
+#include "diskio.h"
+#include "doscmd.h"
+#include "eeprom-conf.h"
+#include "errormsg.h"
+#include "fileops.h"
+#include "filesystem.h"
+#include "ieeebus.h"
+#include "imagecache.h"
+#include "memdisk.h"
+#include "system.h"
+#include "timer.h"
+
+/* Global variables, normally defined in main.c */
+uint8_t device_address = CONFIG_DEFAULT_ADDR;
+
+/* Byte sink for data sent by the "drive" */
+typedef void (*bench_sink_t)(uint8_t byte);
+
+static bool verbose;
+
+/* SD card cost model: per-command overhead and per-sector transfer time */
+/* Defaults approximate an SD card on the 8 MHz SPI bus of the AVRs     */
+static unsigned int card_cmd_us    = 250;
+static unsigned int card_sector_us = 520;
+
+/* IEEE-488 bus model: delays of the simulated PET in nanoseconds and   */
+/* the time of one read of the bus lines by the firmware               */
+static ieeebus_timing_t bus_timing = {
+  .dav_ns  = 5000,
+  .nrfd_ns = 40000,
+  .ndac_ns = 10000,
+  .poll_ns = 375,
+};
+
+/* ATN/IFC injection for the next transfer on the simulated bus */
+static uint32_t inject_atn = IEEEBUS_NO_INJECT;
+static uint32_t inject_ifc = IEEEBUS_NO_INJECT;
+
+/* ------------------------------------------------------------------ */
+/*  Bus emulation - mirrors the buffer handling of ieee.c             */
+/* ------------------------------------------------------------------ */
+
+/* Equivalent of the common end of ieee488_Unlisten */
+static void bus_unlisten(void) {
+  command_length = 0;
+  d64_bam_commit();
+}
+
+/* Equivalent of the OPEN handling in ieee488_Unlisten */
+static void bus_open(uint8_t sa, const char *name) {
+  command_length = strlen(name);
+  if (command_length > CONFIG_COMMAND_BUFFER_SIZE)
+    command_length = CONFIG_COMMAND_BUFFER_SIZE;
+  memcpy(command_buffer, name, command_length);
+  datacrc = 0xffff;
+  file_open(sa);
+  bus_unlisten();
+}
+
+/* Equivalent of a command sent to channel 15 */
+static void bus_command(const char *cmd) {
+  command_length = strlen(cmd);
+  if (command_length > CONFIG_COMMAND_BUFFER_SIZE)
+    command_length = CONFIG_COMMAND_BUFFER_SIZE;
+  memcpy(command_buffer, cmd, command_length);
+  parse_doscommand();
+  bus_unlisten();
+}
+
+/* Equivalent of the CLOSE handling in handle_ieee488 */
+static void bus_close(uint8_t sa) {
+  buffer_t *buf = find_buffer(sa);
+
+  if (buf != NULL) {
+    buf->cleanup(buf);
+    free_buffer(buf);
+  }
+}
+
+/* Equivalent of ieee488_TalkLoop without the handshake, returns bytes sent */
+static uint32_t bus_talk(uint8_t sa, bench_sink_t sink) {
+  uint32_t bytes = 0;
+  buffer_t *buf = find_buffer(sa);
+
+  if (buf == NULL)
+    return 0;
+
+  while (buf->read) {
+    do {
+      if (sink)
+        sink(buf->data[buf->position]);
+      bytes++;
+    } while (buf->position++ < buf->lastused);
+
+    if (buf->sendeoi && sa != 15 && !buf->recordlen &&
+        buf->refill != directbuffer_refill) {
+      buf->read = 0;
+      break;
+    }
+
+    if (buf->refill(buf))
+      break;
+
+    buf = find_buffer(sa);
+  }
+
+  return bytes;
+}
+
+/* Equivalent of ieee488_ListenLoop for data, returns bytes accepted */
+static uint32_t bus_listen(uint8_t sa, uint32_t length) {
+  uint32_t bytes = 0;
+  buffer_t *buf = find_buffer(sa);
+
+  if (buf == NULL || !buf->write)
+    return 0;
+
+  while (bytes < length) {
+    if (buf->mustflush) {
+      if (buf->refill(buf))
+        break;
+      buf = find_buffer(sa);
+    }
+
+    /* two-byte load address followed by a simple pattern */
+    buf->data[buf->position] = (bytes < 2) ? (bytes ? 0x08 : 0x01) : bytes & 0xff;
+    mark_buffer_dirty(buf);
+
+    if (buf->lastused < buf->position)
+      buf->lastused = buf->position;
+    buf->position++;
+    bytes++;
+
+    if (buf->position == 0)
+      buf->mustflush = 1;
+  }
+
+  bus_unlisten();
+  return bytes;
+}
+
+/* Prints and clears the error channel like a status read from the host */
+static void print_status(void) {
+  uint8_t *ptr = error_buffer;
+
+  while (*ptr && *ptr != 13)
+    putchar(*ptr++);
+  putchar('\n');
+
+  set_error(ERROR_OK);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Measurement                                                       */
+/* ------------------------------------------------------------------ */
+
+static struct timeval  start_time;
+static memdisk_stats_t start_stats;
+
+static void bench_start(void) {
+  start_stats = memdisk_stats;
+  gettimeofday(&start_time, NULL);
+}
+
+static void bench_end(const char *op, const char *arg, uint32_t bytes) {
+  struct timeval end;
+  int64_t usecs;
+  uint32_t cmds, sectors;
+  uint64_t card_us;
+
+  gettimeofday(&end, NULL);
+  host_update_ticks();
+  usecs = (int64_t)(end.tv_sec - start_time.tv_sec) * 1000000 +
+          (end.tv_usec - start_time.tv_usec);
+  if (usecs < 1)
+    usecs = 1;
+
+  cmds    = memdisk_stats.read_cmds     - start_stats.read_cmds +
+            memdisk_stats.write_cmds    - start_stats.write_cmds;
+  sectors = memdisk_stats.read_sectors  - start_stats.read_sectors +
+            memdisk_stats.write_sectors - start_stats.write_sectors;
+  card_us = (uint64_t)cmds * card_cmd_us + (uint64_t)sectors * card_sector_us;
+
+  printf("%-5s %-18s %8u bytes %8lld us  card %8llu us %7.1f KB/s  rd %5u/%6u  wr %5u/%6u  ",
+         op, arg, bytes, (long long)usecs, (unsigned long long)card_us,
+         card_us ? bytes * 1000000.0 / 1024.0 / card_us : 0.0,
+         memdisk_stats.read_cmds     - start_stats.read_cmds,
+         memdisk_stats.read_sectors  - start_stats.read_sectors,
+         memdisk_stats.write_cmds    - start_stats.write_cmds,
+         memdisk_stats.write_sectors - start_stats.write_sectors);
+  print_status();
+}
+
+/* Reports a transfer on the simulated bus, times are simulated */
+static void bus_report(const char *op, const char *arg,
+                       ieeebus_result_t res, ieeebus_stats_t *stats) {
+  static const char *results[] = { "", "not present ", "timeout ", "IFC " };
+  double total_us = stats->total_ns / 1000.0;
+
+  printf("%-5s %-18s %8u bytes %8.0f us  bus %7.1f KB/s  hs %6.2f us/byte  stall %5u avg %8.1f max %8.1f us  crc %08x  %s",
+         op, arg, stats->bytes, total_us,
+         total_us > 0 ? stats->bytes * 1000000.0 / 1024.0 / total_us : 0.0,
+         stats->bytes > stats->stalls ?
+           stats->handshake_ns / 1000.0 / (stats->bytes - stats->stalls) : 0.0,
+         stats->stalls,
+         stats->stalls ? stats->stall_ns / 1000.0 / stats->stalls : 0.0,
+         stats->max_stall_ns / 1000.0,
+         stats->crc, results[res]);
+  print_status();
+
+  inject_atn = IEEEBUS_NO_INJECT;
+  inject_ifc = IEEEBUS_NO_INJECT;
+}
+
+/* Prints directory listings in a readable form */
+static unsigned int dir_state;
+
+static void dir_sink(uint8_t byte) {
+  static unsigned int linenum;
+
+  /* 0-1: load address, 2-3: line link, 4-5: line number, 6: text */
+  switch (dir_state) {
+  case 4:
+    linenum = byte;
+    break;
+
+  case 5:
+    printf("%u ", linenum | (byte << 8));
+    break;
+
+  case 6:
+    if (byte == 0) {
+      putchar('\n');
+      dir_state = 2;
+    } else {
+      putchar(byte < 0x20 || byte > 0x7e ? '.' : byte);
+    }
+    return;
+  }
+
+  dir_state++;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Operations                                                        */
+/* ------------------------------------------------------------------ */
+
+static void op_load(const char *name) {
+  uint32_t bytes;
+
+  bench_start();
+  bus_open(0, name);
+  bytes = bus_talk(0, NULL);
+  bus_close(0);
+  bench_end("LOAD", name, bytes);
+}
+
+static void op_save(const char *arg) {
+  char name[CONFIG_COMMAND_BUFFER_SIZE];
+  char *sep;
+  uint32_t size, bytes;
+
+  strncpy(name, arg, sizeof(name)-1);
+  name[sizeof(name)-1] = 0;
+  sep = strrchr(name, '=');
+  if (sep == NULL) {
+    fprintf(stderr, "-s needs NAME=SIZE\n");
+    exit(2);
+  }
+  *sep = 0;
+  size = strtoul(sep+1, NULL, 0);
+
+  bench_start();
+  bus_open(1, name);
+  bytes = bus_listen(1, size);
+  bus_close(1);
+  bench_end("SAVE", name, bytes);
+}
+
+static void op_busload(const char *name) {
+  ieeebus_stats_t stats;
+  ieeebus_result_t res;
+
+  res = ieeebus_load(device_address, 0, name, inject_atn, inject_ifc, &stats);
+  bus_report("BLOAD", name, res, &stats);
+}
+
+static void op_bussave(const char *arg) {
+  char name[CONFIG_COMMAND_BUFFER_SIZE];
+  char *sep;
+  ieeebus_stats_t stats;
+  ieeebus_result_t res;
+
+  strncpy(name, arg, sizeof(name)-1);
+  name[sizeof(name)-1] = 0;
+  sep = strrchr(name, '=');
+  if (sep == NULL) {
+    fprintf(stderr, "-S needs NAME=SIZE\n");
+    exit(2);
+  }
+  *sep = 0;
+
+  res = ieeebus_save(device_address, 1, name, strtoul(sep+1, NULL, 0),
+                     inject_atn, inject_ifc, &stats);
+  bus_report("BSAVE", name, res, &stats);
+}
+
+static void op_dir(const char *pattern) {
+  char name[CONFIG_COMMAND_BUFFER_SIZE];
+  uint32_t bytes;
+
+  snprintf(name, sizeof(name), "$%s", pattern);
+  dir_state = 0;
+
+  bench_start();
+  bus_open(0, name);
+  bytes = bus_talk(0, verbose ? dir_sink : NULL);
+  bus_close(0);
+  bench_end("DIR", name, bytes);
+}
+
+static void op_command(const char *cmd) {
+  bench_start();
+  bus_command(cmd);
+  bench_end("CMD", cmd, 0);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-w] [-v] [-t CMD_US,SECTOR_US] [-b DAV,NRFD,NDAC] image [operations...]\n"
+          "  -w          write changes back to the image file\n"
+          "  -v          print directory listings\n"
+          "  -t CMD,SEC  SD card cost model in microseconds per command\n"
+          "              and per sector (default 250,520)\n"
+          "  -b DAV,NRFD,NDAC  delays of the simulated PET on the bus\n"
+          "              in microseconds (default 5,40,10)\n"
+          "  -n COUNT    repeat the following operations COUNT times\n"
+          "  -c COMMAND  send COMMAND to the command channel\n"
+          "  -l NAME     LOAD NAME\n"
+          "  -s NAME=LEN SAVE LEN bytes as NAME\n"
+          "  -d PATTERN  load the directory ($PATTERN)\n"
+          "  -D          load the directory ($)\n"
+          "  -L NAME     LOAD NAME over the simulated IEEE-488 bus\n"
+          "  -S NAME=LEN SAVE LEN bytes as NAME over the simulated bus\n"
+          "  -a BYTES    interrupt the next bus transfer with ATN after BYTES\n"
+          "  -i BYTES    abort the next bus transfer with IFC after BYTES\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  bool writeback = false;
+  unsigned int repeat = 1;
+  int opt, i, first_op;
+  double dav_us, nrfd_us, ndac_us;
+
+  /* first pass: global options and the image name */
+  while ((opt = getopt(argc, argv, "+wvt:b:h")) != -1) {
+    switch (opt) {
+    case 'b':
+      if (sscanf(optarg, "%lf,%lf,%lf", &dav_us, &nrfd_us, &ndac_us) != 3)
+        usage(argv[0]);
+      bus_timing.dav_ns  = dav_us  * 1000;
+      bus_timing.nrfd_ns = nrfd_us * 1000;
+      bus_timing.ndac_ns = ndac_us * 1000;
+      break;
+
+    case 't':
+      if (sscanf(optarg, "%u,%u", &card_cmd_us, &card_sector_us) != 2)
+        usage(argv[0]);
+      break;
+
+    case 'w':
+      writeback = true;
+      break;
+
+    case 'v':
+      verbose = true;
+      break;
+
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc)
+    usage(argv[0]);
+
+  if (!memdisk_open(argv[optind], writeback))
+    return 1;
+
+  first_op = optind + 1;
+
+  /* Same initialisation order as main.c */
+  system_init_early();
+  timer_init();
+  system_init_late();
+  buffers_init();
+  disk_init();
+  read_configuration();
+  filesystem_init(0);
+
+  bus_timing.card_cmd_ns    = card_cmd_us    * 1000ULL;
+  bus_timing.card_sector_ns = card_sector_us * 1000ULL;
+  ieeebus_init(&bus_timing);
+
+  set_error(ERROR_DOSVERSION);
+  print_status();
+
+  /* second pass: operations, executed in command line order */
+  optind = first_op;
+  while ((opt = getopt(argc, argv, "+n:c:l:s:d:DL:S:a:i:")) != -1) {
+    for (i = 0; i < (opt == 'n' ? 0 : (int)repeat); i++) {
+      switch (opt) {
+      case 'c':
+        op_command(optarg);
+        break;
+
+      case 'l':
+        op_load(optarg);
+        break;
+
+      case 's':
+        op_save(optarg);
+        break;
+
+      case 'd':
+        op_dir(optarg);
+        break;
+
+      case 'D':
+        op_dir("");
+        break;
+
+      case 'L':
+        op_busload(optarg);
+        break;
+
+      case 'S':
+        op_bussave(optarg);
+        break;
+
+      case 'a':
+      case 'i':
+        break;
+
+      default:
+        usage(argv[0]);
+      }
+    }
+
+    if (opt == 'n')
+      repeat = strtoul(optarg, NULL, 0);
+    else if (opt == 'a')
+      inject_atn = strtoul(optarg, NULL, 0);
+    else if (opt == 'i')
+      inject_ifc = strtoul(optarg, NULL, 0);
+  }
+
+  free_multiple_buffers(FMB_USER_CLEAN);
+  imgcache_flush(IMGCACHE_ALL);
+  memdisk_close();
+  return 0;
+}
@@ -0,0 +1,641 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+   ieeebus.c: Simulated IEEE-488 bus and controller for the host build
+
+   ieee.c is compiled unchanged against the registers in ieeebus_regs
+   and runs its main loop in a coroutine of its own. Every read of an
+   input register and every card access lets simulated time pass, the
+   controller (the "PET") runs in the main context and reacts to the
+   bus lines with configurable delays. All times are simulated, CPU
+   time of the device code itself is not accounted for.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include "config.h"
+#include "ieee.h"
+#include "memdisk.h"
+#include "ieeebus.h"
+
+#define DEVICE_STACK_SIZE (1024 * 1024)
+
+/* The PET gives up waiting for DAV after 64 ms */
+#define DAV_TIMEOUT_NS  64000000ULL
+
+/* Any other handshake is considered hung after one second */
+#define HANG_TIMEOUT_NS 1000000000ULL
+
+/* Length of an injected IFC pulse */
+#define IFC_PULSE_NS    100000
+
+/* IEEE-488 commands */
+#define CMD_LISTEN   0x20
+#define CMD_UNLISTEN 0x3f
+#define CMD_TALK     0x40
+#define CMD_UNTALK   0x5f
+#define CMD_DATA     0x60
+#define CMD_CLOSE    0xe0
+#define CMD_OPEN     0xf0
+
+#define LINE(x) (1 << IEEEBUS_##x)
+
+/* Set by the ATN interrupt of the real hardware */
+extern volatile bool ieee488_ATN_received;
+
+ieeebus_regs_t ieeebus_regs;
+
+static ieeebus_timing_t timing;
+static uint64_t now;                    // simulated time in ns
+static uint8_t  ctl_ctrl = 0xff;        // control lines of the controller
+static uint8_t  ctl_data = 0xff;        // data lines of the controller
+
+static ucontext_t main_ctx, device_ctx;
+static bool       in_device;
+static bool       (*wait_cond)(void);
+static uint64_t   wait_until;
+
+/* device time of every byte of the current transfer */
+static uint64_t *byte_times;
+static uint32_t  byte_count, byte_alloc;
+
+/* ------------------------------------------------------------------ */
+/*  Bus lines                                                         */
+/* ------------------------------------------------------------------ */
+
+/* Levels of the control lines, 0 if pulled low by any side */
+static uint8_t ctrl_lines(void) {
+  return ctl_ctrl & ~(ieeebus_regs.ctrl_ddr & ~ieeebus_regs.ctrl_port);
+}
+
+/* Levels of the data lines, inverted like on the real bus */
+static uint8_t data_lines(void) {
+  return ctl_data & ~(ieeebus_regs.data_ddr & ~ieeebus_regs.data_port);
+}
+
+static bool line_high(uint8_t bit) {
+  return ctrl_lines() & bit;
+}
+
+static bool dav_low(void)   { return !line_high(LINE(DAV));  }
+static bool dav_high(void)  { return  line_high(LINE(DAV));  }
+static bool ndac_high(void) { return  line_high(LINE(NDAC)); }
+static bool nrfd_high(void) { return  line_high(LINE(NRFD)); }
+
+/* Equivalent of the ATN interrupt handler in src/avr/atn-ack-*.S */
+static void device_atn_interrupt(void) {
+  ieeebus_regs.data_ddr   = 0;
+  ieeebus_regs.ctrl_ddr  &= ~(LINE(NRFD) | LINE(NDAC) | LINE(EOI) | LINE(DAV));
+  ieeebus_regs.ctrl_port &= ~LINE(TE);
+  ieeebus_regs.ctrl_ddr  |= LINE(NRFD) | LINE(NDAC);
+  ieeebus_regs.ctrl_port &= ~LINE(NRFD);
+  ieeebus_regs.ctrl_port |= LINE(NDAC);
+  ieee488_ATN_received = true;
+}
+
+/* Pull control lines of the controller low */
+static void ctl_pull(uint8_t lines) {
+  if ((lines & LINE(ATN)) && (ctl_ctrl & LINE(ATN)) &&
+      (ieeebus_regs.eimsk & 1)) {
+    ctl_ctrl &= ~lines;
+    device_atn_interrupt();
+  } else {
+    ctl_ctrl &= ~lines;
+  }
+}
+
+/* Release control lines of the controller */
+static void ctl_release(uint8_t lines) {
+  ctl_ctrl |= lines;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Scheduling                                                        */
+/* ------------------------------------------------------------------ */
+
+static void device_main(void) {
+  ieee488_Init();
+  ieee_mainloop();
+  fprintf(stderr, "ieeebus: device main loop exited\n");
+  exit(1);
+}
+
+/**
+ * device_elapse - let time pass on the device side
+ * @ns: time in nanoseconds
+ *
+ * This function advances the simulated time while the device is busy.
+ * The controller gets to run at every point in time it waits for that
+ * lies within this period and as soon as the condition it waits for is
+ * met, so it reacts to line changes the device made before.
+ */
+static void device_elapse(uint64_t ns) {
+  uint64_t target = now + ns;
+
+  for (;;) {
+    if (wait_until <= target) {
+      if (wait_until > now)
+        now = wait_until;
+    } else if (wait_cond == NULL || !wait_cond()) {
+      break;
+    }
+
+    in_device = false;
+    swapcontext(&device_ctx, &main_ctx);
+    in_device = true;
+  }
+
+  now = target;
+}
+
+/**
+ * ctl_wait - let the device run until a condition is true
+ * @cond   : condition to wait for, NULL to wait for the timeout only
+ * @timeout: maximum time to wait in nanoseconds
+ *
+ * Returns true if the condition became true before the timeout.
+ */
+static bool ctl_wait(bool (*cond)(void), uint64_t timeout) {
+  if (cond != NULL && cond())
+    return true;
+
+  wait_cond  = cond;
+  wait_until = now + timeout;
+  in_device  = true;
+  swapcontext(&main_ctx, &device_ctx);
+  wait_cond  = NULL;
+  wait_until = UINT64_MAX;
+
+  return cond == NULL || cond();
+}
+
+static void ctl_delay(uint64_t ns) {
+  ctl_wait(NULL, ns);
+}
+
+uint8_t ieeebus_ctrl_pin(void) {
+  if (in_device)
+    device_elapse(timing.poll_ns);
+  return ctrl_lines();
+}
+
+uint8_t ieeebus_data_pin(void) {
+  if (in_device)
+    device_elapse(timing.poll_ns);
+  return data_lines();
+}
+
+/**
+ * ieeebus_card_access - account for the time of a card access
+ * @sectors: number of sectors transferred
+ *
+ * Called by memdisk for every disk_read/disk_write.
+ */
+void ieeebus_card_access(uint8_t sectors) {
+  if (in_device)
+    device_elapse(timing.card_cmd_ns +
+                  (uint64_t)sectors * timing.card_sector_ns);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Controller                                                        */
+/* ------------------------------------------------------------------ */
+
+/* Assert ATN, the controller becomes talker */
+static void ctl_atn(void) {
+  ctl_release(LINE(NDAC) | LINE(NRFD));
+  ctl_pull(LINE(ATN));
+  ctl_delay(timing.dav_ns);
+}
+
+static void record_byte(uint64_t device_ns) {
+  if (byte_count == byte_alloc) {
+    byte_alloc = byte_alloc ? 2 * byte_alloc : 65536;
+    byte_times = realloc(byte_times, byte_alloc * sizeof(*byte_times));
+    if (byte_times == NULL) {
+      perror("ieeebus");
+      exit(1);
+    }
+  }
+  byte_times[byte_count++] = device_ns;
+}
+
+/**
+ * ctl_send - send a byte as talker
+ * @byte  : data byte
+ * @eoi   : true if EOI should be sent with the byte
+ * @record: true if the device time should be recorded
+ */
+static ieeebus_result_t ctl_send(uint8_t byte, bool eoi, bool record) {
+  uint64_t start = now, device_ns;
+
+  ctl_data = ~byte;
+  if (eoi)
+    ctl_pull(LINE(EOI));
+
+  /* wait until all listeners are ready */
+  if (!ctl_wait(nrfd_high, HANG_TIMEOUT_NS))
+    return IEEEBUS_TIMEOUT;
+  device_ns = now - start;
+
+  /* a listener holds NDAC low until it accepts the byte */
+  if (ndac_high())
+    return IEEEBUS_NOT_PRESENT;
+
+  ctl_delay(timing.dav_ns);
+  ctl_pull(LINE(DAV));
+  start = now;
+  if (!ctl_wait(ndac_high, HANG_TIMEOUT_NS))
+    return IEEEBUS_TIMEOUT;
+  device_ns += now - start;
+
+  ctl_delay(timing.dav_ns);
+  ctl_release(LINE(DAV) | LINE(EOI));
+  ctl_data = 0xff;
+
+  if (record)
+    record_byte(device_ns);
+  return IEEEBUS_OK;
+}
+
+/**
+ * ctl_receive - receive a byte as listener
+ * @byte  : pointer to the received byte
+ * @eoi   : pointer to the EOI flag of the byte
+ * @atn   : true to abort with ATN after the byte was put on the bus
+ */
+static ieeebus_result_t ctl_receive(uint8_t *byte, bool *eoi, bool atn) {
+  uint64_t start, device_ns;
+
+  ctl_delay(timing.nrfd_ns);
+  ctl_release(LINE(NRFD));
+  start = now;
+  if (!ctl_wait(dav_low, DAV_TIMEOUT_NS))
+    return IEEEBUS_TIMEOUT;
+  device_ns = now - start;
+
+  if (atn) {
+    ctl_atn();
+    return IEEEBUS_OK;
+  }
+
+  ctl_pull(LINE(NRFD));
+  *byte = ~data_lines();
+  *eoi  = !line_high(LINE(EOI));
+
+  ctl_delay(timing.ndac_ns);
+  ctl_release(LINE(NDAC));
+  start = now;
+  if (!ctl_wait(dav_high, HANG_TIMEOUT_NS))
+    return IEEEBUS_TIMEOUT;
+  device_ns += now - start;
+  ctl_pull(LINE(NDAC));
+
+  record_byte(device_ns);
+  return IEEEBUS_OK;
+}
+
+/* Release ATN, the device must see DAV high first like on a PET */
+static void ctl_atn_release(void) {
+  ctl_delay(timing.dav_ns);
+  ctl_release(LINE(ATN));
+}
+
+/* Send up to two commands under ATN */
+static ieeebus_result_t ctl_commands(uint8_t cmd1, uint8_t cmd2) {
+  ieeebus_result_t res = ctl_send(cmd1, false, false);
+
+  if (res == IEEEBUS_OK && cmd2)
+    res = ctl_send(cmd2, false, false);
+  return res;
+}
+
+/* Send UNLISTEN and release ATN */
+static ieeebus_result_t ctl_unlisten(void) {
+  ieeebus_result_t res;
+
+  ctl_atn();
+  res = ctl_commands(CMD_UNLISTEN, 0);
+  ctl_atn_release();
+  return res;
+}
+
+/* Address the device as listener for a secondary address */
+static ieeebus_result_t ctl_listen(uint8_t device, uint8_t secondary) {
+  ieeebus_result_t res;
+
+  ctl_atn();
+  res = ctl_commands(CMD_LISTEN | device, secondary);
+  ctl_atn_release();
+  ctl_delay(timing.dav_ns);
+  return res;
+}
+
+/* Address the device as talker, the controller becomes listener */
+static ieeebus_result_t ctl_talk(uint8_t device, uint8_t sa) {
+  ieeebus_result_t res;
+
+  ctl_atn();
+  res = ctl_commands(CMD_TALK | device, CMD_DATA | sa);
+  ctl_pull(LINE(NDAC) | LINE(NRFD));
+  ctl_atn_release();
+  return res;
+}
+
+/* Send a file name to a secondary address */
+static ieeebus_result_t ctl_open(uint8_t device, uint8_t sa, const char *name) {
+  ieeebus_result_t res;
+  size_t len = strlen(name);
+
+  res = ctl_listen(device, CMD_OPEN | sa);
+  while (res == IEEEBUS_OK && len--)
+    res = ctl_send(*name++, len == 0, false);
+  if (res == IEEEBUS_OK)
+    res = ctl_unlisten();
+  return res;
+}
+
+/* Close a secondary address */
+static ieeebus_result_t ctl_close(uint8_t device, uint8_t sa) {
+  ieeebus_result_t res;
+
+  ctl_atn();
+  res = ctl_commands(CMD_LISTEN | device, CMD_CLOSE | sa);
+  if (res == IEEEBUS_OK)
+    res = ctl_commands(CMD_UNLISTEN, 0);
+  ctl_atn_release();
+
+  /* wait until the device has released the bus */
+  if (res == IEEEBUS_OK && !ctl_wait(ndac_high, HANG_TIMEOUT_NS))
+    res = IEEEBUS_TIMEOUT;
+  return res;
+}
+
+/* Pulse IFC and release all lines */
+static void ctl_ifc(void) {
+  ctl_ctrl = 0xff;
+  ctl_data = 0xff;
+  ctl_pull(LINE(IFC));
+  ctl_delay(IFC_PULSE_NS);
+  ctl_release(LINE(IFC));
+  ctl_wait(ndac_high, HANG_TIMEOUT_NS);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Transfers                                                         */
+/* ------------------------------------------------------------------ */
+
+static uint32_t crc32_update(uint32_t crc, uint8_t byte) {
+  uint8_t i;
+
+  crc ^= byte;
+  for (i = 0; i < 8; i++)
+    crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+  return crc;
+}
+
+static int compare_times(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Split the recorded device times into handshakes and stalls */
+static void finish_stats(ieeebus_stats_t *stats) {
+  uint64_t *sorted, threshold;
+  uint32_t i;
+
+  if (byte_count == 0)
+    return;
+
+  sorted = malloc(byte_count * sizeof(*sorted));
+  if (sorted == NULL) {
+    perror("ieeebus");
+    exit(1);
+  }
+  memcpy(sorted, byte_times, byte_count * sizeof(*sorted));
+  qsort(sorted, byte_count, sizeof(*sorted), compare_times);
+  threshold = 2 * sorted[byte_count / 2] + 10000;
+  free(sorted);
+
+  for (i = 0; i < byte_count; i++) {
+    if (byte_times[i] > threshold) {
+      stats->stalls++;
+      stats->stall_ns += byte_times[i];
+      if (byte_times[i] > stats->max_stall_ns)
+        stats->max_stall_ns = byte_times[i];
+    } else {
+      stats->handshake_ns += byte_times[i];
+    }
+  }
+}
+
+static void start_transfer(ieeebus_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->crc = 0xffffffff;
+  byte_count = 0;
+}
+
+/* Release the bus after an error, resets the device if it hangs */
+static void abort_transfer(ieeebus_result_t res) {
+  ctl_ctrl = 0xff;
+  ctl_data = 0xff;
+  if (res == IEEEBUS_TIMEOUT)
+    ctl_ifc();
+}
+
+/**
+ * ieeebus_load - read a file from the device
+ * @device: device address
+ * @sa    : secondary address
+ * @name  : file name
+ * @atn_at: number of bytes after which the transfer is interrupted
+ *          by ATN, UNTALK and TALK, IEEEBUS_NO_INJECT for none
+ * @ifc_at: number of bytes after which the transfer is aborted with
+ *          IFC, IEEEBUS_NO_INJECT for none
+ * @stats : measurements of the transfer
+ *
+ * The ATN is asserted while the device has put the next byte on the
+ * bus but before the controller accepts it, so the device must send
+ * that byte again.
+ */
+ieeebus_result_t ieeebus_load(uint8_t device, uint8_t sa, const char *name,
+                              uint32_t atn_at, uint32_t ifc_at,
+                              ieeebus_stats_t *stats) {
+  uint64_t start = now, data_start;
+  ieeebus_result_t res;
+  uint8_t byte = 0;
+  bool eoi = false;
+
+  start_transfer(stats);
+
+  res = ctl_open(device, sa, name);
+  if (res == IEEEBUS_OK)
+    res = ctl_talk(device, sa);
+
+  data_start = now;
+  while (res == IEEEBUS_OK && !eoi) {
+    if (stats->bytes == ifc_at) {
+      ctl_ifc();
+      res = IEEEBUS_CLEARED;
+      break;
+    }
+
+    res = ctl_receive(&byte, &eoi, stats->bytes == atn_at);
+    if (res != IEEEBUS_OK)
+      break;
+
+    if (stats->bytes == atn_at) {
+      atn_at = IEEEBUS_NO_INJECT;
+      res = ctl_commands(CMD_UNTALK, 0);
+      if (res == IEEEBUS_OK)
+        res = ctl_talk(device, sa);
+      continue;
+    }
+
+    stats->crc = crc32_update(stats->crc, byte);
+    stats->bytes++;
+  }
+  stats->data_ns = now - data_start;
+
+  /* a DAV timeout on the first byte is "file not found" to the PET */
+  if (res == IEEEBUS_OK || (res == IEEEBUS_TIMEOUT && stats->bytes == 0)) {
+    ieeebus_result_t closeres;
+
+    ctl_atn();
+    closeres = ctl_commands(CMD_UNTALK, 0);
+    ctl_atn_release();
+    if (closeres == IEEEBUS_OK)
+      closeres = ctl_close(device, sa);
+    if (closeres != IEEEBUS_OK) {
+      res = closeres;
+      abort_transfer(res);
+    }
+  } else if (res != IEEEBUS_CLEARED) {
+    abort_transfer(res);
+  }
+
+  stats->total_ns = now - start;
+  stats->crc ^= 0xffffffff;
+  finish_stats(stats);
+  return res;
+}
+
+/**
+ * ieeebus_save - write a file to the device
+ * @device: device address
+ * @sa    : secondary address
+ * @name  : file name
+ * @length: number of bytes to write
+ * @atn_at: number of bytes after which the transfer is interrupted
+ *          by UNLISTEN and LISTEN, IEEEBUS_NO_INJECT for none
+ * @ifc_at: number of bytes after which the transfer is aborted with
+ *          IFC, IEEEBUS_NO_INJECT for none
+ * @stats : measurements of the transfer
+ *
+ * The data is a load address of 0x0801 followed by the low byte of
+ * the offset of each byte, like the SAVE of the benchmark driver.
+ */
+ieeebus_result_t ieeebus_save(uint8_t device, uint8_t sa, const char *name,
+                              uint32_t length, uint32_t atn_at,
+                              uint32_t ifc_at, ieeebus_stats_t *stats) {
+  uint64_t start = now, data_start;
+  ieeebus_result_t res;
+  uint8_t byte;
+
+  start_transfer(stats);
+
+  res = ctl_open(device, sa, name);
+  if (res == IEEEBUS_OK)
+    res = ctl_listen(device, CMD_DATA | sa);
+
+  data_start = now;
+  while (res == IEEEBUS_OK && stats->bytes < length) {
+    if (stats->bytes == ifc_at) {
+      ctl_ifc();
+      res = IEEEBUS_CLEARED;
+      break;
+    }
+
+    if (stats->bytes == atn_at) {
+      atn_at = IEEEBUS_NO_INJECT;
+      res = ctl_unlisten();
+      if (res == IEEEBUS_OK)
+        res = ctl_listen(device, CMD_DATA | sa);
+      continue;
+    }
+
+    if (stats->bytes < 2)
+      byte = stats->bytes ? 0x08 : 0x01;
+    else
+      byte = stats->bytes & 0xff;
+    res = ctl_send(byte, stats->bytes == length - 1, true);
+    if (res != IEEEBUS_OK)
+      break;
+
+    stats->crc = crc32_update(stats->crc, byte);
+    stats->bytes++;
+  }
+  stats->data_ns = now - data_start;
+
+  if (res == IEEEBUS_OK)
+    res = ctl_unlisten();
+  if (res == IEEEBUS_OK)
+    res = ctl_close(device, sa);
+  if (res != IEEEBUS_OK && res != IEEEBUS_CLEARED)
+    abort_transfer(res);
+
+  stats->total_ns = now - start;
+  stats->crc ^= 0xffffffff;
+  finish_stats(stats);
+  return res;
+}
+
+/**
+ * ieeebus_init - start the device side of the bus model
+ * @param: timing parameters
+ *
+ * This function starts the main loop of ieee.c in its own context and
+ * runs it until it first waits for the bus.
+ */
+void ieeebus_init(const ieeebus_timing_t *param) {
+  void *stack = malloc(DEVICE_STACK_SIZE);
+
+  if (stack == NULL) {
+    perror("ieeebus");
+    exit(1);
+  }
+
+  timing = *param;
+
+  getcontext(&device_ctx);
+  device_ctx.uc_stack.ss_sp   = stack;
+  device_ctx.uc_stack.ss_size = DEVICE_STACK_SIZE;
+  device_ctx.uc_link          = NULL;
+  makecontext(&device_ctx, device_main, 0);
+
+  wait_until = UINT64_MAX;
+  ctl_delay(0);
+}
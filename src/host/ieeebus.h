@@ -0,0 +1,136 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+   ieeebus.h: Simulated IEEE-488 bus and controller for the host build
+
+*/
+
+#ifndef IEEEBUS_H
+#define IEEEBUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Bits of the simulated control port */
+#define IEEEBUS_ATN  0
+#define IEEEBUS_NDAC 1
+#define IEEEBUS_NRFD 2
+#define IEEEBUS_DAV  3
+#define IEEEBUS_EOI  4
+#define IEEEBUS_IFC  5
+#define IEEEBUS_TE   6
+
+/**
+ * struct ieeebus_regs_s - simulated AVR registers used by ieee.c
+ * @ctrl_port: output register of the control lines
+ * @ctrl_ddr : direction register of the control lines
+ * @data_port: output register of the data lines
+ * @data_ddr : direction register of the data lines
+ * @eimsk    : external interrupt mask, bit 0 enables the ATN interrupt
+ * @eicra    : external interrupt control, ignored
+ *
+ * The input registers are functions because every read lets the
+ * simulated controller react to the current state of the bus.
+ */
+typedef struct ieeebus_regs_s {
+  uint8_t ctrl_port;
+  uint8_t ctrl_ddr;
+  uint8_t data_port;
+  uint8_t data_ddr;
+  uint8_t eimsk;
+  uint8_t eicra;
+} ieeebus_regs_t;
+
+extern ieeebus_regs_t ieeebus_regs;
+
+uint8_t ieeebus_ctrl_pin(void);
+uint8_t ieeebus_data_pin(void);
+
+/**
+ * struct ieeebus_timing_s - timing of the simulated bus in nanoseconds
+ * @dav_ns        : controller as talker: data setup time before DAV low
+ *                  and delay before DAV is released after NDAC high
+ * @nrfd_ns       : controller as listener: processing time of a byte
+ *                  before NRFD is released for the next one
+ * @ndac_ns       : controller as listener: time from DAV low until the
+ *                  byte is accepted by releasing NDAC
+ * @poll_ns       : device: time of one port read in a wait loop
+ * @card_cmd_ns   : device: time of one SD card command
+ * @card_sector_ns: device: transfer time of one SD card sector
+ */
+typedef struct ieeebus_timing_s {
+  uint32_t dav_ns;
+  uint32_t nrfd_ns;
+  uint32_t ndac_ns;
+  uint32_t poll_ns;
+  uint32_t card_cmd_ns;
+  uint32_t card_sector_ns;
+} ieeebus_timing_t;
+
+/* Result of ieeebus_load/ieeebus_save */
+typedef enum {
+  IEEEBUS_OK,
+  IEEEBUS_NOT_PRESENT,      // no listener on the bus
+  IEEEBUS_TIMEOUT,          // device did not answer within the timeout
+  IEEEBUS_CLEARED,          // transfer aborted by an injected IFC
+} ieeebus_result_t;
+
+/**
+ * struct ieeebus_stats_s - measurements of one transfer
+ * @bytes       : number of data bytes transferred
+ * @total_ns    : duration including OPEN and CLOSE
+ * @data_ns     : duration of the data phase
+ * @handshake_ns: device time of all bytes that were not stalled
+ * @stalls      : number of bytes the device stalled on
+ * @stall_ns    : device time of the stalled bytes
+ * @max_stall_ns: longest stall
+ * @crc         : CRC32 of the transferred data
+ *
+ * Device time is the part of a handshake the controller spends waiting
+ * for the device. A byte is counted as stalled if its device time is
+ * far above the median, which happens when a buffer is refilled or
+ * flushed.
+ */
+typedef struct ieeebus_stats_s {
+  uint32_t bytes;
+  uint64_t total_ns;
+  uint64_t data_ns;
+  uint64_t handshake_ns;
+  uint32_t stalls;
+  uint64_t stall_ns;
+  uint64_t max_stall_ns;
+  uint32_t crc;
+} ieeebus_stats_t;
+
+/* No ATN or IFC injection */
+#define IEEEBUS_NO_INJECT 0xffffffffU
+
+void ieeebus_init(const ieeebus_timing_t *param);
+void ieeebus_card_access(uint8_t sectors);
+ieeebus_result_t ieeebus_load(uint8_t device, uint8_t sa, const char *name,
+                              uint32_t atn_at, uint32_t ifc_at,
+                              ieeebus_stats_t *stats);
+ieeebus_result_t ieeebus_save(uint8_t device, uint8_t sa, const char *name,
+                              uint32_t length, uint32_t atn_at,
+                              uint32_t ifc_at, ieeebus_stats_t *stats);
+
+#endif
@@ -0,0 +1,164 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   memdisk.c: Memory-mapped image file as disk for the host build
+
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "config.h"
+#include "diskio.h"
+#include "ieeebus.h"
+#include "memdisk.h"
+
+#define SECTOR_SIZE 512
+
+memdisk_stats_t memdisk_stats;
+
+static uint8_t *image;
+static size_t   image_size;
+static uint32_t sector_count;
+
+/**
+ * memdisk_open - map an image file
+ * @filename : name of the image file
+ * @writeback: flag if writes should modify the file
+ *
+ * This function maps the image file @filename into memory. If
+ * @writeback is false, all changes are private to this process
+ * and discarded when it exits, so the same image can be used for
+ * repeated benchmark runs. Returns true on success.
+ */
+bool memdisk_open(const char *filename, bool writeback) {
+  struct stat st;
+  int fd;
+
+  fd = open(filename, writeback ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    return false;
+  }
+
+  if (fstat(fd, &st) < 0 || st.st_size < SECTOR_SIZE) {
+    fprintf(stderr, "%s: not a usable disk image\n", filename);
+    close(fd);
+    return false;
+  }
+
+  image_size   = st.st_size;
+  sector_count = image_size / SECTOR_SIZE;
+  image = mmap(NULL, image_size, PROT_READ | PROT_WRITE,
+               writeback ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (image == MAP_FAILED) {
+    perror("mmap");
+    image = NULL;
+    return false;
+  }
+
+  disk_state = DISK_OK;
+  return true;
+}
+
+/**
+ * memdisk_close - unmap the image file
+ *
+ * This function unmaps the current image file, any changes are
+ * written back if it was opened with writeback enabled.
+ */
+void memdisk_close(void) {
+  if (image == NULL)
+    return;
+
+  msync(image, image_size, MS_SYNC);
+  munmap(image, image_size);
+  image = NULL;
+  disk_state = DISK_REMOVED;
+}
+
+void disk_init(void) {
+  return;
+}
+
+DSTATUS disk_status(BYTE drv) {
+  if (drv != 0 || image == NULL)
+    return STA_NOINIT | STA_NODISK;
+
+  return 0;
+}
+
+DSTATUS disk_initialize(BYTE drv) {
+  return disk_status(drv);
+}
+
+DRESULT disk_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) {
+  if (disk_status(drv))
+    return RES_NOTRDY;
+
+  if (sector + count > sector_count)
+    return RES_PARERR;
+
+  memdisk_stats.read_cmds++;
+  memdisk_stats.read_sectors += count;
+  ieeebus_card_access(count);
+  memcpy(buffer, image + (size_t)sector * SECTOR_SIZE, count * SECTOR_SIZE);
+  return RES_OK;
+}
+
+DRESULT disk_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) {
+  if (disk_status(drv))
+    return RES_NOTRDY;
+
+  if (sector + count > sector_count)
+    return RES_PARERR;
+
+  memdisk_stats.write_cmds++;
+  memdisk_stats.write_sectors += count;
+  ieeebus_card_access(count);
+  memcpy(image + (size_t)sector * SECTOR_SIZE, buffer, count * SECTOR_SIZE);
+  return RES_OK;
+}
+
+DRESULT disk_getinfo(BYTE drv, BYTE page, void *buffer) {
+  diskinfo0_t *di = buffer;
+
+  if (disk_status(drv))
+    return RES_NOTRDY;
+
+  if (page != 0)
+    return RES_ERROR;
+
+  di->validbytes  = sizeof(diskinfo0_t);
+  di->maxpage     = 0;
+  di->disktype    = DISK_TYPE_SD;
+  di->sectorsize  = 2;
+  di->sectorcount = sector_count;
+
+  return RES_OK;
+}
@@ -0,0 +1,60 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   memdisk.h: Memory-mapped image file as disk for the host build
+
+*/
+
+#ifndef MEMDISK_H
+#define MEMDISK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * struct memdisk_stats_s - access counters of the memory disk
+ * @read_cmds    : number of disk_read calls
+ * @read_sectors : number of sectors read
+ * @write_cmds   : number of disk_write calls
+ * @write_sectors: number of sectors written
+ *
+ * On the real hardware every disk_read/disk_write call is one SD
+ * command with its own setup latency, so the number of calls is as
+ * interesting as the number of sectors transferred.
+ */
+typedef struct memdisk_stats_s {
+  uint32_t read_cmds;
+  uint32_t read_sectors;
+  uint32_t write_cmds;
+  uint32_t write_sectors;
+} memdisk_stats_t;
+
+extern memdisk_stats_t memdisk_stats;
+
+/* Map an image file, writes go to the file if writeback is true */
+bool memdisk_open(const char *filename, bool writeback);
+
+/* Unmap the image file */
+void memdisk_close(void);
+
+#endif
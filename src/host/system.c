@@ -0,0 +1,64 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+   system.c: System-specific initialisation (host version)
+
+*/
+
+#include <stdlib.h>
+#include "config.h"
+#include "system.h"
+
+#ifdef CONFIG_BUFFER_POOL
+/* Stands in for the free AHB ram of LPC17xx boards */
+uint8_t host_pool_arena[CONFIG_BUFFER_POOL * 256];
+#endif
+
+/* Early system initialisation */
+void system_init_early(void) {
+  return;
+}
+
+/* Late initialisation */
+void system_init_late(void) {
+  return;
+}
+
+/* There is nothing to wait for in the host build */
+void system_sleep(void) {
+  return;
+}
+
+/* "Reset" by terminating the process */
+void system_reset(void) {
+  exit(1);
+}
+
+/* No interrupts in the host build */
+void disable_interrupts(void) {
+  return;
+}
+
+void enable_interrupts(void) {
+  return;
+}
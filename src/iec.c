@@ -49,6 +49,7 @@
 #include "fileops.h"
 #include "filesystem.h"
 #include "iec-bus.h"
+#include "imagecache.h"
 #include "led.h"
 #include "system.h"
 #include "timer.h"
@@ -576,6 +577,8 @@ void iec_mainloop(void) {
       parallel_set_dir(PARALLEL_DIR_IN);
       set_iec_atn_irq(1);
       while (IEC_ATN) {
+        imgcache_idle();
+        fatops_idle();
         handle_lcd();
         handle_buttons();
         system_sleep();
@@ -25,8 +25,9 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-// If nonzero, output all bus data
-#define DEBUG_BUS_DATA 1
+// If nonzero, trace all bus data bytes
+// (fills the trace ring faster than it can be drained during LOADs)
+#define DEBUG_BUS_DATA 0
 
 // Ratio of bus interactions / other actions
 #define BUS_RATIO 255
@@ -34,8 +35,10 @@
 
 #include "config.h"
 
-#include <avr/io.h>
-#include <avr/pgmspace.h>
+#ifdef __AVR__
+# include <avr/io.h>
+#endif
+#include "progmem.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,6 +53,7 @@
 #include "fatops.h"
 #include "fileops.h"
 #include "filesystem.h"
+#include "imagecache.h"
 #include "led.h"
 #include "bus.h"
 #include "fastloader.h"
@@ -59,6 +63,7 @@
 #include "system.h"
 #include "lcd.h"
 #include "timer.h"
+#include "trace.h"
 #include "menu.h"
 #include "eeprom-conf.h"
 
@@ -421,7 +426,7 @@ void ieee488_BusIdle(void) {
   ieee488_SetNRFD(1);                           // NRFD high
   if (ieee488_TE75160 != TE_LISTEN)
     ieee488_DataListen();
-  uart_puts_P(PSTR("idle\r\n"));
+  trace_event(TRACE_IDLE, 0, 0);
 }
 
 
@@ -502,7 +507,7 @@ static void ieee488_IgnoreBytes(void) {
   uint8_t BusSignals;
   char c;
 
-  uart_puts_P(PSTR("Ignoring data\n"));
+  trace_event(TRACE_IGNORE, 0, 0);
   do {
     BusSignals = ieee488_RxByte(&c);
   } while ((BusSignals != RX_ATN) && (BusSignals != RX_IFC));
@@ -518,7 +523,7 @@ void ieee488_ListenLoop(uint8_t action, uint8_t sa) {
   // Abort if there is no buffer or it's not open for writing
   // and it isn't an OPEN command
   if ((buf == NULL || !buf->write) && (action != LL_OPEN)) {
-    uart_puts_P(PSTR("LLabort\n"));
+    trace_event(TRACE_LL_ABORT, sa, TRACE_ABORT_NOBUFFER);
     ieee488_IgnoreBytes();
     return;
   }
@@ -526,7 +531,7 @@ void ieee488_ListenLoop(uint8_t action, uint8_t sa) {
   if (sa == 15)
     command_received = true;
 
-  printf("LL %d\r\n", sa);
+  trace_event(TRACE_LL, sa, action);
 
   for (;;) {
     BusSignals = ieee488_RxByte(&c);  // Read byte from IEEE bus
@@ -543,7 +548,7 @@ void ieee488_ListenLoop(uint8_t action, uint8_t sa) {
     // Flush buffer if full
     if (buf->mustflush) {
       if (buf->refill(buf)) {
-        uart_puts_P(PSTR("refill abort\r\n"));
+        trace_event(TRACE_LL_ABORT, sa, TRACE_ABORT_REFILL);
         ieee488_IgnoreBytes();
         return;
       }
@@ -556,7 +561,7 @@ void ieee488_ListenLoop(uint8_t action, uint8_t sa) {
     mark_buffer_dirty(buf);
 
 #if DEBUG_BUS_DATA
-    uart_puthex(c); uart_putc(' ');
+    trace_event(TRACE_RXDATA, c, buf->position);
 #endif
 
     if (buf->lastused < buf->position) buf->lastused = buf->position;
@@ -568,7 +573,7 @@ void ieee488_ListenLoop(uint8_t action, uint8_t sa) {
     // REL files must be syncronized on EOI
     if (buf->recordlen && BusSignals == RX_EOI) {
       if (buf->refill(buf)) {
-        uart_puts_P(PSTR("refill abort2\r\n"));
+        trace_event(TRACE_LL_ABORT, sa, TRACE_ABORT_RELSYNC);
         ieee488_IgnoreBytes();
         return;
       }
@@ -577,9 +582,49 @@ void ieee488_ListenLoop(uint8_t action, uint8_t sa) {
 }
 
 
+/**
+ * ieee488_CanPrefetch - check if a buffer can be refilled early
+ * @buf: buffer to check
+ * @sa : secondary address of the buffer
+ *
+ * Returns true if the next block of the buffer may be read while the
+ * last byte of the current one is still on the bus. That byte must be
+ * sent again if the listener does not accept it, which is not possible
+ * for bytes sent with EOI and for direct access and command channel
+ * buffers that are refilled in place.
+ */
+static inline bool ieee488_CanPrefetch(buffer_t *buf, uint8_t sa) {
+  return !buf->sendeoi && !buf->recordlen && sa != 15 &&
+         buf->refill != directbuffer_refill;
+}
+
+
+/**
+ * ieee488_UnsendByte - put back a byte the listener did not accept
+ * @buf: buffer that was refilled while the byte was on the bus
+ * @c  : byte to send again
+ *
+ * The block that contained the byte is gone when the handshake of its
+ * last byte is aborted, so the byte is stored in front of the next one.
+ * File data blocks start after the link bytes, directory entries at 0
+ * but they are much shorter than a full buffer. Refill callbacks must
+ * not rely on the link bytes still being in the buffer.
+ */
+static void ieee488_UnsendByte(buffer_t *buf, uint8_t c) {
+  if (buf->position == 0) {
+    memmove(buf->data + 1, buf->data, buf->lastused + 1);
+    buf->lastused++;
+  } else
+    buf->position--;
+  buf->data[buf->position] = c;
+}
+
+
 void ieee488_TalkLoop(uint8_t sa) {
   int  c;
   bool LastByte;
+  bool Prefetched;
+  uint8_t RefillError = 0;
   buffer_t *buf;
 
   // This function returns immediately on ATN low.
@@ -588,7 +633,7 @@ void ieee488_TalkLoop(uint8_t sa) {
 
   buf = find_buffer(sa);
   if (buf == NULL) {
-    uart_puts_P(PSTR("T0\r\n"));
+    trace_event(TRACE_TALKLOOP, 0x0, sa);
     ieee488_BusIdle();
     return;
   }
@@ -596,13 +641,14 @@ void ieee488_TalkLoop(uint8_t sa) {
   ieee488_CtrlPortsTalk();              // Set hardware to TALK mode
 
   while (buf->read) {
+    Prefetched = false;
     do {
       if (ieee488_CheckIFC()) return;   // IFC received, abort
       ieee488_SetDAV(1);                // Release DAV and EOI
       ieee488_SetEOI(1);
       while (ieee488_NDAC()) {          // Wait for NDAC low
         if (ieee488_ATN_received) {
-          uart_puts_P(PSTR("T1\r\n"));
+          trace_event(TRACE_TALKLOOP, 0x1, sa);
           ieee488_BusIdle();
           return;
         }
@@ -610,7 +656,7 @@ void ieee488_TalkLoop(uint8_t sa) {
       }
       while (!ieee488_NRFD()) {         // Wait for NRFD high
         if (ieee488_ATN_received) {
-          uart_puts_P(PSTR("T2\r\n"));
+          trace_event(TRACE_TALKLOOP, 0x2, sa);
           return;
         }
         if (ieee488_CheckIFC()) return;
@@ -621,7 +667,7 @@ void ieee488_TalkLoop(uint8_t sa) {
       c = buf->data[buf->position];
 
       if (ieee488_NDAC() || ieee488_ATN_received) {   // NDAC must stay low
-        uart_puts_P(PSTR("T3\r\n"));
+        trace_event(TRACE_TALKLOOP, 0x3, sa);
         ieee488_BusIdle();
         return;
       }
@@ -632,28 +678,45 @@ void ieee488_TalkLoop(uint8_t sa) {
         ieee488_DataTalk();
       ieee488_SetData(c);
       if (ieee488_NDAC() || ieee488_ATN_received) {
-        uart_puts_P(PSTR("T4\r\n"));
+        trace_event(TRACE_TALKLOOP, 0x4, sa);
         return;
       }
       ieee488_SetDAV(0);                // Say data valid
 
+      // The last byte of the block is latched on the bus, read the
+      // next block while the listener takes it. The listener waits
+      // for DAV=1 without timeout after accepting the byte.
+      if (LastByte && ieee488_CanPrefetch(buf, sa)) {
+        trace_event(TRACE_TALKLOOP, 0x7, sa);
+        Prefetched  = true;
+        RefillError = buf->refill(buf);
+        // Search the buffer again, it can change when using large buffers
+        buf = find_buffer(sa);
+      }
+
       // Wait for NRFD low, NDAC must stay low
       while (ieee488_NRFD()) {
         if (ieee488_NDAC() || ieee488_ATN_received) {
           ieee488_SetDAV(1);
           ieee488_SetEOI(1);            // Release DAV and EOI
-          uart_puts_P(PSTR("T5\r\n"));
+          if (Prefetched && !RefillError)
+            ieee488_UnsendByte(buf, c);
+          trace_event(TRACE_TALKLOOP, 0x5, sa);
           ieee488_BusIdle();
           return;
         }
         if (ieee488_CheckIFC()) return;
       }
 
-      while (!ieee488_NDAC()) {         // Wait for NDAC high
+      // Wait for NDAC high. The ATN interrupt pulls NRFD low and releases
+      // NDAC itself, so the byte was not accepted if it came in meanwhile.
+      while (!ieee488_NDAC() || ieee488_ATN_received) {
         if (ieee488_ATN_received) {
           ieee488_SetDAV(1);
           ieee488_SetEOI(1);            // Release DAV and EOI
-          uart_puts_P(PSTR("T6\r\n"));
+          if (Prefetched && !RefillError)
+            ieee488_UnsendByte(buf, c);
+          trace_event(TRACE_TALKLOOP, 0x6, sa);
           return;
         }
         if (ieee488_CheckIFC()) return;
@@ -662,42 +725,48 @@ void ieee488_TalkLoop(uint8_t sa) {
       // Listeners have received our byte
 
 #if DEBUG_BUS_DATA
-      uart_puthex(c); uart_putc(' ');
+      trace_event(TRACE_TXDATA, c, Prefetched ? 0 : buf->position);
 #endif
 
-    } while (buf->position++ < buf->lastused);
+    } while (!Prefetched && buf->position++ < buf->lastused);
 
     // PET/CBM-II wait here without timeout until DAV=1
     // Perfect for flushing buffers without hurry
 
-    uart_puts_P(PSTR("T7\r\n"));
+    if (!Prefetched) {
+      trace_event(TRACE_TALKLOOP, 0x7, sa);
 
-    if (buf->sendeoi && sa != 15 && !buf->recordlen &&
-        buf->refill != directbuffer_refill) {
-      buf->read = 0;
-      ieee488_SetDAV(1);
-      ieee488_SetEOI(1);                // Release DAV and EOI
-      uart_puts_P(PSTR("T8\r\n"));
-      break;
+      if (buf->sendeoi && sa != 15 && !buf->recordlen &&
+          buf->refill != directbuffer_refill) {
+        buf->read = 0;
+        ieee488_SetDAV(1);
+        ieee488_SetEOI(1);              // Release DAV and EOI
+        trace_event(TRACE_TALKLOOP, 0x8, sa);
+        break;
+      }
+
+      RefillError = buf->refill(buf);   // Refill buffer
+
+      // Search the buffer again, it can change when using large buffers
+      buf = find_buffer(sa);
     }
 
-    if (buf->refill(buf)) {             // Refill buffer
+    trace_drain();                      // Hand trace records to the UART
+
+    if (RefillError) {
       ieee488_SetDAV(1);
       ieee488_SetEOI(1);                // Release DAV and EOI
-      uart_puts_P(PSTR("T9\r\n"));
+      trace_event(TRACE_TALKLOOP, 0x9, sa);
       return;
     }
-
-    // Search the buffer again, it can change when using large buffers
-    buf = find_buffer(sa);
   }
 
-  uart_puts_P(PSTR("TA\r\n"));
+  trace_event(TRACE_TALKLOOP, 0xA, sa);
 }
 
 
 void ieee488_Unlisten(void) {
-  uart_puts_P(PSTR("ULN\r\n"));
+  trace_event(TRACE_ULN, 0, 0);
   ieee488_BusIdle();
 
   // If we received a command or a file name to open, process it now
@@ -709,11 +778,14 @@ void ieee488_Unlisten(void) {
   }
   ieee488_ListenActive = command_received = open_active = false;
   command_length = 0;
+
+  // We're done, write back BAM and cached image data
+  d64_bam_commit();
 }
 
 
 void ieee488_Untalk(void) {
-  uart_puts_P(PSTR("UTK\r\n"));
+  trace_event(TRACE_UTK, 0, 0);
   ieee488_BusIdle();
   ieee488_TalkingDevice = 0;            // we don't talk any more
 }
@@ -721,7 +793,7 @@ void ieee488_Untalk(void) {
 
 void ieee488_ProcessIFC(void) {
   ieee488_IFCreceived = false;
-  uart_puts_P(PSTR("\r\nIFC\r\n"));
+  trace_event(TRACE_IFC, 0, 0);
   free_multiple_buffers(FMB_USER_CLEAN);
   ieee488_Init();
   read_configuration();
@@ -790,7 +862,7 @@ void handle_ieee488(void) {
     Device = cmd & 0b00011111;
     sa     = cmd & 0b00001111;
 
-    uart_puthex(cmd); uart_putc(' ');
+    trace_event(TRACE_CMD, cmd, 0);
 
     if (cmd == IEEE_UNLISTEN)             // UNLISTEN
       ieee488_Unlisten();
@@ -798,7 +870,7 @@ void handle_ieee488(void) {
       ieee488_Untalk();
     else if (cmd3 == IEEE_LISTEN) {       // LISTEN
       if (Device == device_address) {
-        uart_puts_P(PSTR("LSN\r\n"));
+        trace_event(TRACE_LSN, Device, 0);
         ieee488_ListenActive = Device;
         // Override talk state because we can't be
         // listener and talker at the same time
@@ -806,7 +878,7 @@ void handle_ieee488(void) {
       }
     } else if (cmd3 == IEEE_TALK) {       // TALK
       if (Device == device_address) {
-        uart_puts_P(PSTR("TLK\r\n"));
+        trace_event(TRACE_TLK, Device, 0);
         ieee488_TalkingDevice = Device;
         // Override listen state because we can't be
         // listener and talker at the same time
@@ -815,15 +887,15 @@ void handle_ieee488(void) {
     } else if (cmd4 == IEEE_SECONDARY) {  // DATA
       while (!ieee488_ATN());             // Wait for ATN high
       if (ieee488_ListenActive) {
-        printf("DTA L %d\r\n", sa);
+        trace_event(TRACE_DTA_L, sa, 0);
         ieee488_ListenLoop(LL_RECEIVE, sa);
       } else if (ieee488_TalkingDevice) {
-        printf("DTA T %d\r\n", sa);
+        trace_event(TRACE_DTA_T, sa, 0);
         ieee488_TalkLoop(sa);
       }
     } else if (cmd4 == IEEE_CLOSE) {      // CLOSE
       if (ieee488_ListenActive) {
-        printf("CLO %d\r\n", sa);
+        trace_event(TRACE_CLO, sa, 0);
         if (sa == 15) {
           free_multiple_buffers(FMB_USER_CLEAN);
           ieee488_TalkingDevice = 0;
@@ -840,13 +912,13 @@ void handle_ieee488(void) {
       while (!ieee488_ATN())              // Wait for ATN high
         if (ieee488_CheckIFC()) return;
       if (ieee488_ListenActive) {
-        printf("OPN %d\r\n", sa);
+        trace_event(TRACE_OPN, sa, 0);
         open_active = true;
         open_sa = sa;
         ieee488_ListenLoop(LL_OPEN, sa);
       }
     } else {
-      uart_puts_P(PSTR("UKN\r\n"));
+      trace_event(TRACE_UKN, cmd, 0);
     }
   }
 }
@@ -872,12 +944,16 @@ void handle_card_changes(void) {
 
 void ieee_mainloop(void) {
   ieee488_InitIFC();
+  trace_init();
   set_error(ERROR_DOSVERSION);
   for (;;) {
     for (uint8_t i = BUS_RATIO; i != 0; i--) handle_ieee488();
     // We are allowed to do here whatever we want for any time long
     // as long as the ATN interrupt stays enabled
     handle_card_changes();
+    trace_drain();
+    imgcache_idle();
+    fatops_idle();
     handle_lcd();
     if (handle_buttons()) break; // switch to IEC bus?
   }
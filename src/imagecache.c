@@ -0,0 +1,505 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+
+   imagecache.c: Write-back block cache for mounted disk images
+
+   Disk image sectors are 256 bytes, but the card can only write whole
+   512 byte sectors. The cache keeps card-sector-sized blocks of the
+   image file so that successive writes to a block, the directory entry
+   and the BAM are merged into a single card write. Dirty blocks are
+   written back when they are evicted and at the explicit flush points:
+   file close, BAM commit, I/UJ, image unmount and after the bus has
+   been idle for a short time.
+
+   With CONFIG_BUFFER_POOL the cache grows beyond CONFIG_IMAGE_CACHE
+   blocks by borrowing pairs of idle buffers, which are given back
+   when the buffers are needed for a channel.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "config.h"
+#include "buffers.h"
+#include "dirent.h"
+#include "fatops.h"
+#include "ff.h"
+#include "parser.h"
+#include "timer.h"
+#include "imagecache.h"
+
+#define BLOCK_SIZE     512
+#define UNUSED_PART    0xff
+#define IDLE_FLUSH     (HZ / 2)
+
+typedef struct {
+  DWORD    block;             /* image file offset / BLOCK_SIZE */
+  uint16_t stamp;             /* last access, for LRU replacement */
+  uint8_t  part;              /* partition or UNUSED_PART */
+  uint8_t  dirty;
+} imgcache_entry_t;
+
+#ifdef CONFIG_BUFFER_POOL
+/* entries after the static ones hold their data in borrowed buffers */
+#  define BORROWED_ENTRIES ((CONFIG_BUFFER_POOL + 1) / 2)
+#else
+#  define BORROWED_ENTRIES 0
+#endif
+#define ENTRY_COUNT (CONFIG_IMAGE_CACHE + BORROWED_ENTRIES)
+
+/* block data is kept separately so adjacent entries can be read at once */
+static imgcache_entry_t imgcache[ENTRY_COUNT];
+static uint8_t  blockdata[CONFIG_IMAGE_CACHE][BLOCK_SIZE];
+static uint16_t access_clock;
+static uint8_t  dirty_count;
+static tick_t   idle_flush_time;
+
+#ifdef CONFIG_BUFFER_POOL
+/* lent buffers of the borrowed entries, NULL if an entry has none */
+static buffer_t *borrowed[BORROWED_ENTRIES];
+#endif
+
+/* returns a pointer to the block data of an entry */
+static uint8_t *entry_data(imgcache_entry_t *entry) {
+  uint8_t num = entry - imgcache;
+
+#ifdef CONFIG_BUFFER_POOL
+  if (num >= CONFIG_IMAGE_CACHE)
+    return borrowed[num - CONFIG_IMAGE_CACHE]->data;
+#endif
+  return blockdata[num];
+}
+
+/* number of bytes of the image file that are stored in a block */
+static uint16_t block_length(uint8_t part, DWORD block) {
+  DWORD remain = partition[part].imagehandle.fsize - block * BLOCK_SIZE;
+
+  if (remain > BLOCK_SIZE)
+    return BLOCK_SIZE;
+  else
+    return remain;
+}
+
+/* time since the last access to an entry, unused entries are the oldest */
+static uint16_t entry_age(imgcache_entry_t *entry) {
+  if (entry->part == UNUSED_PART)
+    return 0xffff;
+  else
+    return access_clock - entry->stamp;
+}
+
+/* returns the cache entry holding a block or NULL if it isn't cached */
+static imgcache_entry_t *find_entry(uint8_t part, DWORD block) {
+  imgcache_entry_t *entry;
+
+  for (entry = imgcache; entry < imgcache + ENTRY_COUNT; entry++)
+    if (entry->part == part && entry->block == block)
+      return entry;
+
+  return NULL;
+}
+
+/**
+ * write_back - write a dirty cache entry to the image file
+ * @entry: pointer to the cache entry
+ *
+ * This function writes the contents of @entry to the image file and
+ * marks it as clean if the write succeeded. Returns 0 if successful,
+ * 1 for a short write or 2 on failure.
+ */
+static uint8_t write_back(imgcache_entry_t *entry) {
+  FIL     *fh  = &partition[entry->part].imagehandle;
+  uint16_t len = block_length(entry->part, entry->block);
+  FRESULT  res;
+  UINT     byteswritten;
+
+  res = f_lseek(fh, entry->block * BLOCK_SIZE);
+  if (res == FR_OK)
+    res = f_write(fh, entry_data(entry), len, &byteswritten);
+
+  if (res != FR_OK) {
+    parse_error(res, 0);
+    return 2;
+  }
+
+  if (byteswritten != len)
+    return 1;
+
+  entry->dirty = 0;
+  dirty_count--;
+  return 0;
+}
+
+/**
+ * load_blocks - read consecutive image blocks into adjacent cache entries
+ * @entry: pointer to the first cache entry
+ * @part : partition number
+ * @block: first block number in the image file
+ * @count: number of blocks
+ *
+ * This function writes back the current contents of the @count entries
+ * starting at @entry if required and reads the image blocks starting
+ * at @block into them with a single read. If a write back fails, the
+ * entries are left untouched. Returns 0 if successful, != 0 otherwise.
+ */
+static uint8_t load_blocks(imgcache_entry_t *entry, uint8_t part, DWORD block, uint8_t count) {
+  FIL     *fh = &partition[part].imagehandle;
+  FRESULT  res;
+  UINT     len, bytesread;
+  uint8_t  i, err;
+
+  for (i = 0; i < count; i++)
+    if (entry[i].dirty && (err = write_back(&entry[i])))
+      return err;
+
+  for (i = 0; i < count; i++)
+    entry[i].part = UNUSED_PART;
+
+  len = (count - 1) * BLOCK_SIZE + block_length(part, block + count - 1);
+
+  res = f_lseek(fh, block * BLOCK_SIZE);
+  if (res == FR_OK)
+    res = f_read(fh, entry_data(entry), len, &bytesread);
+
+  if (res != FR_OK) {
+    parse_error(res, 1);
+    return 2;
+  }
+
+  if (bytesread != len)
+    return 1;
+
+  for (i = 0; i < count; i++) {
+    entry[i].part  = part;
+    entry[i].block = block + i;
+    entry[i].stamp = access_clock;
+  }
+
+  return 0;
+}
+
+#ifdef CONFIG_BUFFER_POOL
+/**
+ * give_back - return the buffers of a borrowed entry
+ * @num: number of the borrowed entry
+ *
+ * This function drops the block held in borrowed entry @num after
+ * writing it back if required and returns its buffers. If the block
+ * cannot be written, the entry stays dirty and keeps its buffers.
+ */
+static void give_back(uint8_t num) {
+  imgcache_entry_t *entry = imgcache + CONFIG_IMAGE_CACHE + num;
+
+  if (entry->dirty && write_back(entry))
+    return;
+
+  entry->part = UNUSED_PART;
+
+  return_buffers(borrowed[num], BLOCK_SIZE / 256);
+  borrowed[num] = NULL;
+}
+
+/**
+ * imgcache_reclaim - reclaim callback for borrowed buffers
+ * @buf: pointer to the first lent buffer
+ *
+ * This function gives the buffers of the borrowed entry that uses
+ * @buf back, so the buffer code can allocate them for a channel.
+ */
+static void imgcache_reclaim(buffer_t *buf) {
+  uint8_t i;
+
+  for (i = 0; i < BORROWED_ENTRIES; i++)
+    if (borrowed[i] == buf)
+      give_back(i);
+}
+
+/**
+ * borrow_entry - choose a borrowed entry for a block
+ * @victim: least recently used static entry
+ *
+ * This function returns the entry that should be replaced with a new
+ * block. Instead of evicting a block from a full cache it tries to
+ * borrow buffers for another entry first, otherwise it returns the
+ * least recently used of @victim and the borrowed entries.
+ */
+static imgcache_entry_t *borrow_entry(imgcache_entry_t *victim) {
+  imgcache_entry_t *entry = imgcache + CONFIG_IMAGE_CACHE;
+  uint8_t i, empty = BORROWED_ENTRIES;
+
+  for (i = 0; i < BORROWED_ENTRIES; i++, entry++) {
+    if (borrowed[i] == NULL) {
+      if (empty == BORROWED_ENTRIES)
+        empty = i;
+    } else if (entry_age(entry) > entry_age(victim))
+      victim = entry;
+  }
+
+  if (victim->part != UNUSED_PART && empty != BORROWED_ENTRIES) {
+    borrowed[empty] = lend_buffers(BLOCK_SIZE / 256, imgcache_reclaim);
+    if (borrowed[empty] != NULL)
+      victim = imgcache + CONFIG_IMAGE_CACHE + empty;
+  }
+
+  return victim;
+}
+#endif
+
+/**
+ * get_entry - find or load the cache entry for an image block
+ * @part : partition number
+ * @block: block number in the image file
+ *
+ * This function returns a pointer to the cache entry that holds @block
+ * of the image on @part, loading it into the least recently used entry
+ * if it is not cached yet. Returns NULL if the block could not be read.
+ */
+static imgcache_entry_t *get_entry(uint8_t part, DWORD block) {
+  imgcache_entry_t *entry, *victim;
+
+  entry = find_entry(part, block);
+  if (entry == NULL) {
+    victim = imgcache;
+    for (entry = imgcache + 1; entry < imgcache + CONFIG_IMAGE_CACHE; entry++)
+      if (entry_age(entry) > entry_age(victim))
+        victim = entry;
+
+#ifdef CONFIG_BUFFER_POOL
+    victim = borrow_entry(victim);
+#endif
+    entry = victim;
+    if (load_blocks(entry, part, block, 1))
+      return NULL;
+  }
+
+  entry->stamp = ++access_clock;
+  return entry;
+}
+
+/**
+ * imgcache_prefetch - read ahead around an image offset
+ * @part  : partition number
+ * @offset: offset of the data that will be needed next
+ * @start : start offset of the range that may be read ahead
+ * @end   : end offset of the range that may be read ahead
+ *
+ * If the block containing @offset is not cached, this function reads
+ * it together with the uncached blocks following and preceding it
+ * within [@start, @end) using a single read, so a card that supports
+ * multi-block reads only needs one command. At most IMGCACHE_PREFETCH
+ * blocks are read, they replace the adjacent static entries that were
+ * used least recently.
+ */
+void imgcache_prefetch(uint8_t part, DWORD offset, DWORD start, DWORD end) {
+  imgcache_entry_t *entry, *window;
+  DWORD    block, first, last;
+  uint16_t age, best_age;
+  uint8_t  count, i;
+
+  block = offset / BLOCK_SIZE;
+  if (end > partition[part].imagehandle.fsize)
+    end = partition[part].imagehandle.fsize;
+  if (offset >= end || find_entry(part, block) != NULL)
+    return;
+
+  /* extend the range over uncached blocks, forward first */
+  first = last = block;
+  while (last - first + 1 < IMGCACHE_PREFETCH &&
+         (last + 1) * BLOCK_SIZE < end &&
+         find_entry(part, last + 1) == NULL)
+    last++;
+
+  while (last - first + 1 < IMGCACHE_PREFETCH &&
+         first > start / BLOCK_SIZE &&
+         find_entry(part, first - 1) == NULL)
+    first--;
+
+  count = last - first + 1;
+
+  /* use the adjacent entries whose most recent access is the oldest */
+  window   = imgcache;
+  best_age = 0;
+  for (entry = imgcache; entry + count <= imgcache + CONFIG_IMAGE_CACHE; entry++) {
+    age = 0xffff;
+    for (i = 0; i < count; i++)
+      if (entry_age(&entry[i]) < age)
+        age = entry_age(&entry[i]);
+
+    if (age > best_age) {
+      best_age = age;
+      window   = entry;
+    }
+  }
+
+  load_blocks(window, part, first, count);
+}
+
+/**
+ * imgcache_read - read data from a disk image through the cache
+ * @part  : partition number
+ * @offset: offset in the image file
+ * @buffer: pointer to the destination buffer
+ * @bytes : number of bytes to read
+ *
+ * This function reads @bytes bytes at @offset from the image file
+ * mounted on @part. The range must be completely within the image file.
+ * Returns the same as image_read.
+ */
+uint8_t imgcache_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes) {
+  imgcache_entry_t *entry;
+  uint8_t *ptr = buffer;
+  uint16_t ofs, len;
+
+  while (bytes) {
+    ofs = offset % BLOCK_SIZE;
+    len = BLOCK_SIZE - ofs;
+    if (len > bytes)
+      len = bytes;
+
+    entry = get_entry(part, offset / BLOCK_SIZE);
+    if (entry == NULL)
+      return 2;
+
+    memcpy(ptr, entry_data(entry) + ofs, len);
+    ptr    += len;
+    offset += len;
+    bytes  -= len;
+  }
+
+  return 0;
+}
+
+/**
+ * imgcache_write - write data to a disk image through the cache
+ * @part  : partition number
+ * @offset: offset in the image file
+ * @buffer: pointer to the source buffer
+ * @bytes : number of bytes to write
+ *
+ * This function writes @bytes bytes from @buffer at @offset into the
+ * image file mounted on @part. The range must be completely within
+ * the image file. The data is only written to the card when the block
+ * is evicted or the cache is flushed. Returns the same as image_write.
+ */
+uint8_t imgcache_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes) {
+  imgcache_entry_t *entry;
+  uint8_t *ptr = buffer;
+  uint16_t ofs, len;
+
+  while (bytes) {
+    ofs = offset % BLOCK_SIZE;
+    len = BLOCK_SIZE - ofs;
+    if (len > bytes)
+      len = bytes;
+
+    entry = get_entry(part, offset / BLOCK_SIZE);
+    if (entry == NULL)
+      return 2;
+
+    memcpy(entry_data(entry) + ofs, ptr, len);
+    if (!entry->dirty) {
+      entry->dirty = 1;
+      dirty_count++;
+    }
+
+    ptr    += len;
+    offset += len;
+    bytes  -= len;
+  }
+
+  idle_flush_time = getticks() + IDLE_FLUSH;
+  return 0;
+}
+
+/**
+ * imgcache_flush - write back dirty blocks
+ * @part: partition number or IMGCACHE_ALL
+ *
+ * This function writes all dirty blocks of the image mounted on @part
+ * (or of all images) to the card and syncs the image file if anything
+ * was written. Returns 0 if successful, != 0 otherwise.
+ */
+uint8_t imgcache_flush(uint8_t part) {
+  imgcache_entry_t *entry;
+  uint8_t res = 0;
+  uint8_t i, written;
+
+  for (i = 0; i < max_part; i++) {
+    if (part != IMGCACHE_ALL && part != i)
+      continue;
+
+    written = 0;
+    for (entry = imgcache; entry < imgcache + ENTRY_COUNT; entry++) {
+      if (entry->part == i && entry->dirty) {
+        res |= write_back(entry);
+        written = 1;
+      }
+    }
+
+    if (written)
+      f_sync(&partition[i].imagehandle);
+  }
+
+  return res;
+}
+
+/**
+ * imgcache_invalidate - drop all cached blocks of a partition
+ * @part: partition number or IMGCACHE_ALL
+ *
+ * This function discards all blocks of @part (or all blocks) from the
+ * cache without writing them back, use imgcache_flush first if required.
+ * Borrowed buffers whose blocks were dropped are given back.
+ */
+void imgcache_invalidate(uint8_t part) {
+  imgcache_entry_t *entry;
+
+  for (entry = imgcache; entry < imgcache + ENTRY_COUNT; entry++) {
+    if (part == IMGCACHE_ALL || entry->part == part) {
+      if (entry->dirty)
+        dirty_count--;
+      entry->part  = UNUSED_PART;
+      entry->dirty = 0;
+    }
+  }
+
+#ifdef CONFIG_BUFFER_POOL
+  for (uint8_t i = 0; i < BORROWED_ENTRIES; i++)
+    if (borrowed[i] != NULL && imgcache[CONFIG_IMAGE_CACHE + i].part == UNUSED_PART)
+      give_back(i);
+#endif
+}
+
+/**
+ * imgcache_idle - flush the cache when the bus has been idle
+ *
+ * This function must be called regularly from the bus main loop.
+ * It flushes all dirty blocks once no image write happened for
+ * a short time. Blocks that could not be written are tried again
+ * after the same delay.
+ */
+void imgcache_idle(void) {
+  if (dirty_count && time_after(getticks(), idle_flush_time))
+    if (imgcache_flush(IMGCACHE_ALL))
+      idle_flush_time = getticks() + IDLE_FLUSH;
+}
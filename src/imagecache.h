@@ -0,0 +1,59 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+
+   imagecache.h: Write-back block cache for mounted disk images
+
+*/
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <stdint.h>
+#include "ff.h"
+
+/* partition number that selects all partitions in imgcache_flush */
+#define IMGCACHE_ALL 0xff
+
+/* maximum number of blocks read at once by imgcache_prefetch */
+#define IMGCACHE_PREFETCH (CONFIG_IMAGE_CACHE > 2 ? CONFIG_IMAGE_CACHE - 2 : 1)
+
+#ifdef CONFIG_IMAGE_CACHE
+
+uint8_t imgcache_read(uint8_t part, DWORD offset, void *buffer, uint16_t bytes);
+uint8_t imgcache_write(uint8_t part, DWORD offset, void *buffer, uint16_t bytes);
+uint8_t imgcache_flush(uint8_t part);
+void    imgcache_prefetch(uint8_t part, DWORD offset, DWORD start, DWORD end);
+void    imgcache_invalidate(uint8_t part);
+void    imgcache_idle(void);
+
+#else
+
+static inline uint8_t imgcache_flush(uint8_t part) { return 0; }
+static inline void    imgcache_invalidate(uint8_t part) {}
+static inline void    imgcache_prefetch(uint8_t part, DWORD offset, DWORD start, DWORD end) {}
+static inline void    imgcache_idle(void) {}
+
+#endif
+
+#endif
@@ -68,6 +68,17 @@ static inline void iec_interrupts_init(void) {
 /* P00 name cache is in AHB ram */
 #define P00CACHE_ATTRIB __attribute__((section(".ahbram")))
 
+/* DNP BAM cache is in AHB ram too, both don't fit at full size */
+#define BAMCACHE_ATTRIB __attribute__((section(".ahbram")))
+
+/* FAT directory cache is in normal RAM */
+#define DIRCACHE_ATTRIB
+
+/* Buffer pool uses the AHB ram left over by the caches above */
+extern uint8_t __ahbram_end__[], __ahbram_limit__[];
+#define BUFFER_POOL_START __ahbram_end__
+#define BUFFER_POOL_END   __ahbram_limit__
+
 // FIXME: Add a fully-commented example configuration that
 //        demonstrates all configuration possilibilites
 
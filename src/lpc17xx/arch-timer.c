@@ -140,3 +140,23 @@ void start_timeout(unsigned int usecs) {
 unsigned int has_timed_out(void) {
   return !BITBAND(TIMEOUT_TIMER->TCR, 0);
 }
+
+/* SysTick counts CPU clocks, scale them down to fit 16 bits */
+#define SUBTICK_SHIFT 5
+
+/**
+ * timer_subticks - returns the position within the current tick
+ *
+ * This function returns the number of SysTick counts since the last
+ * tick interrupt in units of 32 clock cycles.
+ */
+uint16_t timer_subticks(void) {
+  return (SysTick->LOAD - SysTick->VAL) >> SUBTICK_SHIFT;
+}
+
+/**
+ * timer_subticks_per_tick - returns the number of subticks in a tick
+ */
+uint16_t timer_subticks_per_tick(void) {
+  return (SysTick->LOAD + 1) >> SUBTICK_SHIFT;
+}
@@ -42,4 +42,8 @@ void delay_ms(unsigned int time);
 void start_timeout(unsigned int usecs);
 unsigned int has_timed_out(void);
 
+/* Fine timestamp within the current tick */
+uint16_t timer_subticks(void);
+uint16_t timer_subticks_per_tick(void);
+
 #endif
@@ -110,7 +110,13 @@ void spi_tx_block(const void *ptr, unsigned int length) {
   }
 }
 
-void spi_rx_block(void *ptr, unsigned int length) {
+/* Source of the dummy bytes clocked out while receiving with DMA */
+static uint8_t dummy_ff = 0xff;
+
+/* Set when the current transfer runs on DMA and must be waited for */
+static uint8_t dma_active;
+
+void spi_rx_block_start(void *ptr, unsigned int length) {
   uint8_t *data = (uint8_t *)ptr;
   unsigned int txlen = length;
 
@@ -141,9 +147,9 @@ void spi_rx_block(void *ptr, unsigned int length) {
       }
     }
   } else {
-    /* Clear interrupt flags of DMA channels 0 */
-    LPC_GPDMA->DMACIntTCClear = BV(0);
-    LPC_GPDMA->DMACIntErrClr  = BV(0);
+    /* Clear interrupt flags of DMA channels 0 and 1 */
+    LPC_GPDMA->DMACIntTCClear = BV(0) | BV(1);
+    LPC_GPDMA->DMACIntErrClr  = BV(0) | BV(1);
 
     /* Set up RX DMA channel */
     LPC_GPDMACH0->DMACCSrcAddr  = (uint32_t)&SSP_REGS->DR;
@@ -162,23 +168,74 @@ void spi_rx_block(void *ptr, unsigned int length) {
       | (2 << 11) // transfer from peripheral to memory
       ;
 
-    /* Enable RX FIFO DMA */
-    SSP_REGS->DMACR = 1;
+    /* Set up TX DMA channel, clocks out the same dummy byte <length> times */
+    LPC_GPDMACH1->DMACCSrcAddr  = (uint32_t)&dummy_ff;
+    LPC_GPDMACH1->DMACCDestAddr = (uint32_t)&SSP_REGS->DR;
+    LPC_GPDMACH1->DMACCLLI      = 0; // no linked list
+    LPC_GPDMACH1->DMACCControl  = length
+      | (0 << 12) // source burst size 1
+      | (0 << 15) // destination burst size 1
+      | (0 << 18) // source transfer width 1 byte
+      | (0 << 21) // destination transfer width 1 byte
+      | (0 << 26) // source address not incremented
+      | (0 << 27) // destination address not incremented
+      ;
+    LPC_GPDMACH1->DMACCConfig = 1 // enable channel
+      | (SSP_DMAID_TX << 6) // data destination SSP TX
+      | (1 << 11) // transfer from memory to peripheral
+      ;
 
-    /* Write <length> bytes into TX FIFO */
-    while (txlen > 0) {
-      while (txlen > 0 && BITBAND(SSP_REGS->SR, SSP_TNF)) {
-        txlen--;
-        SSP_REGS->DR = 0xff;
-      }
-    }
+    /* Enable RX and TX FIFO DMA, the RX channel has the higher priority */
+    SSP_REGS->DMACR = BV(0) | BV(1);
+    dma_active = 1;
+  }
+}
 
-    /* Wait until DMA channel disables itself */
-    while (LPC_GPDMACH0->DMACCConfig & 1) ;
+void spi_tx_block_start(const void *ptr, unsigned int length) {
+  if (length == 0)
+    return;
+
+  /* Clear interrupt flags of DMA channel 1 */
+  LPC_GPDMA->DMACIntTCClear = BV(1);
+  LPC_GPDMA->DMACIntErrClr  = BV(1);
+
+  /* Set up TX DMA channel, the received bytes are discarded */
+  LPC_GPDMACH1->DMACCSrcAddr  = (uint32_t)ptr;
+  LPC_GPDMACH1->DMACCDestAddr = (uint32_t)&SSP_REGS->DR;
+  LPC_GPDMACH1->DMACCLLI      = 0; // no linked list
+  LPC_GPDMACH1->DMACCControl  = length
+    | (0 << 12) // source burst size 1
+    | (0 << 15) // destination burst size 1
+    | (0 << 18) // source transfer width 1 byte
+    | (0 << 21) // destination transfer width 1 byte
+    | (1 << 26) // source address incremented
+    | (0 << 27) // destination address not incremented
+    ;
+  LPC_GPDMACH1->DMACCConfig = 1 // enable channel
+    | (SSP_DMAID_TX << 6) // data destination SSP TX
+    | (1 << 11) // transfer from memory to peripheral
+    ;
+
+  /* Enable TX FIFO DMA */
+  SSP_REGS->DMACR = BV(1);
+  dma_active = 1;
+}
 
-    /* Disable RX FIFO DMA */
-    SSP_REGS->DMACR = 0;
-  }
+void spi_block_wait(void) {
+  if (!dma_active)
+    return;
+
+  /* Wait until both DMA channels disable themselves */
+  while ((LPC_GPDMACH0->DMACCConfig & 1) || (LPC_GPDMACH1->DMACCConfig & 1)) ;
+
+  /* Disable FIFO DMA */
+  SSP_REGS->DMACR = 0;
+  dma_active = 0;
+}
+
+void spi_rx_block(void *ptr, unsigned int length) {
+  spi_rx_block_start(ptr, length);
+  spi_block_wait();
 }
 
 void spi_set_speed(spi_speed_t speed) {
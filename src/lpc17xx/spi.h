@@ -55,6 +55,18 @@ uint8_t spi_rx_byte(void);
 /* Receive a data block */
 void spi_rx_block(void *data, unsigned int length);
 
+/* Block transfers can run on DMA while the CPU does something else */
+#define HAVE_SPI_DMA
+
+/* Start receiving a data block, finish with spi_block_wait */
+void spi_rx_block_start(void *data, unsigned int length);
+
+/* Start transmitting a data block, finish with spi_block_wait */
+void spi_tx_block_start(const void *data, unsigned int length);
+
+/* Wait until a block transfer started by one of the above is done */
+void spi_block_wait(void);
+
 /* Switch speed of SPI interface */
 void spi_set_speed(spi_speed_t speed);
 
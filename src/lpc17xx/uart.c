@@ -245,6 +245,10 @@ void uart_flush(void) {
   while (read_idx != write_idx) ;
 }
 
+unsigned int uart_txfree(void) {
+  return (read_idx - write_idx - 1) & (sizeof(txbuf)-1);
+}
+
 void uart_puts(const char *text) {
   while (*text) {
     uart_putc(*text++);
@@ -512,7 +512,7 @@ start:
 
   // Allocate buffers with continuous data segments
   // Stores pointers to directory entries for qsort
-  if ((buf_tbl = alloc_linked_buffers(CONFIG_DIR_BUFFERS)) == NULL) return;
+  if ((buf_tbl = alloc_linked_buffers(CONFIG_DIR_BUFFERS, true)) == NULL) return;
 
   // Buffers to store the actual diretory entries.
   // Whilst the directory grows, new buffers get allocated and linked
@@ -715,13 +715,13 @@ reread:
 
   buffer_t *p = buf_tbl;
   do {
-    p->allocated = 0;
+    free_buffer(p);
     p = p->pvt.buffer.next;
   } while (p != NULL);
 
   p = first_buf;
   if (p != NULL) do {
-    p->allocated = 0;
+    free_buffer(p);
     p = p->pvt.buffer.next;
   } while (p != NULL);
 
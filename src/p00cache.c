@@ -34,50 +34,157 @@
 
 #include "uart.h"
 
+/* Open-addressed hash table with linear probing, keyed by partition and */
+/* first cluster. It is never filled beyond P00CACHE_LIMIT entries, so   */
+/* every probe sequence ends at an empty slot. When the limit is reached */
+/* the most recently added entry is replaced if it never got a hit,      */
+/* otherwise the CLOCK hand picks an entry that wasn't used since its    */
+/* last visit. This keeps a stable subset of a directory that is larger  */
+/* than the cache instead of cycling through all of it.                  */
+
 typedef struct {
   uint32_t cluster;
   uint8_t  name[CBM_NAME_LENGTH];
 } p00name_t;
 
-static P00CACHE_ATTRIB p00name_t p00cache[CONFIG_P00CACHE_SIZE / sizeof(p00name_t)];
-static uint8_t      cache_part;
+/* Partition and reference bit are kept in a separate array so */
+/* the entries don't grow by padding.                         */
+#define TAG_REF  0x80  // CLOCK reference bit
+#define TAG_PART 0x7f  // partition + 1, 0 if the slot is empty
+
+#define P00CACHE_ENTRIES (CONFIG_P00CACHE_SIZE / (sizeof(p00name_t) + 1))
+#define P00CACHE_LIMIT   (P00CACHE_ENTRIES * 7 / 8)
+
+static P00CACHE_ATTRIB p00name_t p00cache[P00CACHE_ENTRIES];
+static P00CACHE_ATTRIB uint8_t   p00tag[P00CACHE_ENTRIES];
 static unsigned int entries;
+static unsigned int hand;
+static uint32_t     newest_cluster;
+static uint8_t      newest_part;
+
+uint32_t p00cache_hits;
+uint32_t p00cache_misses;
+
+/* returns the slot holding an entry or the empty slot ending its probe run */
+/* (part is partition + 1 here)                                              */
+static unsigned int find_slot(uint8_t part, uint32_t cluster) {
+  /* multiplicative hash, scatters consecutive clusters over the table */
+  unsigned int i = ((cluster + ((uint32_t)part << 24)) * 2654435761UL >> 8) % P00CACHE_ENTRIES;
+
+  while (p00tag[i]) {
+    if ((p00tag[i] & TAG_PART) == part && p00cache[i].cluster == cluster)
+      break;
+
+    if (++i == P00CACHE_ENTRIES)
+      i = 0;
+  }
+
+  return i;
+}
+
+/* remove an entry and move later entries of its probe run back */
+static void remove_entry(unsigned int i) {
+  unsigned int j = i;
+  unsigned int k;
+
+  p00tag[i] = 0;
+  entries--;
+
+  while (1) {
+    if (++j == P00CACHE_ENTRIES)
+      j = 0;
+
+    if (p00tag[j] == 0)
+      return;
+
+    /* re-insert the entry if the hole is part of its probe run */
+    k = find_slot(p00tag[j] & TAG_PART, p00cache[j].cluster);
+    if (k != j) {
+      p00cache[k] = p00cache[j];
+      p00tag[k]   = p00tag[j];
+      p00tag[j]   = 0;
+    }
+  }
+}
+
+/* free one slot */
+static void evict_entry(void) {
+  unsigned int i;
+
+  /* replace the newest entry while it was never used */
+  if (newest_part) {
+    i = find_slot(newest_part, newest_cluster);
+    newest_part = 0;
+    if (p00tag[i] && !(p00tag[i] & TAG_REF)) {
+      remove_entry(i);
+      return;
+    }
+  }
+
+  /* CLOCK */
+  while (1) {
+    if (p00tag[hand]) {
+      if (p00tag[hand] & TAG_REF) {
+        p00tag[hand] &= TAG_PART;
+      } else {
+        remove_entry(hand);
+        return;
+      }
+    }
+
+    if (++hand == P00CACHE_ENTRIES)
+      hand = 0;
+  }
+}
 
 void p00cache_invalidate(void) {
-  cache_part = -1;
-  entries    = 0;
+  memset(p00tag, 0, sizeof(p00tag));
+
+  entries     = 0;
+  hand        = 0;
+  newest_part = 0;
 }
 
 uint8_t *p00cache_lookup(uint8_t part, uint32_t cluster) {
-  /* fail if it's for a different partition */
-  if (part != cache_part)
-    return NULL;
-
-  /* linear search for the correct cluster number */
-  /* (binary search was only 6-8% faster overall) */
-  for (unsigned int i=0; i<entries; i++) {
-    if (p00cache[i].cluster == cluster)
-      return p00cache[i].name;
+  unsigned int i = find_slot(part + 1, cluster);
+
+  if (p00tag[i]) {
+    p00tag[i] |= TAG_REF;
+    p00cache_hits++;
+    return p00cache[i].name;
   }
 
-  /* noting found */
+  p00cache_misses++;
   return NULL;
 }
 
 void p00cache_add(uint8_t part, uint32_t cluster, uint8_t *name) {
-  /* don't add if the cache is full */
-  if (entries == sizeof(p00cache)/sizeof(p00cache[0]))
-    return;
-
-  /* invalidate if it's for a different partition */
-  // FIXME: ignore instead and add invalidate to CP?
-  if (part != cache_part) {
-    p00cache_invalidate();
-    cache_part = part;
+  unsigned int i;
+
+  part++;
+  i = find_slot(part, cluster);
+
+  if (p00tag[i] == 0) {
+    if (entries >= P00CACHE_LIMIT) {
+      evict_entry();
+      /* the removal may have moved the end of the probe run */
+      i = find_slot(part, cluster);
+    }
+    entries++;
   }
 
-  /* add entry at end of list */
-  p00cache[entries].cluster = cluster;
-  memcpy(p00cache[entries].name, name, CBM_NAME_LENGTH);
-  entries++;
+  p00cache[i].cluster = cluster;
+  p00tag[i]           = part;
+  memcpy(p00cache[i].name, name, CBM_NAME_LENGTH);
+
+  newest_cluster = cluster;
+  newest_part    = part;
+}
+
+unsigned int p00cache_entries(void) {
+  return entries;
+}
+
+unsigned int p00cache_capacity(void) {
+  return P00CACHE_LIMIT;
 }
@@ -32,9 +32,14 @@
 
 #ifdef CONFIG_P00CACHE
 
+extern uint32_t p00cache_hits;
+extern uint32_t p00cache_misses;
+
 void     p00cache_invalidate(void);
 uint8_t *p00cache_lookup(uint8_t part, uint32_t cluster);
 void     p00cache_add(uint8_t part, uint32_t cluster, uint8_t *name);
+unsigned int p00cache_entries(void);
+unsigned int p00cache_capacity(void);
 
 #else
 
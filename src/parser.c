@@ -31,6 +31,8 @@
 #include <stdint.h>
 #include <string.h>
 #include "config.h"
+#include "d64ops.h"
+#include "dircache.h"
 #include "dirent.h"
 #include "display.h"
 #include "eefs-ops.h"
@@ -83,7 +85,7 @@ uint8_t check_invalid_name(uint8_t *name) {
 }
 
 /* Convert a PETSCII character to lower-case */
-static uint8_t tolower_pet(uint8_t c) {
+uint8_t tolower_pet(uint8_t c) {
   if (c >= 0x61 && c <= 0x7a)
     c -= 0x20;
   else if (c >= 0xc1 && c <= 0xda)
@@ -194,6 +196,30 @@ uint8_t match_name(uint8_t *matchstr, cbmdirent_t *dent, uint8_t ignorecase) {
     return 1;
 }
 
+#if defined(CONFIG_D64_DIRINDEX) || defined(CONFIG_FAT_DIRCACHE)
+/**
+ * seek_name - move a directory handle to the next entry with a name
+ * @dh  : directory handle
+ * @name: file name without wildcards
+ *
+ * This function asks the directory index of the file system of @dh for
+ * the next entry that may be called @name. Returns 0 if @dh was moved,
+ * -1 if there are no more entries with this name or 1 if the directory
+ * must be scanned normally.
+ */
+static int8_t seek_name(dh_t *dh, uint8_t *name) {
+#ifdef CONFIG_D64_DIRINDEX
+  if (partition[dh->part].fop == &d64ops)
+    return d64_seek_name(dh, name);
+#endif
+#ifdef CONFIG_FAT_DIRCACHE
+  if (partition[dh->part].fop == &fatops)
+    return dircache_seek_name(dh, name);
+#endif
+  return 1;
+}
+#endif
+
 /**
  * next_match - get next matching directory entry
  * @dh        : directory handle
@@ -211,7 +237,23 @@ uint8_t match_name(uint8_t *matchstr, cbmdirent_t *dent, uint8_t ignorecase) {
 int8_t next_match(dh_t *dh, uint8_t *matchstr, date_t *start, date_t *end, uint8_t type, cbmdirent_t *dent) {
   int8_t res;
 
+#if defined(CONFIG_D64_DIRINDEX) || defined(CONFIG_FAT_DIRCACHE)
+  /* Exact names can be looked up in the directory index */
+  uint8_t indexed = (matchstr && !start && !end &&
+                     !ustrchr(matchstr, '*') && !ustrchr(matchstr, '?'));
+#endif
+
   while (1) {
+#if defined(CONFIG_D64_DIRINDEX) || defined(CONFIG_FAT_DIRCACHE)
+    if (indexed) {
+      res = seek_name(dh, matchstr);
+      if (res < 0)
+        return res;
+      if (res > 0)
+        indexed = 0;
+    }
+#endif
+
     res = readdir(dh, dent);
     if (res == 0) {
       /* Skip if the type doesn't match */
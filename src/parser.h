@@ -46,6 +46,9 @@ void update_current_dir(path_t *path);
 /* Parse a partition number */
 uint8_t parse_partition(uint8_t **buf);
 
+/* Converts a PETSCII character to lower-case */
+uint8_t tolower_pet(uint8_t c);
+
 /* Performs CBM DOS pattern matching */
 uint8_t match_name(uint8_t *matchstr, cbmdirent_t *dent, uint8_t ignorecase);
 
@@ -492,6 +492,143 @@ DSTATUS sd_initialize(BYTE drv) {
 DSTATUS disk_initialize(BYTE drv) __attribute__ ((weak, alias("sd_initialize")));
 
 
+/* Results of receive_block */
+#define BLOCK_OK       0
+#define BLOCK_CRCERROR 1
+#define BLOCK_TIMEOUT  2
+
+#if defined(CONFIG_SD_BLOCKTRANSFER) && defined(HAVE_SPI_DMA)
+/**
+ * receive_blocks - receive consecutive data blocks from the card
+ * @buffer: pointer to the buffer
+ * @count : number of blocks to receive
+ * @done  : number of blocks received with a correct CRC
+ *
+ * This function receives up to count 512 byte data blocks from the
+ * already selected card into buffer. The CRC of each block is
+ * calculated while the DMA receives the next one. Returns BLOCK_OK,
+ * BLOCK_CRCERROR or BLOCK_TIMEOUT like receive_block and stores the
+ * number of blocks that were transferred successfully in done.
+ */
+static uint8_t receive_blocks(BYTE *buffer, uint8_t count, uint8_t *done) {
+  uint16_t recvcrc = 0;
+  uint8_t i;
+
+  *done = 0;
+  for (i = 0; i < count; i++) {
+    /* wait for start block token */
+    if (!expect_byte(0xfe))
+      return BLOCK_TIMEOUT;
+
+    spi_rx_block_start(buffer + 512 * i, 512);
+
+    /* check the previous block while this one is transferred */
+    if (i > 0) {
+      if (crc_xmodem_block(0, buffer + 512 * (i - 1), 512) != recvcrc) {
+        spi_block_wait();
+        return BLOCK_CRCERROR;
+      }
+      *done = i;
+    }
+
+    spi_block_wait();
+    recvcrc = spi_rx_byte() << 8 | spi_rx_byte();
+  }
+
+  if (crc_xmodem_block(0, buffer + 512 * (count - 1), 512) != recvcrc)
+    return BLOCK_CRCERROR;
+
+  *done = count;
+  return BLOCK_OK;
+}
+#else
+/**
+ * receive_block - receive a data block from the card
+ * @buffer: pointer to the buffer
+ *
+ * This function waits for the start block token and receives
+ * one 512 byte data block from the already selected card into
+ * buffer. Returns BLOCK_OK if successful, BLOCK_CRCERROR if the
+ * calculated data CRC does not match the one sent by the card or
+ * BLOCK_TIMEOUT if the card didn't send a start block token.
+ */
+static uint8_t receive_block(BYTE *buffer) {
+  uint16_t crc, recvcrc;
+
+  /* wait for start block token */
+  if (!expect_byte(0xfe))
+    return BLOCK_TIMEOUT;
+
+  /* transfer data */
+  crc = 0;
+#ifdef CONFIG_SD_BLOCKTRANSFER
+  /* transfer data first, calculate CRC afterwards */
+  spi_rx_block(buffer, 512);
+
+  recvcrc = spi_rx_byte() << 8 | spi_rx_byte();
+  crc = crc_xmodem_block(0, buffer, 512);
+#else
+  /* interleave transfer/CRC calculation, AVR-optimized */
+  uint16_t i;
+  uint8_t  tmp;
+  BYTE     *ptr = buffer;
+
+  /* start SPI data exchange */
+  SPDR = 0xff;
+
+  for (i=0; i<512; i++) {
+    /* wait until byte available */
+    loop_until_bit_is_set(SPSR, SPIF);
+    tmp = SPDR;
+    /* transmit the next byte while the current one is processed */
+    SPDR = 0xff;
+
+    *ptr++ = tmp;
+    crc = crc_xmodem_update(crc, tmp);
+  }
+  /* wait for the first CRC byte */
+  loop_until_bit_is_set(SPSR, SPIF);
+
+  recvcrc  = SPDR << 8;
+  recvcrc |= spi_rx_byte();
+#endif
+
+  if (recvcrc != crc)
+    return BLOCK_CRCERROR;
+
+  return BLOCK_OK;
+}
+#endif
+
+/**
+ * stop_transmission - terminate a multiple block read
+ * @drv: drive
+ *
+ * This function sends STOP_TRANSMISSION to the card to end a
+ * READ_MULTIPLE_BLOCK command and waits until the card is no
+ * longer busy. The card stays selected.
+ */
+static void stop_transmission(BYTE drv) {
+  tick_t timeout;
+
+  /* The first byte after the command is a stuff byte that may */
+  /* still contain data bits, so it must not be mistaken for   */
+  /* the response - send_command can't be used here.           */
+  spi_tx_byte(STOP_TRANSMISSION);
+  spi_tx_byte(0);
+  spi_tx_byte(0);
+  spi_tx_byte(0);
+  spi_tx_byte(0);
+  spi_tx_byte(0x61); // precalculated CRC7 for CMD12 with parameter 0
+  spi_rx_byte();
+
+  timeout = getticks() + CARD_TIMEOUT_TICKS;
+  while ((spi_rx_byte() & 0x80) && time_before(getticks(), timeout)) ;
+
+  /* R1b response, wait until the card releases the busy state */
+  while (spi_rx_byte() == 0 && time_before(getticks(), timeout)) ;
+}
+
 /**
  * sd_read - reads sectors from the SD card to buffer
  * @drv   : drive
@@ -501,14 +638,15 @@ DSTATUS disk_initialize(BYTE drv) __attribute__ ((weak, alias("sd_initialize")))
  *
  * This function reads count sectors from the SD card starting
  * at sector to buffer. Returns RES_ERROR if an error occured or
- * RES_OK if successful. Up to SD_AUTO_RETRIES will be made if
- * the calculated data CRC does not match the one sent by the
- * card. If there were errors during the command transmission
- * disk_state will be set to DISK_ERROR and no retries are made.
+ * RES_OK if successful. Multiple sectors are read with a single
+ * READ_MULTIPLE_BLOCK command. Up to SD_AUTO_RETRIES will be made
+ * if the calculated data CRC does not match the one sent by the
+ * card, the transfer is restarted at the sector that failed.
+ * If there were errors during the command transmission disk_state
+ * will be set to DISK_ERROR and no retries are made.
  */
 DRESULT sd_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) {
-  uint8_t  res, sec, errors;
-  uint16_t crc, recvcrc;
+  uint8_t res, cmd, sec, errors;
 
   if (drv >= MAX_CARDS)
     return RES_PARERR;
@@ -517,79 +655,64 @@ DRESULT sd_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) {
   if (cardtype[drv] == CARD_MMCSD)
     sector <<= 9;
 
-  for (sec = 0; sec < count; sec++) {
-    errors = 0;
-    while (errors < CONFIG_SD_AUTO_RETRIES) {
-      /* send read command */
-      if (cardtype[drv] & CARD_SDHC)
-        res = send_command(drv, READ_SINGLE_BLOCK, sector + sec);
-      else
-        res = send_command(drv, READ_SINGLE_BLOCK, sector + (sec << 9));
+  sec    = 0;
+  errors = 0;
+  while (sec < count) {
+    if (count - sec > 1)
+      cmd = READ_MULTIPLE_BLOCK;
+    else
+      cmd = READ_SINGLE_BLOCK;
 
-      /* fail if the command wasn't accepted */
-      if (res != 0) {
-        deselect_card();
-        disk_state = DISK_ERROR;
-        return RES_ERROR;
-      }
+    /* send read command */
+    if (cardtype[drv] & CARD_SDHC)
+      res = send_command(drv, cmd, sector + sec);
+    else
+      res = send_command(drv, cmd, sector + (sec << 9));
 
-      /* wait for start block token */
-      if (!expect_byte(0xfe)) {
-        deselect_card();
-        disk_state = DISK_ERROR;
-        return RES_ERROR;
-      }
+    /* fail if the command wasn't accepted */
+    if (res != 0) {
+      deselect_card();
+      disk_state = DISK_ERROR;
+      return RES_ERROR;
+    }
 
-      /* transfer data */
-      crc = 0;
-#ifdef CONFIG_SD_BLOCKTRANSFER
-      /* transfer data first, calculate CRC afterwards */
-      spi_rx_block(buffer, 512);
+    /* receive blocks until done or until a CRC error occurs */
+#if defined(CONFIG_SD_BLOCKTRANSFER) && defined(HAVE_SPI_DMA)
+    uint8_t done;
 
-      recvcrc = spi_rx_byte() << 8 | spi_rx_byte();
-      crc = crc_xmodem_block(0, buffer, 512);
+    res = receive_blocks(buffer, (cmd == READ_MULTIPLE_BLOCK) ? count - sec : 1, &done);
+    if (done) {
+      buffer += 512 * done;
+      sec    += done;
+      errors  = 0;
+    }
 #else
-      /* interleave transfer/CRC calculation, AVR-optimized */
-      uint16_t i;
-      uint8_t  tmp;
-      BYTE     *ptr = buffer;
-
-      /* start SPI data exchange */
-      SPDR = 0xff;
-
-      for (i=0; i<512; i++) {
-        /* wait until byte available */
-        loop_until_bit_is_set(SPSR, SPIF);
-        tmp = SPDR;
-        /* transmit the next byte while the current one is processed */
-        SPDR = 0xff;
-
-        *ptr++ = tmp;
-        crc = crc_xmodem_update(crc, tmp);
-      }
-      /* wait for the first CRC byte */
-      loop_until_bit_is_set(SPSR, SPIF);
-
-      recvcrc  = SPDR << 8;
-      recvcrc |= spi_rx_byte();
+    do {
+      res = receive_block(buffer);
+      if (res != BLOCK_OK)
+        break;
+
+      buffer += 512;
+      sec++;
+      errors = 0;
+    } while (cmd == READ_MULTIPLE_BLOCK && sec < count);
 #endif
 
-      /* check CRC */
-      if (recvcrc != crc) {
-        uart_putc('X');
-        deselect_card();
-        errors++;
-        continue;
-      }
-
-      break; // FIXME: Ugly control flow
-    }
+    if (cmd == READ_MULTIPLE_BLOCK)
+      stop_transmission(drv);
     deselect_card();
 
-    if (errors >= CONFIG_SD_AUTO_RETRIES)
+    if (res == BLOCK_TIMEOUT) {
+      disk_state = DISK_ERROR;
       return RES_ERROR;
+    }
 
-    buffer += 512;
+    /* retry from the failed sector on */
+    if (res == BLOCK_CRCERROR) {
+      uart_putc('X');
+      if (++errors >= CONFIG_SD_AUTO_RETRIES)
+        return RES_ERROR;
+    }
   }
 
   return RES_OK;
@@ -647,7 +770,12 @@ DRESULT sd_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) {
       spi_tx_byte(0xfe);
 
       /* transfer data */
-#ifdef CONFIG_SD_BLOCKTRANSFER
+#if defined(CONFIG_SD_BLOCKTRANSFER) && defined(HAVE_SPI_DMA)
+      /* calculate the CRC while the DMA sends the data */
+      spi_tx_block_start(buffer, 512);
+      crc = crc_xmodem_block(0, buffer, 512);
+      spi_block_wait();
+#elif defined(CONFIG_SD_BLOCKTRANSFER)
       spi_tx_block(buffer, 512);
       crc = crc_xmodem_block(0, buffer, 512);
 #else
@@ -0,0 +1,96 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+   trace.c: Binary event trace for the bus handlers
+
+   Every event is sent as six bytes: 0x80 plus the event id, the low
+   byte of the tick counter, the subtick counter (low byte first) and
+   both arguments. Regular debug output is plain ASCII, so the set high
+   bit of the first byte marks the start of a record.
+
+*/
+
+#include <stdint.h>
+#include "config.h"
+#include "timer.h"
+#include "uart.h"
+#include "trace.h"
+
+#define TRACE_RECORD_BYTES 6
+
+trace_record_t trace_ring[TRACE_RING_SIZE];
+uint8_t trace_head, trace_tail, trace_lost;
+
+/**
+ * trace_init - initialise the trace ring
+ *
+ * This function empties the trace ring and records a start event that
+ * tells the decoder the length of a tick in subticks.
+ */
+void trace_init(void) {
+  uint16_t period = timer_subticks_per_tick();
+
+  trace_head = trace_tail = trace_lost = 0;
+  trace_event(TRACE_START, period & 0xff, period >> 8);
+}
+
+/**
+ * send_record - copy a trace record into the UART buffer
+ * @rec: record to send
+ */
+static void send_record(trace_record_t *rec) {
+  uart_putc(0x80 | rec->id);
+  uart_putc(rec->tick);
+  uart_putc(rec->subtick & 0xff);
+  uart_putc(rec->subtick >> 8);
+  uart_putc(rec->arg1);
+  uart_putc(rec->arg2);
+}
+
+/**
+ * trace_drain - move trace records to the UART
+ *
+ * This function copies as many trace records into the UART transmit
+ * buffer as fit without waiting, the UART interrupt sends them later.
+ * A notice about dropped events is sent before further records once
+ * the ring has space again.
+ */
+void trace_drain(void) {
+  while (trace_tail != trace_head &&
+         uart_txfree() >= TRACE_RECORD_BYTES) {
+    send_record(&trace_ring[trace_tail]);
+    trace_tail = (trace_tail + 1) & (TRACE_RING_SIZE - 1);
+  }
+
+  if (trace_lost && trace_tail == trace_head &&
+      uart_txfree() >= TRACE_RECORD_BYTES) {
+    trace_record_t rec;
+
+    rec.id      = TRACE_LOST;
+    rec.tick    = (uint8_t)ticks;
+    rec.subtick = timer_subticks();
+    rec.arg1    = trace_lost;
+    rec.arg2    = 0;
+    send_record(&rec);
+    trace_lost  = 0;
+  }
+}
@@ -0,0 +1,125 @@
+/* NODISKEMU - SD/MMC to IEEE-488 interface/controller
+   Copyright (C) 2007-2018  Ingo Korb <ingo@akana.de>
+
+   NODISKEMU is a fork of sd2iec by Ingo Korb (et al.), http://sd2iec.de
+
+   Inspired by MMC2IEC by Lars Pontoppidan et al.
+
+   FAT filesystem access based on code from ChaN and Jim Brain, see ff.c|h.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 of the License only.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+   trace.h: Binary event trace for the bus handlers
+
+   Bus loops can't afford formatted debug output between bytes, so they
+   store small binary records in a ring buffer instead. The ring is
+   drained to the UART when the bus is idle, scripts/decode-trace.pl
+   turns the resulting byte stream back into text.
+
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Event ids - keep in sync with scripts/decode-trace.pl */
+typedef enum {
+  TRACE_START = 0,    // arg1/arg2: subticks per tick, low/high byte
+  TRACE_LOST,         // arg1: number of dropped events
+  TRACE_IDLE,         // bus released
+  TRACE_IFC,          // interface clear
+  TRACE_CMD,          // arg1: command byte received under ATN
+  TRACE_LSN,          // arg1: device, addressed as listener
+  TRACE_TLK,          // arg1: device, addressed as talker
+  TRACE_ULN,          // unlisten
+  TRACE_UTK,          // untalk
+  TRACE_DTA_L,        // arg1: secondary address of data to receive
+  TRACE_DTA_T,        // arg1: secondary address of data to send
+  TRACE_OPN,          // arg1: secondary address
+  TRACE_CLO,          // arg1: secondary address
+  TRACE_UKN,          // arg1: unknown command byte
+  TRACE_LL,           // arg1: secondary address, arg2: listen action
+  TRACE_LL_ABORT,     // arg1: secondary address, arg2: reason
+  TRACE_IGNORE,       // ignoring data until ATN
+  TRACE_TALKLOOP,     // arg1: checkpoint (T0..TA), arg2: secondary address
+  TRACE_RXDATA,       // arg1: data byte, arg2: buffer position
+  TRACE_TXDATA,       // arg1: data byte, arg2: buffer position
+  TRACE_EVENT_COUNT
+} trace_id_t;
+
+/* Reasons for TRACE_LL_ABORT */
+#define TRACE_ABORT_NOBUFFER 0
+#define TRACE_ABORT_REFILL   1
+#define TRACE_ABORT_RELSYNC  2
+
+#ifdef CONFIG_BUS_TRACE
+
+#include "timer.h"
+
+/* Number of events in the ring, must be a power of two */
+#define TRACE_RING_SIZE 32
+
+typedef struct {
+  uint8_t  id;
+  uint8_t  tick;      // low byte of the tick counter
+  uint16_t subtick;   // position within the tick
+  uint8_t  arg1;
+  uint8_t  arg2;
+} trace_record_t;
+
+extern trace_record_t trace_ring[TRACE_RING_SIZE];
+extern uint8_t trace_head, trace_tail, trace_lost;
+
+void trace_init(void);
+void trace_drain(void);
+
+/**
+ * trace_event - store an event in the trace ring
+ * @id  : event id
+ * @arg1: first argument
+ * @arg2: second argument
+ *
+ * This function records an event with the current time in the trace
+ * ring. It never waits, if the ring is full the event is dropped and
+ * counted instead. Must not be called from interrupt handlers.
+ */
+static inline void trace_event(trace_id_t id, uint8_t arg1, uint8_t arg2) {
+  uint8_t next = (trace_head + 1) & (TRACE_RING_SIZE - 1);
+  trace_record_t *rec;
+
+  if (next == trace_tail) {
+    if (trace_lost != 0xff)
+      trace_lost++;
+    return;
+  }
+
+  rec = &trace_ring[trace_head];
+  rec->id      = id;
+  rec->subtick = timer_subticks();
+  rec->tick    = (uint8_t)ticks;
+  rec->arg1    = arg1;
+  rec->arg2    = arg2;
+  trace_head   = next;
+}
+
+#else
+
+static inline void trace_init(void) {}
+static inline void trace_drain(void) {}
+static inline void trace_event(trace_id_t id, uint8_t arg1, uint8_t arg2) {}
+
+#endif
+
+#endif
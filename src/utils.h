@@ -43,6 +43,9 @@
 /* Write a number to a string as ASCII */
 uint8_t *appendnumber(uint8_t *msg, uint8_t value);
 
+/* Write a long number to a string as ASCII without leading zeroes */
+uint8_t *appendlong(uint8_t *msg, uint32_t value);
+
 /* Convert between integer and BCD */
 uint8_t bcd2int(uint8_t value);
 uint8_t int2bcd(uint8_t value);